@@ -0,0 +1,120 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "alloc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace bthelper::alloc {
+
+namespace {
+struct AtomicCounter {
+    std::atomic<uint64_t> allocs{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+};
+
+// Zero initialized before any constructor runs, so usable by
+// allocations during static initialization.
+AtomicCounter counters[static_cast<size_t>(Tag::count_)];
+
+#ifdef ENABLE_ALLOC_STATS
+void count(size_t n)
+{
+    auto& c = counters[static_cast<size_t>(current)];
+    c.allocs.fetch_add(1, std::memory_order_relaxed);
+    c.bytes.fetch_add(n, std::memory_order_relaxed);
+}
+#endif
+} // namespace
+
+#ifdef ENABLE_ALLOC_STATS
+thread_local Tag current = Tag::other;
+#endif
+
+const char* tag_name(Tag t)
+{
+    switch (t) {
+    case Tag::other:
+        return "other";
+    case Tag::loop:
+        return "loop";
+    case Tag::read:
+        return "read";
+    case Tag::buffer:
+        return "buffer";
+    case Tag::write:
+        return "write";
+    case Tag::bench:
+        return "bench";
+    case Tag::count_:
+        break;
+    }
+    return "unknown";
+}
+
+Counters snapshot()
+{
+    Counters ret;
+    for (size_t i = 0; i < ret.size(); i++) {
+        ret[i].allocs = counters[i].allocs.load(std::memory_order_relaxed);
+        ret[i].bytes = counters[i].bytes.load(std::memory_order_relaxed);
+    }
+    return ret;
+}
+
+Counters since(const Counters& before)
+{
+    auto ret = snapshot();
+    for (size_t i = 0; i < ret.size(); i++) {
+        ret[i].allocs -= before[i].allocs;
+        ret[i].bytes -= before[i].bytes;
+    }
+    return ret;
+}
+
+} // namespace bthelper::alloc
+
+#ifdef ENABLE_ALLOC_STATS
+// The other forms (arrays, nothrow) are implemented by the standard
+// library in terms of these. Sized delete is too, but defining the
+// unsized ones alone draws -Wsized-deallocation.
+void* operator new(std::size_t n)
+{
+    bthelper::alloc::count(n);
+    if (auto p = std::malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t n, std::align_val_t al)
+{
+    bthelper::alloc::count(n);
+    void* p = nullptr;
+    const auto align = std::max(sizeof(void*), static_cast<size_t>(al));
+    if (posix_memalign(&p, align, n ? n : 1)) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+#endif
@@ -0,0 +1,96 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Heap allocation accounting.
+ *
+ * With ./configure --enable-alloc-stats, the global operator new is
+ * replaced by one that counts allocations and bytes against the tag of
+ * the innermost Scope on the calling thread. Without it, Scope does
+ * nothing and all counters stay zero.
+ *
+ * Forwarding data shouldn't allocate once buffers have grown to their
+ * working size, and bt-replay -a checks that it doesn't.
+ *
+ * Usage:
+ *   alloc::Scope scope(alloc::Tag::buffer);
+ */
+#ifndef __INCLUDE_ALLOC_H__
+#define __INCLUDE_ALLOC_H__
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace bthelper::alloc {
+
+enum class Tag {
+    other,  // Anything not in a scope, e.g. setup.
+    loop,   // Shuffler's own bookkeeping.
+    read,   // read() and on_read callbacks.
+    buffer, // Buffer::write(), e.g. telnet encoding and decoding.
+    write,  // write() and Buffer::ack().
+    bench,  // Benchmark harness, not counted as forwarding.
+    count_,
+};
+
+#ifdef ENABLE_ALLOC_STATS
+constexpr bool enabled = true;
+#else
+constexpr bool enabled = false;
+#endif
+
+const char* tag_name(Tag t);
+
+struct Counter {
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+};
+using Counters = std::array<Counter, static_cast<size_t>(Tag::count_)>;
+
+// Totals so far, for all threads.
+Counters snapshot();
+
+// What was allocated between two snapshots.
+Counters since(const Counters& before);
+
+#ifdef ENABLE_ALLOC_STATS
+extern thread_local Tag current;
+
+// Count allocations on this thread against tag, until destroyed.
+class Scope
+{
+public:
+    explicit Scope(Tag tag) : prev_(current) { current = tag; }
+    ~Scope() { current = prev_; }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const Tag prev_;
+};
+#else
+class Scope
+{
+public:
+    explicit Scope(Tag) {}
+};
+#endif
+
+} // namespace bthelper::alloc
+#endif
@@ -13,8 +13,14 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#include "capture.h"
 #include "common.h"
+#include "connect.h"
+#include "log.h"
+#include "predict.h"
 #include "shuffle.h"
+#include "transfer.h"
+#include "tune.h"
 
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -22,12 +28,14 @@ limitations under the License.
 
 #include <signal.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include <system_error>
 #include <cstdio>
 #include <cstring>
+#include <initializer_list>
 #include <ios>
 #include <iostream>
 #include <memory>
@@ -44,20 +52,38 @@ constexpr uint8_t escape = 0x1d; // ^]
 void usage(const char* av0, int err)
 {
     fprintf(stderr,
-            "Usage: %s [ -ht ] <bluetooth destination> <channel>\n"
+            "Usage: %s [ -hPtvx ] [ -p <profile> ] [ -r <bytes/s> ] [ -w <capture file> ] "
+            "[ -u <file> | -d <file> ] "
+            "<bluetooth destination> <channel>\n"
+            "       %s [ options ] <destination>/<channel> [ <destination>/<channel> ... ]\n"
             "  Options:\n"
+            "    -d       Download this file from a listener in transfer mode.\n"
             "    -h       Show this help.\n"
+            "    -p       Socket tuning profile: default, interactive or bulk.\n"
+            "    -P       Predictive local echo, for slow links. Requires -t.\n"
+            "    -r       Limit sending to this many bytes per second.\n"
             "    -t       Use a raw terminal. E.g. when the other side is a getty.\n"
-            "             Press ^] to abort.\n",
+            "             Press ^] to abort.\n"
+            "    -u       Upload this file to a listener in transfer mode.\n"
+            "    -v       Increase verbosity.\n"
+            "    -w       Record timing and size of all reads to a capture file.\n"
+            "    -x       Include the data in the capture file.\n"
+            "\n"
+            "With several destinations, all are tried at the same time and the\n"
+            "first to connect is used. A destination can also be unix:<path>,\n"
+            "e.g. for bt-linkemu.\n",
+            av0,
             av0);
     exit(err);
 }
 
-int setup_signalfd()
+int setup_signalfd(std::initializer_list<int> signals)
 {
     sigset_t mask;
     sigemptyset(&mask);
-    sigaddset(&mask, SIGWINCH);
+    for (const auto sig : signals) {
+        sigaddset(&mask, sig);
+    }
     const int fd = signalfd(-1, &mask, SFD_NONBLOCK);
     if (-1 == fd) {
         throw std::system_error(errno, std::generic_category(), "signalfd()");
@@ -77,13 +103,59 @@ void sigint_handler(int)
     exit(1);
 }
 
-void send_window(int terminal, TelnetEncoderBuffer* buf)
+void send_window(int terminal, TelnetEncoderBuffer* buf, PredictEchoBuffer* pred)
 {
     struct winsize ws;
     if (-1 == ioctl(terminal, TIOCGWINSZ, reinterpret_cast<char*>(&ws))) {
-        perror("ioctl");
+        LOG(warning) << "ioctl(TIOCGWINSZ): " << strerror(errno);
     } else {
         buf->window_size(ws.ws_row, ws.ws_col);
+        if (pred) {
+            pred->set_width(ws.ws_col);
+        }
+    }
+}
+
+// Periodic timer, to expire unconfirmed predictions.
+int setup_timerfd()
+{
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (-1 == fd) {
+        throw std::system_error(errno, std::generic_category(), "timerfd_create()");
+    }
+    struct itimerspec its {
+    };
+    its.it_interval.tv_nsec = 250000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, nullptr)) {
+        close(fd);
+        throw std::system_error(errno, std::generic_category(), "timerfd_settime()");
+    }
+    return fd;
+}
+
+// Log why a stream ended. Only the stream that failed reports it, not
+// the others on the same fd.
+void log_close(CloseReason why, std::error_code err)
+{
+    switch (why) {
+    case CloseReason::eof:
+    case CloseReason::fd_error:
+    case CloseReason::removed:
+        return;
+    case CloseReason::exception:
+        LOG(debug) << "Exceptional condition on fd";
+        return;
+    case CloseReason::read_error:
+    case CloseReason::write_error:
+        break;
+    }
+    // Actually a normal way for the connection to end. This is for the
+    // user at the terminal, not the log, so show it at any verbosity.
+    if (err == std::errc::connection_reset) {
+        std::cerr << "<Disconnected>\n\r";
+    } else {
+        LOG(warning).kv("reason", close_reason_name(why)) << err.message();
     }
 }
 
@@ -103,100 +175,220 @@ void set_raw_terminal(int terminal)
 int wrapmain(int argc, char** argv)
 {
     bool do_terminal = false;
+    bool do_predict = false;
+    int verbose = 0;
+    std::string capture_file;
+    bool capture_payload = false;
+    double rate_limit = 0;
+    std::string upload;
+    std::string download;
+    const Profile* profile = &default_profile();
     {
         int opt;
-        while ((opt = getopt(argc, argv, "ht")) != -1) {
+        while ((opt = getopt(argc, argv, "d:hp:Pr:tu:vw:x")) != -1) {
             switch (opt) {
+            case 'd':
+                download = optarg;
+                break;
             case 'h':
                 usage(argv[0], EXIT_SUCCESS);
+            case 'p':
+                profile = find_profile(optarg);
+                if (!profile) {
+                    fprintf(stderr, "Unknown profile <%s>. Available:", optarg);
+                    for (const auto& name : profile_names()) {
+                        fprintf(stderr, " %s", name.c_str());
+                    }
+                    fprintf(stderr, "\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                do_predict = true;
+                break;
+            case 'r': {
+                char* end = nullptr;
+                rate_limit = strtod(optarg, &end);
+                if (*end || rate_limit < 0) {
+                    fprintf(stderr, "Invalid rate limit <%s>\n", optarg);
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            }
             case 't':
                 do_terminal = true;
                 break;
+            case 'u':
+                upload = optarg;
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case 'w':
+                capture_file = optarg;
+                break;
+            case 'x':
+                capture_payload = true;
+                break;
             default:
                 usage(argv[0], EXIT_FAILURE);
             }
         }
     }
 
-    if (optind + 2 != argc) {
-        fprintf(stderr, "Need exactly two args, the destination and the channel\n");
+    if (optind == argc) {
+        fprintf(stderr, "Need a destination\n");
+        usage(argv[0], EXIT_FAILURE);
+    }
+    if (do_predict && !do_terminal) {
+        fprintf(stderr, "Predictive echo (-P) only works in terminal mode (-t)\n");
         usage(argv[0], EXIT_FAILURE);
     }
 
-    // Args.
-    const std::string addrs = argv[optind];
-    const std::string chans = argv[optind + 1];
-    int channel;
-    {
-        const auto ch_ok = xatoi(chans.c_str());
-        if (!ch_ok.second) {
-            fprintf(stderr, "Unable to parse channel number: %s\n", chans.c_str());
-            exit(EXIT_FAILURE);
-        }
-        channel = ch_ok.first;
+    if (!upload.empty() + !download.empty() + do_terminal > 1) {
+        fprintf(stderr, "Only one of -d, -t and -u may be given\n");
+        usage(argv[0], EXIT_FAILURE);
     }
 
-    int sock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+    log::set_level(log::verbosity(verbose));
 
-    // Bind to zeroes.
-    struct sockaddr_rc laddr {
-    };
-    laddr.rc_family = AF_BLUETOOTH;
-    if (bind(sock, reinterpret_cast<sockaddr*>(&laddr), sizeof(laddr))) {
-        perror("bind()");
-        close(sock);
-        return EXIT_FAILURE;
+    // Args. Either "<addr> <channel>", or one or more "<addr>/<channel>".
+    std::vector<Candidate> cands;
+    if (optind + 2 == argc && std::string(argv[optind]).find('/') == std::string::npos) {
+        Candidate c;
+        if (!parse_candidate(argv[optind], argv[optind + 1], &c)) {
+            fprintf(stderr,
+                    "Failed to parse <%s> <%s> as bluetooth address and channel\n",
+                    argv[optind],
+                    argv[optind + 1]);
+            return EXIT_FAILURE;
+        }
+        cands.push_back(c);
+    } else {
+        for (int i = optind; i < argc; i++) {
+            Candidate c;
+            if (!parse_candidate(argv[i], &c)) {
+                fprintf(stderr,
+                        "Failed to parse <%s> as <address>/<channel> or unix:<path>\n",
+                        argv[i]);
+                return EXIT_FAILURE;
+            }
+            cands.push_back(c);
+        }
     }
 
     // Connect to remote end.
-    struct sockaddr_rc addr {
-    };
-    addr.rc_family = AF_BLUETOOTH;
-    if (!parse_addr(addrs, &addr.rc_bdaddr)) {
-        fprintf(stderr, "Failed to parse <%s> as a bluetooth address\n", addrs.c_str());
+    const auto race = race_connect(cands);
+    if (race.sock == -1) {
+        LOG(error) << "Failed to connect to any of " << cands.size() << " candidates";
         return EXIT_FAILURE;
     }
-    addr.rc_channel = channel;
-    if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
-        perror("connect()");
-        return EXIT_FAILURE;
+    const int sock = race.sock;
+    const auto connected = std::chrono::steady_clock::now();
+    LOG(debug).kv("candidate", cands[race.winner].name)
+        .kv("connect_ms",
+            std::chrono::duration_cast<std::chrono::milliseconds>(race.elapsed).count())
+        << "Connected";
+
+    tune_rfcomm(sock, *profile);
+    if (!upload.empty() || !download.empty()) {
+        const bool ok = upload.empty() ? pull_file(sock, download) : push_file(sock, upload);
+        close(sock);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    const auto opts = stream_options(*profile, rfcomm_mtu(sock));
+    auto rx_opts = opts;
+    auto tx_opts = opts;
+    tx_opts.rate = rate_limit;
+    tx_opts.on_close = rx_opts.on_close = log_close;
+    std::unique_ptr<CaptureWriter> capture;
+    if (!capture_file.empty()) {
+        capture = std::make_unique<CaptureWriter>(capture_file, capture_payload);
+        rx_opts.on_read = capture->observer(dir_from_bt);
+        tx_opts.on_read = capture->observer(dir_to_bt);
     }
+    rx_opts.on_read = [next = rx_opts.on_read, connected, first = true](
+                          std::string_view data) mutable {
+        if (first) {
+            first = false;
+            LOG(debug).kv("ttfb_ms",
+                          std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - connected)
+                              .count())
+                << "First byte received";
+        }
+        if (next) {
+            next(data);
+        }
+    };
 
     Shuffler shuf;
 
+    // Stop cleanly on SIGINT and SIGTERM while capturing, so that the
+    // end of the capture is written out.
+    int stop_signal = 0;
+    if (capture) {
+        const auto exitfd = setup_signalfd({ SIGINT, SIGTERM });
+        shuf.watch(exitfd, [exitfd, &shuf, &stop_signal](int) {
+            struct signalfd_siginfo si;
+            if (read(exitfd, &si, sizeof si) == sizeof si) {
+                stop_signal = si.ssi_signo;
+                shuf.stop();
+            }
+        });
+    }
+
     if (do_terminal) {
         auto txbuf = std::make_unique<TelnetEncoderBuffer>();
-        send_window(STDIN_FILENO, txbuf.get());
+        std::unique_ptr<PredictEchoBuffer> rxbuf;
+        if (do_predict) {
+            rxbuf = std::make_unique<PredictEchoBuffer>();
+        }
+        const auto enc = txbuf.get();
+        const auto nonce = enc->hello();
+        send_window(STDIN_FILENO, enc, rxbuf.get());
 
-        auto sigfd = setup_signalfd();
-        shuf.watch(sigfd, [sigfd, txbuf = txbuf.get()](int) {
-            send_window(STDIN_FILENO, txbuf);
+        auto sigfd = setup_signalfd({ SIGWINCH });
+        shuf.watch(sigfd, [sigfd, txbuf = txbuf.get(), pred = rxbuf.get()](int) {
+            send_window(STDIN_FILENO, txbuf, pred);
             struct signalfd_siginfo tmp;
             if (-1 == read(sigfd, &tmp, sizeof tmp)) {
-                perror("read(signalfd)");
+                LOG(warning) << "read(signalfd): " << strerror(errno);
             }
         });
 
         signal(SIGINT, sigint_handler);
         set_raw_terminal(STDIN_FILENO);
 
-        // shuf.copy(sock, STDOUT_FILENO, std::make_unique<TelnetEncoderBuffer>());
-        shuf.copy(sock, STDOUT_FILENO);
-        shuf.copy(STDIN_FILENO, sock, std::move(txbuf), escape);
-    } else {
-        shuf.copy(sock, STDOUT_FILENO);
-        shuf.copy(STDIN_FILENO, sock);
-    }
-
-    try {
-        shuf.run();
-    } catch (const std::system_error& e) {
-        // Actually a normal way for the connection to end.
-        if (e.code() == std::errc::connection_reset) {
-            std::cerr << "<Disconnected>\n\r";
-        } else {
-            throw;
+        std::unique_ptr<Buffer> tx = std::move(txbuf);
+        if (rxbuf) {
+            const auto timerfd = setup_timerfd();
+            shuf.watch(timerfd, [timerfd, pred = rxbuf.get()](int) {
+                uint64_t tmp;
+                if (-1 == read(timerfd, &tmp, sizeof tmp)) {
+                    LOG(warning) << "read(timerfd): " << strerror(errno);
+                }
+                pred->tick();
+            });
+            tx = std::make_unique<KeystrokeTap>(std::move(tx), rxbuf.get());
+        }
+
+        // Switch to v2 framing if the listener replies to the hello.
+        std::unique_ptr<Buffer> rx = std::move(rxbuf);
+        if (!rx) {
+            rx = std::make_unique<RawBuffer>();
         }
+        rx = std::make_unique<HelloReplyTap>(std::move(rx), nonce, [enc] {
+            LOG(debug) << "Listener supports v2 framing";
+            enc->use_frames();
+        });
+        shuf.copy(sock, STDOUT_FILENO, std::move(rx), -1, rx_opts);
+        shuf.copy(STDIN_FILENO, sock, std::move(tx), escape, tx_opts);
+    } else {
+        shuf.copy(sock, STDOUT_FILENO, nullptr, -1, rx_opts);
+        shuf.copy(STDIN_FILENO, sock, nullptr, -1, tx_opts);
     }
-    return EXIT_SUCCESS;
+
+    shuf.run();
+    return stop_signal ? 128 + stop_signal : EXIT_SUCCESS;
 }
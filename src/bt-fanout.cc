@@ -0,0 +1,370 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Run the same command on many devices at once.
+ *
+ * Connects to each target like bt-connecter, up to -j at a time, all in
+ * one event loop. The command is sent as one line, and everything the
+ * device sends back until it closes the connection is collected. The
+ * listener on the device decides what the line means, e.g.:
+ *
+ *   bt-listener -c 4 -e -- sh -c 'read -r cmd; eval "$cmd"'
+ */
+#include "common.h"
+#include "connect.h"
+#include "coro.h"
+#include "log.h"
+#include "shuffle.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace bthelper;
+
+namespace {
+[[noreturn]] void usage(const char* av0, int err)
+{
+    fprintf(stderr,
+            "Usage: %s [ -hv ] [ -c <command> ] [ -f <file> ] [ -j <jobs> ] "
+            "[ -o <dir> ] [ -t <seconds> ] [ <destination>/<channel> ... ]\n"
+            "  Options:\n"
+            "    -c       Send this line to each device.\n"
+            "    -f       Read more targets from this file, one per line.\n"
+            "    -h       Show this help.\n"
+            "    -j       Connections at the same time. Default 8.\n"
+            "    -o       Write each device's output to <dir>/<target>.out,\n"
+            "             instead of to stdout.\n"
+            "    -t       Give up on a device after this long. Default 60.\n"
+            "    -v       Increase verbosity.\n"
+            "\n"
+            "A target can also be unix:<path>, e.g. for bt-linkemu.\n",
+            av0);
+    exit(err);
+}
+
+struct Result {
+    Candidate cand;
+    int sock = -1;
+    bool done = false;
+    bool ok = false;
+    bool timed_out = false;
+    std::string status = "pending";
+    std::string output;
+    Shuffler::clock::time_point start;
+    Shuffler::clock::time_point connected;
+    Shuffler::clock::time_point end;
+};
+
+Shuffler shuf;
+std::vector<Result> results;
+std::string command;
+std::string outdir;
+size_t jobs = 8;
+Shuffler::clock::duration timeout = std::chrono::seconds(60);
+Shuffler::clock::time_point t0;
+size_t next_target = 0;
+size_t running = 0;
+size_t finished = 0;
+
+long long to_ms(Shuffler::clock::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+}
+
+// A file name for a target, e.g. unix:/tmp/a.sock -> unix:_tmp_a.sock.
+std::string file_name(const std::string& name)
+{
+    auto ret = name;
+    std::replace(ret.begin(), ret.end(), '/', '_');
+    return ret;
+}
+
+// Show or save a device's output, as soon as it's done.
+void report(const Result& r)
+{
+    const auto connect_ms =
+        r.connected == Shuffler::clock::time_point{} ? -1 : to_ms(r.connected - r.start);
+    LOG(info)
+        .kv("target", r.cand.name)
+        .kv("status", r.status)
+        .kv("bytes", r.output.size())
+        .kv("connect_ms", connect_ms)
+        .kv("total_ms", to_ms(r.end - r.start))
+        << "Target done";
+    if (outdir.empty()) {
+        std::cout << "==> " << r.cand.name << ": " << r.status << ", " << r.output.size()
+                  << " bytes in " << to_ms(r.end - r.start) << " ms <==\n"
+                  << r.output;
+        if (!r.output.empty() && r.output.back() != '\n') {
+            std::cout << "\n";
+        }
+        std::cout << std::flush;
+        return;
+    }
+    const auto fn = outdir + "/" + file_name(r.cand.name) + ".out";
+    std::ofstream f(fn, std::ios::binary);
+    f << r.output;
+    if (!f) {
+        LOG(error).kv("file", fn) << "Failed to write output: " << strerror(errno);
+    }
+}
+
+void launch();
+
+void finish(size_t i)
+{
+    auto& r = results[i];
+    r.end = Shuffler::clock::now();
+    r.done = true;
+    if (r.timed_out) {
+        r.ok = false;
+        r.status = "timeout";
+    }
+    if (r.sock >= 0) {
+        close(r.sock);
+        r.sock = -1;
+    }
+    report(r);
+    running--;
+    finished++;
+    if (finished == results.size()) {
+        // Don't wait for the timeouts.
+        shuf.stop();
+        return;
+    }
+    launch();
+}
+
+coro::Task<void> run_one(size_t i)
+{
+    auto& r = results[i];
+    r.start = Shuffler::clock::now();
+    shuf.at(r.start + timeout, [i] {
+        auto& r = results[i];
+        if (!r.done && r.sock >= 0) {
+            // Wakes up the connect or read in progress.
+            r.timed_out = true;
+            shutdown(r.sock, SHUT_RDWR);
+        }
+    });
+
+    r.sock = start_connect(r.cand);
+    if (r.sock == -1) {
+        r.status = strerror(errno);
+        finish(i);
+        co_return;
+    }
+    co_await coro::writable(shuf, r.sock);
+    if (const int err = finish_connect(r.sock)) {
+        r.status = strerror(err);
+        finish(i);
+        co_return;
+    }
+    // finish_connect() made it blocking again.
+    fcntl(r.sock, F_SETFL, fcntl(r.sock, F_GETFL) | O_NONBLOCK);
+    r.connected = Shuffler::clock::now();
+    LOG(debug).kv("target", r.cand.name).kv("connect_ms", to_ms(r.connected - r.start))
+        << "Connected";
+
+    if (!command.empty()) {
+        const auto w = co_await coro::async_write(shuf, r.sock, command + "\n");
+        if (!w.ok()) {
+            r.status = w.err.message();
+            finish(i);
+            co_return;
+        }
+    }
+    std::array<char, 4096> buf;
+    for (;;) {
+        const auto rd = co_await coro::async_read(shuf, r.sock, buf.data(), buf.size());
+        // RFCOMM reports the other end closing as a reset.
+        if (!rd.ok() && rd.err != std::errc::connection_reset) {
+            r.status = rd.err.message();
+            break;
+        }
+        if (!rd.n) {
+            r.ok = true;
+            r.status = "ok";
+            break;
+        }
+        r.output.append(buf.data(), rd.n);
+    }
+    finish(i);
+}
+
+// Start connections until there are -j of them.
+void launch()
+{
+    while (running < jobs && next_target < results.size()) {
+        running++;
+        coro::spawn(run_one(next_target++));
+    }
+}
+
+// Nearest rank percentile of sorted values.
+Shuffler::clock::duration percentile(const std::vector<Shuffler::clock::duration>& sorted,
+                                     double p)
+{
+    const auto rank = static_cast<size_t>(p * sorted.size() + 0.999999);
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+void summary()
+{
+    std::vector<Shuffler::clock::duration> done_at;
+    uint64_t bytes = 0;
+    size_t ok = 0;
+    for (const auto& r : results) {
+        done_at.push_back(r.end - t0);
+        bytes += r.output.size();
+        ok += r.ok;
+    }
+    std::sort(done_at.begin(), done_at.end());
+    const auto wall = Shuffler::clock::now() - t0;
+    const auto secs = std::chrono::duration<double>(wall).count();
+    LOG(info)
+        .kv("targets", results.size())
+        .kv("ok", ok)
+        .kv("failed", results.size() - ok)
+        .kv("bytes", bytes)
+        .kv("wall_ms", to_ms(wall))
+        .kv("bytes_per_s", static_cast<long long>(secs > 0 ? bytes / secs : 0))
+        .kv("p50_ms", to_ms(percentile(done_at, 0.5)))
+        .kv("p90_ms", to_ms(percentile(done_at, 0.9)))
+        .kv("max_ms", to_ms(done_at.back()))
+        << "All done";
+}
+
+// Targets from a file, one per line, with # comments.
+std::vector<std::string> read_targets(const char* av0, const std::string& fn)
+{
+    std::ifstream f(fn);
+    if (!f) {
+        std::cerr << av0 << ": failed to open " << fn << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    std::vector<std::string> ret;
+    std::string line;
+    while (std::getline(f, line)) {
+        std::istringstream in(line.substr(0, line.find('#')));
+        for (std::string t; in >> t;) {
+            ret.push_back(t);
+        }
+    }
+    return ret;
+}
+} // namespace
+
+int wrapmain(int argc, char** argv)
+{
+    int verbose = 0;
+    std::vector<std::string> targets;
+    {
+        int opt;
+        while ((opt = getopt(argc, argv, "c:f:hj:o:t:v")) != -1) {
+            switch (opt) {
+            case 'c':
+                command = optarg;
+                break;
+            case 'f':
+                for (const auto& t : read_targets(argv[0], optarg)) {
+                    targets.push_back(t);
+                }
+                break;
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+            case 'j': {
+                const auto j = xatoi(optarg);
+                if (!j.second || j.first < 1) {
+                    fprintf(stderr, "Invalid -j <%s>\n", optarg);
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                jobs = j.first;
+                break;
+            }
+            case 'o':
+                outdir = optarg;
+                break;
+            case 't': {
+                char* end = nullptr;
+                const auto t = strtod(optarg, &end);
+                if (*end || t <= 0) {
+                    fprintf(stderr, "Invalid -t <%s>\n", optarg);
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                timeout = std::chrono::duration_cast<Shuffler::clock::duration>(
+                    std::chrono::duration<double>(t));
+                break;
+            }
+            case 'v':
+                verbose++;
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+            }
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        targets.push_back(argv[i]);
+    }
+    if (targets.empty()) {
+        fprintf(stderr, "Need at least one target\n");
+        usage(argv[0], EXIT_FAILURE);
+    }
+    for (const auto& t : targets) {
+        Result r;
+        if (!parse_candidate(t, &r.cand)) {
+            fprintf(stderr,
+                    "Failed to parse <%s> as <address>/<channel> or unix:<path>\n",
+                    t.c_str());
+            return EXIT_FAILURE;
+        }
+        results.push_back(std::move(r));
+    }
+    if (!outdir.empty()) {
+        struct stat st;
+        if (stat(outdir.c_str(), &st) || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "Output directory <%s> doesn't exist\n", outdir.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+    log::set_level(log::verbosity(verbose));
+
+    t0 = Shuffler::clock::now();
+    launch();
+    if (finished < results.size()) {
+        shuf.run();
+    }
+    summary();
+    return finished == results.size()
+                   && std::all_of(results.begin(),
+                                  results.end(),
+                                  [](const Result& r) { return r.ok; })
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+}
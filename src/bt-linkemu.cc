@@ -0,0 +1,320 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Run real bt-connecter and bt-listener data paths over an emulated
+ * RFCOMM link. See linkemu.h for the link model.
+ *
+ * Listens on a Unix socket, which bt-connecter can connect to as
+ * "unix:<path>". Each connection is passed over the emulated link to
+ * either a Unix socket (-C), or to a command started for it with the
+ * other end on stdin (e.g. bt-listener -i).
+ */
+#include "linkemu.h"
+#include "log.h"
+#include "shuffle.h"
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace bthelper;
+
+namespace {
+[[noreturn]] void usage(const char* av0, int err)
+{
+    fprintf(stderr,
+            "Usage: %s [ -1hv ] [ -b <bytes/s> ] [ -j <ms> ] [ -l <ms> ] [ -m <mtu> ] "
+            "[ -o <bytes> ] [ -s <seed> ] [ -w <bytes> ]\n"
+            "       -L <path> ( -C <path> | <command> ... )\n"
+            "  Options:\n"
+            "    -1       Exit after the first connection.\n"
+            "    -b       Link rate, counting frame overhead. 0 is unlimited.\n"
+            "             Default 100000.\n"
+            "    -C       Connect each link to this Unix socket.\n"
+            "    -h       Show this help.\n"
+            "    -j       Max jitter added to each frame. Default 5.\n"
+            "    -l       One way latency. Default 20.\n"
+            "    -L       Listen on this Unix socket.\n"
+            "    -m       Max payload per frame. Default %zu.\n"
+            "    -o       Overhead per frame. Default 13.\n"
+            "    -s       Seed for the jitter. Default 1.\n"
+            "    -v       Increase verbosity.\n"
+            "    -w       Max bytes read but not yet delivered, per direction.\n"
+            "             0 is unlimited. Default %zu.\n"
+            "\n"
+            "Without -C, the command is started for each connection, with the\n"
+            "other end of the link on stdin, e.g.: bt-listener -i -t localhost:22\n",
+            av0,
+            RFCOMM_DEFAULT_MTU,
+            LinkParams{}.window);
+    exit(err);
+}
+
+struct Link {
+    int a = -1;
+    int b = -1;
+    std::unique_ptr<LinkEmulator> emu;
+};
+
+Shuffler shuf;
+LinkParams params;
+std::map<int, Link> links;
+int next_id = 0;
+bool once = false;
+int listen_sock = -1;
+std::string connect_path;
+std::vector<std::string> command;
+
+sockaddr_un unix_addr(const std::string& path)
+{
+    struct sockaddr_un sa {
+    };
+    sa.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(sa.sun_path)) {
+        throw std::invalid_argument("Unix socket path too long: " + path);
+    }
+    strcpy(sa.sun_path, path.c_str());
+    return sa;
+}
+
+int unix_listen(const std::string& path)
+{
+    struct stat st;
+    if (!stat(path.c_str(), &st) && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        throw std::system_error(errno, std::generic_category(), "socket()");
+    }
+    const auto sa = unix_addr(path);
+    if (bind(sock, reinterpret_cast<const sockaddr*>(&sa), sizeof(sa))) {
+        throw std::system_error(errno, std::generic_category(), "bind(" + path + ")");
+    }
+    if (listen(sock, 10)) {
+        throw std::system_error(errno, std::generic_category(), "listen()");
+    }
+    return sock;
+}
+
+// The far end of a new link, or -1.
+int open_far_end()
+{
+    if (!connect_path.empty()) {
+        const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock == -1) {
+            LOG(error) << "socket(): " << strerror(errno);
+            return -1;
+        }
+        const auto sa = unix_addr(connect_path);
+        if (connect(sock, reinterpret_cast<const sockaddr*>(&sa), sizeof(sa))) {
+            LOG(error).kv("path", connect_path) << "connect(): " << strerror(errno);
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+        LOG(error) << "socketpair(): " << strerror(errno);
+        return -1;
+    }
+    const auto pid = fork();
+    if (pid == -1) {
+        LOG(error) << "fork(): " << strerror(errno);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (!pid) {
+        log::forked_child();
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        if (dup2(sv[1], STDIN_FILENO) == -1) {
+            LOG(error) << "dup2(): " << strerror(errno);
+            _exit(EXIT_FAILURE);
+        }
+        std::vector<char*> args;
+        for (auto& a : command) {
+            args.push_back(a.data());
+        }
+        args.push_back(nullptr);
+        execvp(args[0], args.data());
+        LOG(error).kv("cmd", args[0]) << "exec(): " << strerror(errno);
+        _exit(EXIT_FAILURE);
+    }
+    close(sv[1]);
+    return sv[0];
+}
+
+long long to_us(Shuffler::clock::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+void log_stats(int id, const char* dir, const LinkStats& s)
+{
+    LOG(info)
+        .kv("link", id)
+        .kv("dir", dir)
+        .kv("bytes", s.bytes)
+        .kv("frames", s.frames)
+        .kv("delay_avg_us", s.frames ? to_us(s.delay_sum) / s.frames : 0)
+        .kv("delay_max_us", to_us(s.delay_max))
+        << "Link closed";
+}
+
+void finish(int id)
+{
+    const auto it = links.find(id);
+    auto& l = it->second;
+    log_stats(id, "a_to_b", l.emu->a_to_b());
+    log_stats(id, "b_to_a", l.emu->b_to_a());
+    close(l.a);
+    close(l.b);
+    links.erase(it);
+    if (once && links.empty()) {
+        shuf.stop();
+    }
+}
+
+void accept_link(int)
+{
+    const int con = accept4(listen_sock, nullptr, nullptr, SOCK_CLOEXEC);
+    if (con == -1) {
+        LOG(warning) << "accept(): " << strerror(errno);
+        return;
+    }
+    const int far = open_far_end();
+    if (far == -1) {
+        close(con);
+        return;
+    }
+    if (once) {
+        shuf.unwatch(listen_sock);
+        close(listen_sock);
+    }
+
+    // Same seeds for the same sequence of connections.
+    const int id = next_id++;
+    auto p = params;
+    p.seed += id;
+    LOG(debug).kv("link", id).kv("seed", p.seed) << "Link up";
+    auto& l = links[id];
+    l.a = con;
+    l.b = far;
+    l.emu = std::make_unique<LinkEmulator>(shuf, con, far, p, [id] {
+        shuf.at(Shuffler::clock::now(), [id] { finish(id); });
+    });
+}
+
+// Parse a non-negative number option.
+double number(const char* av0, int opt, const char* arg)
+{
+    char* end = nullptr;
+    const auto v = strtod(arg, &end);
+    if (*end || v < 0) {
+        fprintf(stderr, "Invalid -%c <%s>\n", opt, arg);
+        usage(av0, EXIT_FAILURE);
+    }
+    return v;
+}
+} // namespace
+
+int wrapmain(int argc, char** argv)
+{
+    int verbose = 0;
+    std::string listen_path;
+    {
+        int opt;
+        while ((opt = getopt(argc, argv, "+1b:C:hj:l:L:m:o:s:vw:")) != -1) {
+            switch (opt) {
+            case '1':
+                once = true;
+                break;
+            case 'b':
+                params.rate = number(argv[0], opt, optarg);
+                break;
+            case 'C':
+                connect_path = optarg;
+                break;
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+            case 'j':
+                params.jitter = std::chrono::microseconds(
+                    static_cast<long long>(number(argv[0], opt, optarg) * 1000));
+                break;
+            case 'l':
+                params.latency = std::chrono::microseconds(
+                    static_cast<long long>(number(argv[0], opt, optarg) * 1000));
+                break;
+            case 'L':
+                listen_path = optarg;
+                break;
+            case 'm':
+                params.mtu = number(argv[0], opt, optarg);
+                if (!params.mtu) {
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                params.overhead = number(argv[0], opt, optarg);
+                break;
+            case 's':
+                params.seed = number(argv[0], opt, optarg);
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case 'w':
+                params.window = number(argv[0], opt, optarg);
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+            }
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        command.push_back(argv[i]);
+    }
+    if (listen_path.empty() || connect_path.empty() == command.empty()) {
+        fprintf(stderr, "Need -L, and one of -C or a command\n");
+        usage(argv[0], EXIT_FAILURE);
+    }
+    log::set_level(log::verbosity(verbose));
+
+    // Reap command children automatically, and get EPIPE instead of
+    // dying. Both are reset in the children.
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_sock = unix_listen(listen_path);
+    LOG(debug).kv("path", listen_path) << "Listening…";
+    shuf.persist(true);
+    shuf.watch(listen_sock, accept_link);
+    shuf.run();
+    return EXIT_SUCCESS;
+}
@@ -14,12 +14,26 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include "capture.h"
 #include "common.h"
+#include "coro.h"
+#include "handoff.h"
+#include "log.h"
+#include "pipeline.h"
+#include "screen.h"
 #include "shuffle.h"
+#include "trace.h"
+#include "transfer.h"
+#include "tune.h"
 
+#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
 #include <pty.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -28,9 +42,15 @@ limitations under the License.
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <cinttypes>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -42,14 +62,256 @@ namespace {
 const std::string escape_term = "{}";
 const std::string escape_addr = "{addr}";
 int verbose = 0;
+const Profile* profile = &default_profile();
+std::unique_ptr<CaptureWriter> capture;
+// Tells sessions apart in the capture.
+uint32_t capture_session = 0;
+double rate_limit = 0;
+
+// Screen mode (-S): exec sessions send screen updates at most this many
+// times per second, instead of the raw terminal output. 0 is off.
+int screen_fps = 0;
+
+// How long an exec session in screen mode waits for its client to come
+// back.
+constexpr auto detach_timeout = std::chrono::minutes(5);
+
+// Default terminal size, until the client says otherwise.
+constexpr uint16_t default_rows = 24;
+constexpr uint16_t default_cols = 80;
+
+// Pre-forked exec children kept ready per listening exec binding (-F).
+int pool_size = 0;
+
+// Target sessions forward on threads of their own (-T).
+bool threaded = false;
+
+// How long to wait before replacing a pre-forked child that exited on
+// its own, so that a command that fails at once isn't run in a loop.
+constexpr auto spare_retry = std::chrono::seconds(1);
+
+// A pre-forked exec child with its terminal set up, waiting for a
+// client.
+struct Spare {
+    pid_t pid = -1;
+    int pty = -1;
+
+    // Socket the child reads the remote address from before it execs the
+    // command. -1 if the command doesn't use {addr}, in which case it's
+    // already running.
+    int ctl = -1;
+};
+
+// A listening socket, and what to do with its connections. Exactly one
+// of target, exec_args and dir is set, or none for stdin/stdout.
+struct Binding {
+    int channel = -1;
+
+    // Local adapter address to bind to. Empty means any.
+    std::string adapter;
+
+    std::string target;
+    std::vector<std::string> exec_args;
+    std::string dir;
+
+    // -1 when handling a single inherited connection.
+    int sock = -1;
+
+    // Connections accepted, and sessions currently running.
+    uint64_t accepted = 0;
+    int active = 0;
+
+    // Exec children ready for the next connections, oldest first.
+    std::vector<Spare> spares;
+};
+
+// The screen of an exec session in screen mode, and when it was last
+// sent. Outlives the session's streams while detached.
+struct Console {
+    std::shared_ptr<ScreenFeed> feed;
+    bool attached = false;
+    bool frame_pending = false;
+    Shuffler::clock::time_point last_frame;
+};
+
+struct Session {
+    HandoffSession h;
+
+    // Streams not yet closed.
+    int open = 0;
+
+    // Screen mode only.
+    std::shared_ptr<Console> console;
+
+    // The bt side went away, rather than the program.
+    bool client_gone = false;
+
+    // Threaded (-T) sessions only.
+    std::unique_ptr<Pipeline> pipe;
+};
+
+// An exec session in screen mode without a client, waiting for it to
+// reconnect.
+struct Detached {
+    HandoffSession h;
+    std::shared_ptr<Console> console;
+
+    // To tell its timeout from that of an earlier detach.
+    uint64_t id = 0;
+};
+
+// All listening sockets and sessions share one event loop.
+Shuffler shuf;
+std::vector<Binding> bindings;
+
+// By bt socket.
+std::map<int, Session> sessions;
+
+// By pty master.
+std::map<int, Detached> detached;
+uint64_t detach_count = 0;
+
+// Exec and file transfer children, with their remote address.
+std::map<pid_t, std::string> children;
+
+// Sessions whose target connection is in progress, by bt socket.
+std::map<int, HandoffSession> connecting;
+
+// Only one session can have stdin/stdout.
+bool stdio_busy = false;
+
+// For handing over to a new binary.
+char** orig_argv = nullptr;
+std::string self_path;
+int sigfd = -1;
+bool upgrade = false;
 
 void usage(const char* av0, int err)
 {
-    fprintf(
-        stderr, "Usage: %s [ -hv ] [ -t <target> ] [ -e <exec> ] -c <channel>\n", av0);
+    fprintf(stderr,
+            "Usage: %s [ -hTvx ] [ -p <profile> ] [ -r <bytes/s> ] [ -w <capture file> ] "
+            "[ -S <fps> ] [ -F <spares> ] [ -t <target> ] [ -d <dir> ] [ -e <exec> ] "
+            "[ -a <adapter> ] [ -i | -c <channel> | -C <config> ]\n"
+            "\n"
+            "Without -c or -C, the listening socket is taken from systemd style\n"
+            "socket activation (LISTEN_FDS). If that is an already accepted\n"
+            "connection, or with -i (connection on stdin, inetd style), only that\n"
+            "one connection is handled. With -i, logs go to syslog, since inetd\n"
+            "usually points stderr at the connection.\n"
+            "\n"
+            "With -C, listen on every channel in the config file, one per line:\n"
+            "  <channel>[@<adapter>] target <host:port>\n"
+            "  <channel>[@<adapter>] exec <command> [<args>...]\n"
+            "  <channel>[@<adapter>] dir <directory>\n"
+            "\n"
+            "With -S, exec sessions run through a terminal emulator, and only send\n"
+            "what changed on screen, at most <fps> times per second. A client that\n"
+            "disconnects can reconnect within %d minutes and get the same session\n"
+            "back.\n"
+            "\n"
+            "With -F, keep this many exec children per listening channel forked\n"
+            "and ready, with their terminal set up. If the command doesn't use\n"
+            "{addr}, it's also already running.\n"
+            "\n"
+            "With -T, target sessions forward on two threads of their own, one\n"
+            "reading and one writing. Not with the interactive profile or -w.\n",
+            av0,
+            static_cast<int>(detach_timeout.count()));
     exit(err);
 }
 
+// Channel number, or -1 if invalid.
+int parse_channel(const std::string& in)
+{
+    const auto ch_ok = xatoi(in.c_str());
+    if (!ch_ok.second || ch_ok.first < 1 || ch_ok.first > 30) {
+        return -1;
+    }
+    return ch_ok.first;
+}
+
+// Parse a config file of bindings. See usage().
+std::vector<Binding> read_config(const char* av0, const std::string& fn)
+{
+    std::ifstream f(fn);
+    if (!f) {
+        std::cerr << av0 << ": failed to open config " << fn << ": " << strerror(errno)
+                  << "\n";
+        exit(EXIT_FAILURE);
+    }
+    std::vector<Binding> ret;
+    std::string line;
+    for (int lineno = 1; std::getline(f, line); lineno++) {
+        const auto fail = [&](const std::string& msg) {
+            std::cerr << av0 << ": " << fn << ":" << lineno << ": " << msg << "\n";
+            exit(EXIT_FAILURE);
+        };
+        line = line.substr(0, line.find('#'));
+        std::istringstream in(line);
+        std::string addr;
+        std::string kind;
+        if (!(in >> addr)) {
+            continue;
+        }
+        in >> kind;
+        std::vector<std::string> args;
+        for (std::string arg; in >> arg;) {
+            args.push_back(arg);
+        }
+
+        Binding b;
+        const auto at = addr.find('@');
+        b.channel = parse_channel(addr.substr(0, at));
+        if (b.channel < 0) {
+            fail("channel needs to be a number 1-30");
+        }
+        if (at != std::string::npos) {
+            b.adapter = addr.substr(at + 1);
+            bdaddr_t tmp;
+            if (!parse_addr(b.adapter, &tmp)) {
+                fail("invalid adapter address " + b.adapter);
+            }
+        }
+        if (kind == "exec" && !args.empty()) {
+            b.exec_args = args;
+        } else if (kind == "target" && args.size() == 1) {
+            b.target = args[0];
+        } else if (kind == "dir" && args.size() == 1) {
+            b.dir = args[0];
+        } else {
+            fail("expected 'target <host:port>', 'exec <command>' or 'dir <directory>'");
+        }
+        ret.push_back(std::move(b));
+    }
+    if (ret.empty()) {
+        std::cerr << av0 << ": no bindings in config " << fn << "\n";
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+StreamOptions tune_session(int sock, std::string_view remote)
+{
+    tune_rfcomm(sock, *profile);
+    const auto mtu = rfcomm_mtu(sock);
+    LOG(trace).kv("remote", remote).kv("mtu", mtu).kv("profile", profile->name)
+        << "Tuned session";
+    return stream_options(*profile, mtu);
+}
+
+// Options for one direction of a session, with capture and rate limit if
+// enabled.
+StreamOptions direction(StreamOptions opts, uint8_t dir, uint32_t session)
+{
+    if (dir == dir_to_bt) {
+        opts.rate = rate_limit;
+    }
+    if (capture) {
+        opts.on_read = capture->observer(dir, session);
+    }
+    return opts;
+}
+
 std::pair<std::string, std::string> hostport_split(const std::string& in)
 {
     const auto count = std::count(in.begin(), in.end(), ':');
@@ -79,54 +341,58 @@ std::pair<std::string, std::string> hostport_split(const std::string& in)
     return { host1.substr(1, host1.size() - 2), port };
 }
 
-int tcp_connect(const std::string& target)
+// Connect without blocking the event loop, except for the name lookup.
+coro::Task<int> tcp_connect(std::string target)
 {
     const auto hostport = hostport_split(target);
     const auto host = hostport.first;
     const auto port = hostport.second;
     if (host.empty() || port.empty()) {
-        std::cerr << "Failed to parse " << target << "\n";
-        return -1;
-    }
-    if (verbose > 1) {
-        std::cerr << "Host and port: <" << host << "> & <" << port << ">\n";
+        LOG(error).kv("target", target) << "Failed to parse target";
+        co_return -1;
     }
+    LOG(trace).kv("host", host).kv("port", port) << "Connecting to target";
 
     struct addrinfo hints {
     };
     hints.ai_family = PF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
-    // hints.ai_flags = A
     struct addrinfo* addrs;
-    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs)) {
-        perror("getaddrinfo()");
-        return -1;
+    const auto gai = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+    if (gai) {
+        LOG(error).kv("target", target) << "getaddrinfo(): " << gai_strerror(gai);
+        co_return -1;
     }
 
     int sock = -1;
     for (struct addrinfo* ai = addrs; ai; ai = ai->ai_next) {
-        int s = socket(ai->ai_family, SOCK_STREAM, 0);
+        int s = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         if (s == -1) {
             continue;
         }
-        if (!connect(s, ai->ai_addr, ai->ai_addrlen)) {
+        PROBE(connect_start, s, target.c_str());
+        const auto err =
+            co_await coro::async_connect(shuf, s, ai->ai_addr, ai->ai_addrlen);
+        PROBE(connect_finish, s, err.value());
+        if (!err) {
             sock = s;
             break;
         }
+        LOG(debug).kv("target", target) << "connect(): " << err.message();
+        close(s);
     }
     freeaddrinfo(addrs);
-    return sock;
+    co_return sock;
 }
 
-
 // ttyname() except with "/dev" stripped.
 std::string xttyname(int fd)
 {
     char buf[PATH_MAX] = { 0 };
     const auto err = ttyname_r(fd, buf, sizeof buf);
     if (err) {
-        fprintf(stderr, "ttyname_r(): %d: %s\n", err, strerror(errno));
-        exit(EXIT_FAILURE);
+        LOG(error) << "ttyname_r(): " << strerror(err);
+        _exit(EXIT_FAILURE);
     }
     const std::string s = buf;
     const std::string prefix = "/dev";
@@ -136,42 +402,467 @@ std::string xttyname(int fd)
     return s;
 }
 
-namespace {
-struct FdCloser {
-    int fd;
-    ~FdCloser() { if (fd >= 0) close(fd); }
-    FdCloser(const FdCloser&) = delete;
-    FdCloser& operator=(const FdCloser&) = delete;
-};
+// SIGUSR2 asks for a handoff to a new binary, see handoff.h. SIGCHLD is
+// for reaping exec and file transfer children. SIGINT and SIGTERM stop
+// the event loop, so that the capture file is completed on the way out.
+int setup_signalfd()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    const int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (-1 == fd) {
+        throw std::system_error(errno, std::generic_category(), "signalfd()");
+    }
+    if (-1 == sigprocmask(SIG_BLOCK, &mask, nullptr)) {
+        close(fd);
+        throw std::system_error(errno, std::generic_category(), "sigprocmask()");
+    }
+    return fd;
 }
 
-void connection(int sock, std::string_view remote, const std::string& target)
+void set_cloexec(int fd)
 {
-    FdCloser sock_closer{ sock };
-    int ar = STDIN_FILENO;
-    int aw = STDOUT_FILENO;
-    FdCloser tcp_closer{ -1 };
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+        LOG(warning) << "fcntl(FD_CLOEXEC): " << strerror(errno);
+    }
+}
 
-    if (!target.empty()) {
-        ar = aw = tcp_connect(target);
-        if (ar == -1) {
-            std::cerr << remote << " Failed to connect to target\n";
+// Log why a session's stream ended. Only the stream that failed reports
+// it, not the others on the same fd.
+void log_close(std::string_view remote, CloseReason why, std::error_code err)
+{
+    switch (why) {
+    case CloseReason::eof:
+    case CloseReason::fd_error:
+    case CloseReason::removed:
+        return;
+    case CloseReason::exception:
+        LOG(debug).kv("remote", remote) << "Exceptional condition on fd";
+        return;
+    case CloseReason::read_error:
+    case CloseReason::write_error:
+        break;
+    }
+    // Actually normal ways for the connection to end.
+    if (err == std::errc::connection_reset) {
+        LOG(info).kv("remote", remote) << "Disconnected";
+    } else if (err == std::errc::io_error) {
+        LOG(info).kv("remote", remote) << "Terminal closed";
+    } else {
+        LOG(warning).kv("remote", remote).kv("reason", close_reason_name(why))
+            << err.message();
+    }
+}
+
+void log_exit(std::string_view remote, int status)
+{
+    if (WIFEXITED(status)) {
+        LOG(debug).kv("remote", remote).kv("status", WEXITSTATUS(status))
+            << "Child process exited";
+        return;
+    }
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGHUP) {
+        // Session ended, closing its terminal.
+        LOG(debug).kv("remote", remote) << "Child process hung up";
+        return;
+    }
+    if (WIFSIGNALED(status)) {
+        LOG(warning).kv("remote", remote)
+            << "Child process terminated due to signal: " << strsignal(WTERMSIG(status));
+        return;
+    }
+    LOG(error).kv("remote", remote) << "waitpid(): Child process failed in unknown way";
+}
+
+// Stop the event loop once there's nothing left to do. Only happens when
+// handling a single inherited connection.
+void maybe_done()
+{
+    const bool listening = std::any_of(
+        bindings.begin(), bindings.end(), [](const Binding& b) { return b.sock >= 0; });
+    if (!listening && sessions.empty() && children.empty() && connecting.empty()) {
+        shuf.stop();
+    }
+}
+
+// Send the next frame of a screen mode session once a frame interval
+// has passed since the last one, and the last one has been written.
+void schedule_frame(const std::shared_ptr<Console>& c)
+{
+    if (c->frame_pending) {
+        return;
+    }
+    c->frame_pending = true;
+    const auto interval = std::chrono::duration_cast<Shuffler::clock::duration>(
+        std::chrono::duration<double>(1.0 / screen_fps));
+    const auto when = std::max(Shuffler::clock::now(), c->last_frame + interval);
+    shuf.at(when, [wc = std::weak_ptr<Console>(c)] {
+        const auto c = wc.lock();
+        if (!c) {
+            return;
+        }
+        c->frame_pending = false;
+        if (!c->attached) {
             return;
         }
-        tcp_closer.fd = ar;
+        c->last_frame = Shuffler::clock::now();
+        if (!c->feed->render()) {
+            schedule_frame(c);
+        }
+    });
+}
+
+std::shared_ptr<Console> new_console(int pty)
+{
+    auto c = std::make_shared<Console>();
+    c->feed = std::make_shared<ScreenFeed>(default_rows, default_cols);
+    c->feed->on_dirty = [wc = std::weak_ptr<Console>(c)] {
+        const auto c = wc.lock();
+        if (c && c->attached) {
+            schedule_frame(c);
+        }
+    };
+    c->feed->screen().reply = [pty](std::string_view sv) {
+        if (-1 == write(pty, sv.data(), sv.size())) {
+            LOG(debug) << "write(pty): " << strerror(errno);
+        }
+    };
+    return c;
+}
+
+// Close a detached session's terminal, so that its program gets SIGHUP.
+void drop_detached(int pty)
+{
+    shuf.unwatch(pty);
+    close(pty);
+    detached.erase(pty);
+    maybe_done();
+}
+
+// Keep following what a detached session's program draws.
+void read_detached(int pty)
+{
+    auto& d = detached[pty];
+    std::array<char, 4096> buf;
+    const auto n = read(pty, buf.data(), buf.size());
+    if (n > 0) {
+        d.console->feed->write(std::string_view(buf.data(), n));
+        return;
     }
-    Shuffler shuf;
-    shuf.copy(ar, sock);
-    shuf.copy(sock, aw);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    // EIO once the program has exited.
+    LOG(info).kv("remote", d.h.remote) << "Detached session ended";
+    drop_detached(pty);
+}
 
-    try {
-        shuf.run();
-    } catch (const std::system_error& e) {
-        // Actually a normal way for the connection to end.
-        if (e.code() == std::errc::connection_reset) {
-            std::cerr << remote << " Disconnected\n";
-        } else {
-            throw;
+// Keep a screen mode session's program running without a client, until
+// the client reconnects or the timeout.
+void detach(Session s)
+{
+    const int pty = s.h.peer;
+    const auto id = ++detach_count;
+    s.console->attached = false;
+    s.h.sock = -1;
+    shuf.watch(pty, [pty](int) { read_detached(pty); });
+    shuf.at(Shuffler::clock::now() + detach_timeout, [pty, id] {
+        const auto it = detached.find(pty);
+        if (it != detached.end() && it->second.id == id) {
+            LOG(info).kv("remote", it->second.h.remote) << "Client didn't come back";
+            drop_detached(pty);
+        }
+    });
+    detached[pty] = Detached{ std::move(s.h), std::move(s.console), id };
+}
+
+// Detach a session handed over detached by a previous process, with the
+// screen it had then.
+void restore_detached(HandoffSession h)
+{
+    auto console = new_console(h.peer);
+    ScreenBuffer(console->feed).restore("", h.to_bt_partial);
+    h.to_bt_partial.clear();
+    detach(Session{ .h = std::move(h), .console = std::move(console) });
+}
+
+// Close a session's fds. An exec child gets SIGHUP from its terminal
+// closing, and is reaped on SIGCHLD. In screen mode, if the client went
+// away, the session is detached instead, as long as there's a listening
+// socket for the client to come back to.
+void end_session(int sock)
+{
+    const auto it = sessions.find(sock);
+    if (it == sessions.end()) {
+        return;
+    }
+    auto& s = it->second;
+    const auto& h = s.h;
+    const bool keep = s.console && s.client_gone && children.count(h.pid)
+                      && bindings[h.binding].sock >= 0;
+    // Its threads may still be polling the fds.
+    s.pipe.reset();
+    close(h.sock);
+    if (h.kind == "stdio") {
+        stdio_busy = false;
+    }
+    auto& b = bindings[h.binding];
+    b.active--;
+    LOG(info)
+        .kv("remote", h.remote)
+        .kv("channel", b.channel)
+        .kv("active", b.active)
+        .kv("accepted", b.accepted)
+        << (keep ? "Session detached" : "Session ended");
+    PROBE(session_close, h.sock, b.channel, keep);
+    if (keep) {
+        detach(std::move(s));
+    } else if (h.peer >= 0) {
+        close(h.peer);
+    }
+    sessions.erase(it);
+    if (capture) {
+        capture->flush();
+    }
+    maybe_done();
+}
+
+// Remove the streams on fd of the session on bt socket sock, from the
+// event loop or the session's own threads.
+void remove_fd(int sock, int fd)
+{
+    const auto it = sessions.find(sock);
+    if (it != sessions.end() && it->second.pipe) {
+        it->second.pipe->remove(fd);
+    } else {
+        shuf.remove(fd);
+    }
+}
+
+// A stream of the session on bt socket sock was removed. Once one
+// direction reaches EOF, pass it on: the bt side going away ends the
+// session, the target only gets a FIN, since it may still have more to
+// say. Runs from the Shuffler, so any changes to streams are deferred.
+void stream_closed(int sock, uint8_t dir, CloseReason why, std::error_code err)
+{
+    const auto it = sessions.find(sock);
+    if (it == sessions.end()) {
+        return;
+    }
+    auto& s = it->second;
+    log_close(s.h.remote, why, err);
+    const bool bt_failed = dir == dir_from_bt
+                               ? why == CloseReason::eof || why == CloseReason::read_error
+                               : why == CloseReason::write_error;
+    if (bt_failed) {
+        s.client_gone = true;
+    }
+    const auto now = Shuffler::clock::now();
+    if (why == CloseReason::eof) {
+        if (dir == dir_to_bt) {
+            shuf.at(now, [sock] { remove_fd(sock, sock); });
+        } else if (s.h.kind == "target") {
+            shutdown(s.h.peer, SHUT_WR);
+        } else if (s.h.kind == "exec") {
+            shuf.at(now, [peer = s.h.peer] { shuf.remove(peer); });
+        }
+    }
+    if (!--s.open) {
+        shuf.at(now, [sock] { end_session(sock); });
+    }
+}
+
+// Add a session's streams to the event loop. Returns its console, in
+// screen mode.
+std::shared_ptr<Console> shuffle_session(const HandoffSession& h,
+                                         std::shared_ptr<Console> console,
+                                         const StreamOptions& tx_opts,
+                                         const StreamOptions& rx_opts)
+{
+    const int ar = h.peer >= 0 ? h.peer : STDIN_FILENO;
+    const int aw = h.peer >= 0 ? h.peer : STDOUT_FILENO;
+    const int sock = h.sock;
+    std::shared_ptr<ScreenFeed> feed;
+
+    // Replies to the client's offer of v2 framing, in exec sessions.
+    const auto replies = std::make_shared<std::string>();
+    if (h.kind == "exec" && screen_fps) {
+        if (!console) {
+            console = new_console(h.peer);
+        }
+        console->attached = true;
+        feed = console->feed;
+        // Starts with a full redraw.
+        ReplyBuffer<ScreenBuffer> tx(ScreenBuffer(feed), replies);
+        tx.restore(h.to_bt, h.to_bt_partial);
+        shuf.copy(ar, sock, std::move(tx), -1, tx_opts);
+        schedule_frame(console);
+    } else if (h.kind == "exec") {
+        ReplyBuffer<RawBuffer> tx(RawBuffer(), replies);
+        tx.restore(h.to_bt, h.to_bt_partial);
+        shuf.copy(ar, sock, std::move(tx), -1, tx_opts);
+    } else {
+        RawBuffer tx;
+        tx.restore(h.to_bt, h.to_bt_partial);
+        shuf.copy(ar, sock, std::move(tx), -1, tx_opts);
+    }
+
+    if (h.kind == "exec") {
+        TelnetDecoderBuffer rx(
+            [amaster = h.peer, feed](uint16_t rows, uint16_t cols) {
+                struct winsize ws {
+                };
+                ws.ws_row = rows;
+                ws.ws_col = cols;
+                if (-1 == ioctl(amaster, TIOCSWINSZ, &ws)) {
+                    LOG(warning) << "ioctl(TIOCSWINSZ): " << strerror(errno);
+                }
+                if (feed) {
+                    feed->screen().resize(rows, cols);
+                }
+            },
+            [](uint32_t cookie) { LOG(debug).kv("cookie", cookie) << "PING"; },
+            [](uint32_t cookie) { LOG(debug).kv("cookie", cookie) << "PONG"; },
+            [replies, remote = h.remote](std::string_view reply) {
+                LOG(debug).kv("remote", remote) << "Client offers v2 framing";
+                replies->append(reply);
+            });
+        rx.restore(h.from_bt, h.from_bt_partial);
+        shuf.copy(sock, aw, std::move(rx), -1, rx_opts);
+    } else {
+        RawBuffer rx;
+        rx.restore(h.from_bt, h.from_bt_partial);
+        shuf.copy(sock, aw, std::move(rx), -1, rx_opts);
+    }
+    return console;
+}
+
+// Forward a target session on a reader and a writer thread of its own
+// (-T).
+std::unique_ptr<Pipeline> pipeline_session(const HandoffSession& h,
+                                           const StreamOptions& tx_opts,
+                                           const StreamOptions& rx_opts)
+{
+    auto pipe = std::make_unique<Pipeline>(shuf);
+    auto tx = std::make_unique<RawBuffer>();
+    tx->restore(h.to_bt, h.to_bt_partial);
+    pipe->copy(h.peer, h.sock, std::move(tx), tx_opts);
+    auto rx = std::make_unique<RawBuffer>();
+    rx->restore(h.from_bt, h.from_bt_partial);
+    pipe->copy(h.sock, h.peer, std::move(rx), rx_opts);
+    pipe->start();
+    LOG(debug).kv("remote", h.remote) << "Forwarding on reader and writer threads";
+    return pipe;
+}
+
+// Start forwarding data for a session, picking up any buffered data it
+// was handed over with. A reattached screen mode session brings its
+// console.
+void start_session(HandoffSession h, std::shared_ptr<Console> console = nullptr)
+{
+    const int sock = h.sock;
+    auto opts = tune_session(sock, h.remote);
+    const auto on_close = [sock](uint8_t dir) {
+        return [sock, dir](CloseReason why, std::error_code err) {
+            stream_closed(sock, dir, why, err);
+        };
+    };
+    const auto id = capture_session++;
+    auto tx_opts = direction(opts, dir_to_bt, id);
+    tx_opts.on_close = on_close(dir_to_bt);
+    auto rx_opts = direction(opts, dir_from_bt, id);
+    rx_opts.on_close = on_close(dir_from_bt);
+
+    // Interactive sessions gain nothing from threads. Captures aren't
+    // thread safe.
+    std::unique_ptr<Pipeline> pipe;
+    if (threaded && h.kind == "target" && !capture && profile->name != "interactive") {
+        pipe = pipeline_session(h, tx_opts, rx_opts);
+    } else {
+        console = shuffle_session(h, std::move(console), tx_opts, rx_opts);
+    }
+
+    if (h.kind == "stdio") {
+        stdio_busy = true;
+    }
+    h.to_bt.clear();
+    h.to_bt_partial.clear();
+    h.from_bt.clear();
+    h.from_bt_partial.clear();
+    bindings[h.binding].active++;
+    sessions.insert_or_assign(sock,
+                              Session{ .h = std::move(h),
+                                       .open = 2,
+                                       .console = std::move(console),
+                                       .pipe = std::move(pipe) });
+}
+
+// Hand all listening sockets and running sessions over to a new binary.
+// Only returns if that failed.
+void try_handoff()
+{
+    if (capture) {
+        capture->flush();
+    }
+    HandoffState state;
+    // Bindings are matched by channel and adapter in the new process.
+    const auto handed = [](HandoffSession h) {
+        h.channel = bindings[h.binding].channel;
+        h.adapter = bindings[h.binding].adapter;
+        return h;
+    };
+    for (const auto& b : bindings) {
+        if (b.sock >= 0) {
+            state.listeners.push_back({ b.channel, b.adapter, b.sock });
+        }
+    }
+    auto snap = shuf.snapshot();
+    for (auto& [sock, s] : sessions) {
+        if (s.pipe) {
+            s.pipe->pause();
+            const auto ps = s.pipe->snapshot();
+            snap.insert(snap.end(), ps.begin(), ps.end());
+        }
+    }
+    for (const auto& [sock, s] : sessions) {
+        if (!s.open) {
+            // Ending anyway.
+            continue;
+        }
+        auto h = handed(s.h);
+        for (const auto& st : snap) {
+            if (st.src == sock) {
+                h.from_bt = st.output;
+                h.from_bt_partial = st.partial;
+            } else if (st.dst == sock) {
+                h.to_bt = st.output;
+                h.to_bt_partial = st.partial;
+            }
+        }
+        state.sessions.push_back(std::move(h));
+    }
+    // The new process connects to the target again.
+    for (const auto& [sock, c] : connecting) {
+        auto h = handed(c);
+        h.kind = "connect";
+        state.sessions.push_back(std::move(h));
+    }
+    // Without a bt socket. The screen goes along as the partial of the
+    // stream it would be sent on, see ScreenBuffer::partial().
+    for (const auto& [pty, d] : detached) {
+        auto h = handed(d.h);
+        h.to_bt_partial = ScreenBuffer(d.console->feed).partial();
+        state.sessions.push_back(std::move(h));
+    }
+    handoff(self_path, orig_argv, state);
+    LOG(warning) << "Carrying on in the old process";
+    for (auto& [sock, s] : sessions) {
+        if (s.pipe) {
+            s.pipe->start();
         }
     }
 }
@@ -210,142 +901,591 @@ std::vector<std::string> substitute_args(const std::vector<std::string>& in,
 }
 
 
-int exec_child(const std::vector<std::string>& exec_args, const std::string& addr)
+// In a child: stop blocking the signals the parent has on its signalfd.
+void unblock_signals()
+{
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, nullptr);
+}
+
+// In an exec child: make its terminal raw, and unblock signals.
+void setup_exec_child()
 {
-    const auto tty = xttyname(0);
-    const auto args = substitute_args(exec_args, tty, addr);
     struct termios tio {
     };
     cfmakeraw(&tio);
     if (tcsetattr(0, TCSADRAIN, &tio)) {
-        std::cerr << "tcsetattr(raw)\n";
-        exit(EXIT_FAILURE);
+        LOG(error) << "tcsetattr(raw): " << strerror(errno);
+        _exit(EXIT_FAILURE);
     }
+    unblock_signals();
+}
 
+int exec_child(const std::vector<std::string>& exec_args, const std::string& addr)
+{
+    const auto tty = xttyname(0);
+    const auto args = substitute_args(exec_args, tty, addr);
     const auto cargs = exec_c_args(args);
     execvp(cargs[0], const_cast<char* const*>(&cargs[0]));
-    perror("exec()");
+    LOG(error).kv("cmd", cargs[0]) << "exec(): " << strerror(errno);
     return EXIT_FAILURE;
 }
 
 
-int handle_exec(int con,
-                std::string_view remote,
-                const std::vector<std::string>& exec_args,
-                const std::string& addr)
+// In a child: close the listening sockets and everyone else's sessions,
+// so that they don't stay open for as long as the child runs.
+void close_parent_fds()
+{
+    for (const auto& b : bindings) {
+        if (b.sock >= 0) {
+            close(b.sock);
+        }
+        for (const auto& s : b.spares) {
+            close(s.pty);
+            if (s.ctl >= 0) {
+                close(s.ctl);
+            }
+        }
+    }
+    for (const auto& [sock, s] : sessions) {
+        close(sock);
+        if (s.h.peer >= 0) {
+            close(s.h.peer);
+        }
+    }
+    for (const auto& d : detached) {
+        close(d.first);
+    }
+}
+
+// Start an exec child that sets up its terminal, and then waits to be
+// told the remote address before running the command. If the command
+// doesn't use the address, it's run straight away, and its output waits
+// in the terminal until a client comes.
+std::optional<Spare> fork_spare(int binding)
+{
+    const auto& exec_args = bindings[binding].exec_args;
+    const bool wait = std::any_of(exec_args.begin(), exec_args.end(), [](const auto& a) {
+        return a.find(escape_addr) != std::string::npos;
+    });
+    int ctl[2] = { -1, -1 };
+    if (wait && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ctl)) {
+        LOG(error) << "socketpair(): " << strerror(errno);
+        return std::nullopt;
+    }
+    int amaster;
+    struct winsize ws {
+    };
+    ws.ws_row = default_rows;
+    ws.ws_col = default_cols;
+    const auto pid = forkpty(&amaster, NULL, NULL, screen_fps ? &ws : NULL);
+    if (pid == -1) {
+        LOG(error) << "forkpty(): " << strerror(errno);
+        if (wait) {
+            close(ctl[0]);
+            close(ctl[1]);
+        }
+        return std::nullopt;
+    }
+    if (!pid) {
+        log::forked_child();
+        close_parent_fds();
+        setup_exec_child();
+        std::string addr;
+        if (wait) {
+            close(ctl[1]);
+            char buf[64];
+            for (;;) {
+                const auto n = read(ctl[0], buf, sizeof buf);
+                if (n <= 0) {
+                    break;
+                }
+                addr.append(buf, n);
+            }
+            if (addr.empty()) {
+                // Not needed after all.
+                _exit(EXIT_SUCCESS);
+            }
+        }
+        _exit(exec_child(exec_args, addr));
+    }
+    set_cloexec(amaster);
+    if (wait) {
+        close(ctl[0]);
+    }
+    return Spare{ pid, amaster, ctl[1] };
+}
+
+// Top up a binding's pool of exec children, if it still listens.
+void fill_pool(int binding)
 {
+    auto& b = bindings[binding];
+    while (b.sock >= 0 && static_cast<int>(b.spares.size()) < pool_size) {
+        const auto s = fork_spare(binding);
+        if (!s) {
+            return;
+        }
+        b.spares.push_back(*s);
+    }
+}
+
+// Forget a pre-forked child that exited before being used. Returns false
+// if pid wasn't one.
+bool drop_spare(pid_t pid)
+{
+    for (size_t i = 0; i < bindings.size(); i++) {
+        auto& spares = bindings[i].spares;
+        const auto it = std::find_if(
+            spares.begin(), spares.end(), [pid](const Spare& s) { return s.pid == pid; });
+        if (it == spares.end()) {
+            continue;
+        }
+        close(it->pty);
+        if (it->ctl >= 0) {
+            close(it->ctl);
+        }
+        spares.erase(it);
+        LOG(warning).kv("channel", bindings[i].channel)
+            << "Pre-forked exec child exited, replacing it";
+        shuf.at(Shuffler::clock::now() + spare_retry, [i] { fill_pool(i); });
+        return true;
+    }
+    return false;
+}
+
+// Hand a new connection a pre-forked child, if there is one ready.
+bool start_spare(HandoffSession& h)
+{
+    auto& spares = bindings[h.binding].spares;
+    if (spares.empty()) {
+        return false;
+    }
+    const auto s = spares.front();
+    spares.erase(spares.begin());
+    if (s.ctl >= 0) {
+        const auto rc = send(s.ctl, h.remote.data(), h.remote.size(), MSG_NOSIGNAL);
+        close(s.ctl);
+        if (rc != static_cast<ssize_t>(h.remote.size())) {
+            // Child gone. Reaped as unknown.
+            LOG(warning) << "Pre-forked exec child not responding: " << strerror(errno);
+            close(s.pty);
+            return false;
+        }
+    }
+    h.kind = "exec";
+    h.peer = s.pty;
+    h.pid = s.pid;
+    children[s.pid] = h.remote;
+
+    // After this session has started.
+    shuf.at(Shuffler::clock::now(), [b = h.binding] { fill_pool(b); });
+    start_session(std::move(h));
+    return true;
+}
+
+void start_exec(HandoffSession h)
+{
+    if (start_spare(h)) {
+        return;
+    }
     int amaster;
-    const auto pid = forkpty(&amaster, NULL, NULL, NULL);
+    // The screen model has to start out the same size as the terminal.
+    struct winsize ws {
+    };
+    ws.ws_row = default_rows;
+    ws.ws_col = default_cols;
+    const auto pid = forkpty(&amaster, NULL, NULL, screen_fps ? &ws : NULL);
     if (pid == -1) {
-        perror("forkpty()");
-        return EXIT_FAILURE;
+        LOG(error).kv("remote", h.remote) << "forkpty(): " << strerror(errno);
+        close(h.sock);
+        return;
+    }
+
+    if (!pid) {
+        log::forked_child();
+        if (h.sock > STDERR_FILENO) {
+            close(h.sock);
+        }
+        setup_exec_child();
+        _exit(exec_child(bindings[h.binding].exec_args, h.remote));
     }
+    // Or later children would keep this terminal open.
+    set_cloexec(amaster);
+    h.kind = "exec";
+    h.peer = amaster;
+    h.pid = pid;
+    children[pid] = h.remote;
+    start_session(std::move(h));
+}
 
+// File transfers are blocking, so they get a child process each.
+void start_transfer(HandoffSession h)
+{
+    tune_session(h.sock, h.remote);
+    const auto pid = fork();
+    if (pid == -1) {
+        LOG(error).kv("remote", h.remote) << "fork(): " << strerror(errno);
+        close(h.sock);
+        return;
+    }
     if (!pid) {
+        log::forked_child();
+        unblock_signals();
+        close_parent_fds();
+        bool ok = false;
+        try {
+            ok = serve_transfer(h.sock, bindings[h.binding].dir);
+        } catch (const std::exception& e) {
+            LOG(error).kv("remote", h.remote) << e.what();
+        }
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(h.sock);
+    children[pid] = h.remote;
+}
+
+void reap()
+{
+    for (;;) {
+        int status;
+        const auto pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0) {
+            break;
+        }
+        const auto it = children.find(pid);
+        if (it == children.end() && drop_spare(pid)) {
+            continue;
+        }
+        log_exit(it != children.end() ? it->second : "unknown", status);
+        if (it != children.end()) {
+            children.erase(it);
+        }
+    }
+    maybe_done();
+}
+
+void on_signal(int fd)
+{
+    struct signalfd_siginfo si;
+    while (read(fd, &si, sizeof si) == sizeof si) {
+        switch (si.ssi_signo) {
+        case SIGCHLD:
+            reap();
+            break;
+        case SIGUSR2:
+            upgrade = true;
+            shuf.stop();
+            break;
+        case SIGINT:
+        case SIGTERM:
+            LOG(info) << "Exiting on " << strsignal(si.ssi_signo);
+            shuf.stop();
+            break;
+        }
+    }
+}
+
+// Give a client back its detached session on this binding, if any.
+bool reattach(HandoffSession& h)
+{
+    const auto it = std::find_if(detached.begin(), detached.end(), [&h](const auto& d) {
+        return d.second.h.binding == h.binding && d.second.h.remote == h.remote;
+    });
+    if (it == detached.end()) {
+        return false;
+    }
+    auto d = std::move(it->second);
+    detached.erase(it);
+    shuf.unwatch(d.h.peer);
+    d.h.sock = h.sock;
+    LOG(info).kv("remote", h.remote) << "Client reattached";
+    start_session(std::move(d.h), std::move(d.console));
+    return true;
+}
+
+coro::Task<void> connect_target(HandoffSession h)
+{
+    connecting[h.sock] = h;
+    h.peer = co_await tcp_connect(bindings[h.binding].target);
+    connecting.erase(h.sock);
+    if (h.peer == -1) {
+        LOG(warning).kv("remote", h.remote) << "Failed to connect to target";
+        close(h.sock);
+        maybe_done();
+        co_return;
+    }
+    tune_target(h.peer, *profile);
+    h.kind = "target";
+    start_session(std::move(h));
+}
+
+void handle(int binding, int con, const std::string& remote)
+{
+    auto& b = bindings[binding];
+    b.accepted++;
+    LOG(debug).kv("remote", remote).kv("channel", b.channel) << "Client connected";
+    PROBE(session_accept, con, b.channel, remote.c_str());
+    HandoffSession h;
+    h.kind = "stdio";
+    h.remote = remote;
+    h.binding = binding;
+    h.sock = con;
+    if (!b.dir.empty()) {
+        start_transfer(std::move(h));
+    } else if (!b.exec_args.empty()) {
+        if (!reattach(h)) {
+            start_exec(std::move(h));
+        }
+    } else if (!b.target.empty()) {
+        coro::spawn(connect_target(std::move(h)));
+    } else if (stdio_busy) {
+        LOG(warning).kv("remote", remote) << "Already serving stdin/stdout, refusing";
         close(con);
-        exec_child(exec_args, addr);
-    }
-    auto rx = std::make_unique<TelnetDecoderBuffer>(
-        [amaster](uint16_t rows, uint16_t cols) {
-            struct winsize ws {
-            };
-            ws.ws_row = rows;
-            ws.ws_col = cols;
-            if (-1 == ioctl(amaster, TIOCSWINSZ, &ws)) {
-                perror("ioctl()");
-            }
-        },
-        [](uint32_t cookie) { std::cerr << "PING\n"; },
-        [](uint32_t cookie) { std::cerr << "PONG\n"; });
-
-    Shuffler shuf;
-    shuf.copy(amaster, con);
-    shuf.copy(con, amaster, std::move(rx));
-    try {
-        shuf.run();
-    } catch (const std::system_error& e) {
-        // Actually a normal way for the connection to end, apparently.
-        if (e.code() == std::errc::connection_reset) {
-            std::cerr << remote << " Disconnected\n";
-        } else if (e.code() == std::errc::io_error) {
-            std::cerr << remote << " Terminal closed\n";
-        } else {
-            throw;
+    } else {
+        start_session(std::move(h));
+    }
+}
+
+void accept_one(int binding)
+{
+    struct sockaddr_rc raddr {
+    };
+    socklen_t socklen = sizeof(raddr);
+    auto& b = bindings[binding];
+    const int con =
+        accept4(b.sock, reinterpret_cast<sockaddr*>(&raddr), &socklen, SOCK_CLOEXEC);
+    if (con == -1) {
+        LOG(warning).kv("channel", b.channel) << "accept(): " << strerror(errno);
+        return;
+    }
+    handle(binding, con, stringify_addr(&raddr.rc_bdaddr));
+}
+
+// Index of the binding on this channel and adapter, or -1.
+int find_binding(int channel, const std::string& adapter)
+{
+    for (size_t i = 0; i < bindings.size(); i++) {
+        if (bindings[i].channel == channel
+            && !strcasecmp(bindings[i].adapter.c_str(), adapter.c_str())) {
+            return i;
         }
     }
-    close(con);
-    close(amaster);
+    return -1;
+}
 
-    int status;
-    const auto rpid = waitpid(pid, &status, 0);
-    if (rpid != pid) {
-        std::cerr << remote << " waitpid(): " << strerror(errno) << "\n";
-        return EXIT_FAILURE;
+// Listen on the binding's channel. Returns false on error.
+bool open_listener(Binding& b)
+{
+    const int sock = socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_CLOEXEC, BTPROTO_RFCOMM);
+    if (sock == -1) {
+        LOG(error) << "socket(): " << strerror(errno);
+        return false;
     }
 
-    if (WIFEXITED(status)) {
-        return WEXITSTATUS(status);
+    // Bind to zeroes, unless an adapter is given.
+    struct sockaddr_rc laddr {
+    };
+    laddr.rc_family = AF_BLUETOOTH;
+    laddr.rc_channel = b.channel;
+    if (!b.adapter.empty()) {
+        parse_addr(b.adapter, &laddr.rc_bdaddr);
     }
+    if (bind(sock, reinterpret_cast<sockaddr*>(&laddr), sizeof(laddr))) {
+        LOG(error).kv("channel", b.channel).kv("adapter", b.adapter)
+            << "Failed to bind: " << strerror(errno);
+        close(sock);
+        return false;
+    }
+    if (listen(sock, 10)) {
+        LOG(error) << "listen(): " << strerror(errno);
+        close(sock);
+        return false;
+    }
+    LOG(debug).kv("channel", b.channel).kv("adapter", b.adapter) << "Listening…";
+    b.sock = sock;
+    return true;
+}
 
-    if (WIFSIGNALED(status)) {
-        std::cerr << remote << " Child process terminated due to signal: "
-                  << strsignal(WTERMSIG(status)) << "\n";
-        return EXIT_FAILURE;
+// First socket passed by systemd style socket activation, or -1.
+int listen_fds()
+{
+    const char* pid = getenv("LISTEN_PID");
+    const char* fds = getenv("LISTEN_FDS");
+    if (!pid || !fds) {
+        return -1;
     }
+    const auto pid_ok = xatoi(pid);
+    const auto fds_ok = xatoi(fds);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if (!pid_ok.second || pid_ok.first != getpid()) {
+        // Meant for someone else.
+        return -1;
+    }
+    if (!fds_ok.second || fds_ok.first < 1) {
+        return -1;
+    }
+    constexpr int first_fd = 3; // SD_LISTEN_FDS_START
+    if (fds_ok.first > 1) {
+        LOG(warning).kv("count", fds_ok.first) << "Only using the first passed socket";
+    }
+    fcntl(first_fd, F_SETFD, FD_CLOEXEC);
+    return first_fd;
+}
 
-    std::cerr << remote << " waitpid(): Child process failed in unknown way\n";
-    return EXIT_FAILURE;
+bool is_listening(int fd)
+{
+    int val = 0;
+    socklen_t len = sizeof(val);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len)) {
+        throw std::system_error(errno, std::generic_category(), "getsockopt(SO_ACCEPTCONN)");
+    }
+    return val;
+}
+
+// Remote address of an inherited connection.
+std::string peer_name(int fd)
+{
+    struct sockaddr_rc raddr {
+    };
+    socklen_t socklen = sizeof(raddr);
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&raddr), &socklen)) {
+        LOG(warning) << "getpeername(): " << strerror(errno);
+        return "unknown";
+    }
+    if (raddr.rc_family != AF_BLUETOOTH) {
+        return "non-bluetooth";
+    }
+    return stringify_addr(&raddr.rc_bdaddr);
 }
 
 } // namespace
 
 int wrapmain(int argc, char** argv)
 {
-    int channel = -1;
-    std::string target;
+    // getopt() reorders argv.
+    std::vector<char*> args(argv, argv + argc + 1);
+    orig_argv = args.data();
+    self_path = executable_path();
+
+    Binding cli;
+    std::string config;
     bool do_exec = false;
+    bool inetd = false;
+    std::string capture_file;
+    bool capture_payload = false;
     {
         int opt;
-        while ((opt = getopt(argc, argv, "c:ht:ev")) != -1) {
+        while ((opt = getopt(argc, argv, "a:c:C:d:F:hip:r:S:t:Tevw:x")) != -1) {
             switch (opt) {
+            case 'a': {
+                cli.adapter = optarg;
+                bdaddr_t tmp;
+                if (!parse_addr(cli.adapter, &tmp)) {
+                    std::cerr << argv[0] << ": invalid adapter address (-a): " << optarg
+                              << "\n";
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'C':
+                config = optarg;
+                break;
+            case 'd':
+                cli.dir = optarg;
+                break;
             case 'e':
                 do_exec = true;
                 break;
+            case 'F': {
+                const auto n = xatoi(optarg);
+                if (!n.second || n.first < 0 || n.first > 100) {
+                    std::cerr << argv[0] << ": spares (-F) needs to be 0-100: " << optarg
+                              << "\n";
+                    exit(EXIT_FAILURE);
+                }
+                pool_size = n.first;
+                break;
+            }
             case 'h':
                 usage(argv[0], EXIT_SUCCESS);
             case 'c': {
-                const auto ch_ok = xatoi(optarg);
-                if (!ch_ok.second) {
+                if (!xatoi(optarg).second) {
                     std::cerr << argv[0]
                               << ": channel number (-c) not a number: " << optarg << "\n";
                     exit(EXIT_FAILURE);
                 }
-                channel = ch_ok.first;
-                if (channel < 1 || channel > 30) {
+                cli.channel = parse_channel(optarg);
+                if (cli.channel < 0) {
                     std::cerr << argv[0] << ": channel needs to be a number 1-30\n";
                     exit(EXIT_FAILURE);
                 }
                 break;
             }
+            case 'i':
+                inetd = true;
+                break;
+            case 'p':
+                profile = find_profile(optarg);
+                if (!profile) {
+                    std::cerr << argv[0] << ": unknown profile " << optarg
+                              << ". Available:";
+                    for (const auto& name : profile_names()) {
+                        std::cerr << " " << name;
+                    }
+                    std::cerr << "\n";
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r': {
+                char* end = nullptr;
+                rate_limit = strtod(optarg, &end);
+                if (*end || rate_limit < 0) {
+                    std::cerr << argv[0] << ": invalid rate limit (-r): " << optarg
+                              << "\n";
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'S': {
+                const auto fps = xatoi(optarg);
+                if (!fps.second || fps.first < 1 || fps.first > 1000) {
+                    std::cerr << argv[0] << ": frame rate (-S) needs to be 1-1000: "
+                              << optarg << "\n";
+                    exit(EXIT_FAILURE);
+                }
+                screen_fps = fps.first;
+                break;
+            }
             case 't':
-                target = optarg;
+                cli.target = optarg;
+                break;
+            case 'T':
+                threaded = true;
                 break;
             case 'v':
                 verbose++;
                 break;
+            case 'w':
+                capture_file = optarg;
+                break;
+            case 'x':
+                capture_payload = true;
+                break;
             default:
                 usage(argv[0], EXIT_FAILURE);
             }
         }
     }
-    std::vector<std::string> exec_args;
     if (do_exec) {
         if (optind == argc) {
             std::cerr << argv[0] << ": -e specified but no command line given\n";
             exit(EXIT_FAILURE);
         }
         for (int i = optind; i < argc; i++) {
-            exec_args.push_back(argv[i]);
+            cli.exec_args.push_back(argv[i]);
         }
     } else {
         if (optind != argc) {
@@ -354,46 +1494,148 @@ int wrapmain(int argc, char** argv)
         }
     }
 
-    if (channel < 0) {
-        std::cerr << argv[0] << ": channel (-c) not specified\n";
+    if (!cli.dir.empty() && (do_exec || !cli.target.empty())) {
+        std::cerr << argv[0] << ": file transfer (-d) can't be combined with -e or -t\n";
         exit(EXIT_FAILURE);
     }
+    if (!config.empty()) {
+        if (cli.channel >= 0 || !cli.adapter.empty() || !cli.target.empty()
+            || !cli.dir.empty() || do_exec || inetd) {
+            std::cerr << argv[0]
+                      << ": -C can't be combined with -a, -c, -d, -e, -i or -t\n";
+            exit(EXIT_FAILURE);
+        }
+        bindings = read_config(argv[0], config);
+    } else {
+        if (!cli.adapter.empty() && cli.channel < 0) {
+            std::cerr << argv[0] << ": adapter (-a) needs a channel (-c)\n";
+            exit(EXIT_FAILURE);
+        }
+        bindings.push_back(cli);
+    }
+    log::set_level(log::verbosity(verbose));
+    if (inetd) {
+        // stderr is likely the connection itself. Keep anything written
+        // to it out of the session.
+        log::use_syslog("bt-listener");
+        const int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (null >= 0) {
+            dup2(null, STDERR_FILENO);
+            close(null);
+        }
+    }
+    if (!capture_file.empty()) {
+        capture = std::make_unique<CaptureWriter>(capture_file, capture_payload);
+    }
 
-    int sock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+    sigfd = setup_signalfd();
+    shuf.persist(true);
+    shuf.watch(sigfd, on_signal);
 
-    // Bind to zeroes.
-    struct sockaddr_rc laddr {
-    };
-    laddr.rc_family = AF_BLUETOOTH;
-    laddr.rc_channel = channel;
-    if (bind(sock, reinterpret_cast<sockaddr*>(&laddr), sizeof(laddr))) {
-        perror("Failed to bind");
-        close(sock);
-        return EXIT_FAILURE;
-    }
-    if (listen(sock, 10)) {
-        perror("listen()");
-        return EXIT_FAILURE;
+    // Take over from a previous process, if started by one.
+    const auto state = receive_handoff();
+    const int inherited = (inetd && !state) ? STDIN_FILENO : listen_fds();
+    if (state) {
+        LOG(info).kv("sessions", state->sessions.size())
+            << "Took over from previous process";
+        for (const auto& l : state->listeners) {
+            const auto b = find_binding(l.channel, l.adapter);
+            if (b < 0 || bindings[b].sock >= 0) {
+                LOG(warning).kv("channel", l.channel).kv("adapter", l.adapter)
+                    << "Binding gone, closing its socket";
+                close(l.sock);
+                continue;
+            }
+            bindings[b].sock = l.sock;
+        }
+        if (!state->listeners.empty()) {
+            for (auto& b : bindings) {
+                if (b.sock < 0 && !open_listener(b)) {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        for (auto s : state->sessions) {
+            const auto b = find_binding(s.channel, s.adapter);
+            if (b < 0) {
+                LOG(warning).kv("remote", s.remote).kv("channel", s.channel)
+                    .kv("adapter", s.adapter) << "Binding gone, closing its session";
+                if (s.sock >= 0) {
+                    close(s.sock);
+                }
+                if (s.peer >= 0) {
+                    close(s.peer);
+                }
+                if (s.pid > 0) {
+                    // Hangs up when its terminal closes.
+                    children[s.pid] = s.remote;
+                }
+                continue;
+            }
+            s.binding = b;
+            if (s.pid > 0) {
+                children[s.pid] = s.remote;
+            }
+            if (s.kind == "connect") {
+                coro::spawn(connect_target(std::move(s)));
+            } else if (s.sock < 0) {
+                restore_detached(std::move(s));
+            } else {
+                start_session(std::move(s));
+            }
+        }
+    } else if (inherited >= 0) {
+        if (cli.channel >= 0 || !config.empty()) {
+            std::cerr << argv[0]
+                      << ": -c and -C can't be used with an inherited socket\n";
+            exit(EXIT_FAILURE);
+        }
+        if (inetd || !is_listening(inherited)) {
+            // A single connection, already accepted.
+            if (cli.target.empty() && !do_exec && cli.dir.empty()) {
+                std::cerr << argv[0]
+                          << ": an accepted connection needs -t, -e or -d to talk to\n";
+                exit(EXIT_FAILURE);
+            }
+            const auto remote = peer_name(inherited);
+            LOG(debug).kv("remote", remote) << "Handling inherited connection";
+            handle(0, inherited, remote);
+        } else {
+            bindings[0].sock = inherited;
+            LOG(debug) << "Listening on inherited socket…";
+        }
+    } else {
+        if (config.empty() && cli.channel < 0) {
+            std::cerr << argv[0] << ": channel (-c) not specified\n";
+            exit(EXIT_FAILURE);
+        }
+        for (auto& b : bindings) {
+            if (!open_listener(b)) {
+                return EXIT_FAILURE;
+            }
+        }
     }
 
-    if (verbose) {
-        std::cerr << "Listening…\n";
+    for (size_t i = 0; i < bindings.size(); i++) {
+        if (bindings[i].sock >= 0) {
+            shuf.watch(bindings[i].sock, [i](int) { accept_one(i); });
+        }
+        if (!bindings[i].exec_args.empty()) {
+            fill_pool(i);
+        }
     }
+    // In case there's nothing to do.
+    shuf.at(Shuffler::clock::now(), maybe_done);
     for (;;) {
-        struct sockaddr_rc raddr {
-        };
-        socklen_t socklen = sizeof(raddr);
-        const int con = accept(sock, reinterpret_cast<sockaddr*>(&raddr), &socklen);
-        const auto remote = stringify_addr(&raddr.rc_bdaddr);
-        if (verbose) {
-            std::cerr << remote << " Client connected\n";
-        }
-        // TODO: log remote address
-        // TODO: fork.
-        if (do_exec) {
-            handle_exec(con, remote, exec_args, remote);
-        } else {
-            connection(con, remote, target);
+        upgrade = false;
+        shuf.run();
+        if (!upgrade) {
+            break;
         }
+        try_handoff();
+    }
+    for (const auto& b : bindings) {
+        LOG(debug).kv("channel", b.channel).kv("accepted", b.accepted) << "Binding done";
     }
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,730 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Replay a capture (bt-listener/bt-connecter -w) through Shuffler and
+ * the Buffer types, and report latency and throughput.
+ *
+ * Each direction in the capture gets its own stream between a pair of
+ * socketpairs. A feeder thread writes the recorded reads with their
+ * original timing (optionally sped up), and a receiver thread
+ * timestamps their arrival on the other side.
+ *
+ * With -k, instead measure keystroke latency while a bulk stream shares
+ * a slow link, or with -m telnet, how long window size changes take to
+ * get through behind a paste.
+ *
+ * With -P, the streams run in a Pipeline, on a reader and a writer
+ * thread, instead of in the Shuffler.
+ *
+ * Built with --enable-alloc-stats, a replay also reports heap
+ * allocations made while forwarding, and -a fails it if there are too
+ * many.
+ */
+#include "alloc.h"
+#include "capture.h"
+#include "common.h"
+#include "pipeline.h"
+#include "shuffle.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using namespace bthelper;
+
+namespace {
+using clock_type = std::chrono::steady_clock;
+
+[[noreturn]] void usage(const char* av0, int err)
+{
+    fprintf(stderr,
+            "Usage: %s [ -ChPV ] [ -a <allocs/MB> ] [ -I <session> ] [ -m <mode> ]\n"
+            "          [ -s <speed> ] <capture file>\n"
+            "       %s -k <link rate> [ -b <bulk rate> ] [ -d <seconds> ]\n"
+            "  Options:\n"
+            "    -a       Fail if forwarding makes more than this many heap\n"
+            "             allocations per MB. Needs --enable-alloc-stats.\n"
+            "    -C       No cut-through. Data waits for the next poll() to be\n"
+            "             written, even if the buffer was empty.\n"
+            "    -h       Show this help.\n"
+            "    -I       Session to replay, from a listener's capture of several.\n"
+            "             Default is the first one recorded.\n"
+            "    -P       Forward on two threads (reading and writing), through\n"
+            "             a Pipeline.\n"
+            "    -m       Buffer path: raw (default), telnet for encoder+decoder, or\n"
+            "             frames for the same in v2 framing.\n"
+            "             With -k, telnet or frames measures window size change\n"
+            "             latency.\n"
+            "    -s       Speed factor. 1 is original timing (default), 10 is ten\n"
+            "             times faster, and 0 as fast as possible.\n"
+            "    -V       Use the runtime-polymorphic Buffer interface, instead of\n"
+            "             streams specialized for the buffer type.\n"
+            "    -k       Keystroke latency benchmark, over a link of this many\n"
+            "             bytes per second.\n"
+            "    -b       Rate limit the bulk stream to this many bytes per second.\n"
+            "    -d       Duration of keystroke benchmark. Default 5 seconds.\n",
+            av0,
+            av0);
+    exit(err);
+}
+
+// Telnet encoder and decoder back to back, as the two ends of a
+// terminal session would be, in IAC or v2 framing.
+class ChainBuffer final : public Buffer
+{
+public:
+    explicit ChainBuffer(bool frames)
+        : dec_([](uint16_t, uint16_t) {}, [](uint32_t) {}, [](uint32_t) {})
+    {
+        if (frames) {
+            enc_.use_frames();
+        }
+    }
+
+    void write(std::string_view sv) override
+    {
+        enc_.write(sv);
+        const auto p = enc_.peek();
+        dec_.write(p);
+        enc_.ack(p.size());
+    }
+    std::string_view peek() const override { return dec_.peek(); }
+    void ack(size_t n) override { dec_.ack(n); }
+
+private:
+    TelnetEncoderBuffer enc_;
+    TelnetDecoderBuffer dec_;
+};
+
+struct Direction {
+    uint8_t dir = 0;
+    std::vector<CaptureEvent> events;
+
+    // Cumulative bytes at the end of each event.
+    std::vector<uint64_t> end_offset;
+
+    // Time each event was written, as nanoseconds since start.
+    std::unique_ptr<std::atomic<int64_t>[]> sent;
+
+    std::vector<double> latency_us;
+    clock_type::time_point last_recv;
+
+    int in[2] = { -1, -1 };
+    int out[2] = { -1, -1 };
+};
+
+void make_pair(int* fds)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+        throw std::system_error(errno, std::generic_category(), "socketpair()");
+    }
+}
+
+void write_all(int fd, std::string_view data)
+{
+    while (!data.empty()) {
+        const auto rc = ::write(fd, data.data(), data.size());
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "write()");
+        }
+        data.remove_prefix(rc);
+    }
+}
+
+// Data to send for an event. Captures without payload get a pattern
+// that includes IAC bytes, so the telnet path does some escaping.
+std::string payload(const CaptureEvent& ev)
+{
+    if (ev.has_payload) {
+        return ev.payload;
+    }
+    std::string ret(ev.len, 0);
+    for (size_t i = 0; i < ret.size(); i++) {
+        ret[i] = static_cast<char>(i & 0xff);
+    }
+    return ret;
+}
+
+void feeder(Direction* d, double speed, clock_type::time_point start)
+{
+    alloc::Scope scope(alloc::Tag::bench);
+    for (size_t i = 0; i < d->events.size(); i++) {
+        const auto& ev = d->events[i];
+        if (speed > 0) {
+            std::this_thread::sleep_until(
+                start
+                + std::chrono::duration_cast<clock_type::duration>(
+                    std::chrono::duration<double, std::micro>(ev.usec / speed)));
+        }
+        const auto data = payload(ev);
+        d->sent[i].store((clock_type::now() - start).count(), std::memory_order_release);
+        write_all(d->in[1], data);
+    }
+    close(d->in[1]);
+}
+
+void receiver(Direction* d, clock_type::time_point start)
+{
+    alloc::Scope scope(alloc::Tag::bench);
+    std::vector<char> buf(64 * 1024);
+    uint64_t received = 0;
+    size_t idx = 0;
+    for (;;) {
+        const auto rc = read(d->out[1], buf.data(), buf.size());
+        if (rc <= 0) {
+            break;
+        }
+        received += rc;
+        const auto now = clock_type::now();
+        d->last_recv = now;
+        const auto now_ns = (now - start).count();
+        while (idx < d->end_offset.size() && received >= d->end_offset[idx]) {
+            const auto sent = d->sent[idx].load(std::memory_order_acquire);
+            d->latency_us.push_back((now_ns - sent) / 1000.0);
+            idx++;
+        }
+    }
+    close(d->out[1]);
+}
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    const auto idx = std::min(sorted.size() - 1,
+                              static_cast<size_t>(p / 100.0 * sorted.size()));
+    return sorted[idx];
+}
+
+void report(const Direction& d, clock_type::time_point start)
+{
+    auto lat = d.latency_us;
+    std::sort(lat.begin(), lat.end());
+    const uint64_t bytes = d.end_offset.empty() ? 0 : d.end_offset.back();
+    const double secs = std::chrono::duration<double>(d.last_recv - start).count();
+    printf("dir=%s events=%zu bytes=%llu seconds=%.3f throughput_kBps=%.1f "
+           "latency_us_p50=%.0f p90=%.0f p99=%.0f max=%.0f\n",
+           d.dir == dir_from_bt ? "from_bt" : "to_bt",
+           d.events.size(),
+           static_cast<unsigned long long>(bytes),
+           secs,
+           secs > 0 ? bytes / secs / 1000 : 0,
+           percentile(lat, 50),
+           percentile(lat, 90),
+           percentile(lat, 99),
+           lat.empty() ? 0 : lat.back());
+}
+
+// Syscalls and wakeups, per MB forwarded.
+void report_stats(const Shuffler::Stats& st, uint64_t bytes)
+{
+    const double mb = bytes / 1e6;
+    const auto per_mb = [mb](uint64_t n) { return mb > 0 ? n / mb : 0; };
+    printf("wakeups_per_MB=%.1f reads_per_MB=%.1f writes_per_MB=%.1f "
+           "cut_through_writes=%llu of %llu\n",
+           per_mb(st.wakeups),
+           per_mb(st.reads),
+           per_mb(st.writes),
+           static_cast<unsigned long long>(st.cut_through),
+           static_cast<unsigned long long>(st.writes));
+}
+
+// Heap allocations made while forwarding bytes. Returns false if over
+// budget (allocations per MB), if there is one.
+bool report_allocs(const alloc::Counters& used, uint64_t bytes, double budget)
+{
+    uint64_t allocs = 0;
+    uint64_t alloc_bytes = 0;
+    std::string by_tag;
+    for (size_t i = 0; i < used.size(); i++) {
+        const auto tag = static_cast<alloc::Tag>(i);
+        if (tag == alloc::Tag::bench) {
+            continue;
+        }
+        allocs += used[i].allocs;
+        alloc_bytes += used[i].bytes;
+        by_tag += std::string(" ") + alloc::tag_name(tag) + "="
+                  + std::to_string(used[i].allocs);
+    }
+    const double per_mb = bytes ? allocs / (bytes / 1e6) : 0;
+    printf("allocs=%llu alloc_bytes=%llu allocs_per_MB=%.2f%s\n",
+           static_cast<unsigned long long>(allocs),
+           static_cast<unsigned long long>(alloc_bytes),
+           per_mb,
+           by_tag.c_str());
+    if (budget >= 0 && per_mb > budget) {
+        fprintf(stderr,
+                "Allocation budget exceeded: %.2f allocs/MB > %.2f\n",
+                per_mb,
+                budget);
+        return false;
+    }
+    return true;
+}
+
+// Keystrokes and a bulk transfer sharing one link, drained at
+// link_rate. Keystroke bytes are 'k' and bulk bytes 'b', so the
+// receiver can tell them apart.
+int keystroke_bench(double link_rate, double bulk_rate, double duration)
+{
+    constexpr auto key_interval = std::chrono::milliseconds(50);
+    int link[2];
+    int bulk[2];
+    int keys[2];
+    make_pair(link);
+    make_pair(bulk);
+    make_pair(keys);
+
+    // Small socket buffer, like an RFCOMM socket.
+    const int sndbuf = 16 * 1024;
+    setsockopt(link[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(link[0], F_SETFL, fcntl(link[0], F_GETFL) | O_NONBLOCK);
+
+    StreamOptions bulk_opts;
+    bulk_opts.rate = bulk_rate;
+    bulk_opts.latency = LatencyClass::bulk;
+    StreamOptions key_opts;
+    key_opts.latency = LatencyClass::interactive;
+
+    Shuffler shuf;
+    shuf.copy(bulk[0], link[0], RawBuffer(), -1, bulk_opts);
+    shuf.copy(keys[0], link[0], RawBuffer(), -1, key_opts);
+
+    const auto start = clock_type::now();
+    const auto end = start
+                     + std::chrono::duration_cast<clock_type::duration>(
+                         std::chrono::duration<double>(duration));
+    std::atomic<bool> done{ false };
+    std::vector<clock_type::time_point> key_sent;
+    std::mutex key_mu;
+
+    std::thread key_thread([&] {
+        while (clock_type::now() < end) {
+            {
+                std::lock_guard<std::mutex> lk(key_mu);
+                key_sent.push_back(clock_type::now());
+            }
+            write_all(keys[1], "k");
+            std::this_thread::sleep_for(key_interval);
+        }
+        done = true;
+        close(keys[1]);
+    });
+    std::thread bulk_thread([&] {
+        const std::string chunk(4096, 'b');
+        while (!done) {
+            write_all(bulk[1], chunk);
+        }
+        close(bulk[1]);
+    });
+
+    std::vector<double> lat;
+    uint64_t bulk_bytes = 0;
+    std::thread recv_thread([&] {
+        std::vector<char> buf(64 * 1024);
+        const auto tick = std::chrono::milliseconds(1);
+        const size_t per_tick = std::max<size_t>(1, link_rate / 1000);
+        size_t key_idx = 0;
+        for (;;) {
+            // Drain at link rate while measuring, then as fast as
+            // possible.
+            const auto want = done ? buf.size() : per_tick;
+            const auto rc = read(link[1], buf.data(), want);
+            if (rc <= 0) {
+                break;
+            }
+            const auto now = clock_type::now();
+            for (ssize_t i = 0; i < rc; i++) {
+                if (buf[i] != 'k') {
+                    if (!done) {
+                        bulk_bytes++;
+                    }
+                    continue;
+                }
+                std::lock_guard<std::mutex> lk(key_mu);
+                lat.push_back(
+                    std::chrono::duration<double, std::milli>(now - key_sent[key_idx++])
+                        .count());
+            }
+            if (!done) {
+                std::this_thread::sleep_for(tick);
+            }
+        }
+    });
+
+    shuf.run();
+    close(link[0]);
+    key_thread.join();
+    bulk_thread.join();
+    recv_thread.join();
+
+    std::sort(lat.begin(), lat.end());
+    printf("link_Bps=%.0f bulk_limit_Bps=%.0f keystrokes=%zu "
+           "bulk_kBps=%.1f latency_ms_p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+           link_rate,
+           bulk_rate,
+           lat.size(),
+           bulk_bytes / duration / 1000,
+           percentile(lat, 50),
+           percentile(lat, 90),
+           percentile(lat, 99),
+           lat.empty() ? 0 : lat.back());
+    return EXIT_SUCCESS;
+}
+
+// Window size changes sent through the telnet encoder while a paste
+// fills the link, as a client resized mid-paste would. Measures the
+// time from window_size() until the decoder on the far side sees it,
+// or a later size that replaced it.
+int resize_bench(double link_rate, double paste_rate, double duration, bool frames)
+{
+    constexpr auto resize_interval = std::chrono::milliseconds(50);
+    int link[2];
+    int paste[2];
+    make_pair(link);
+    make_pair(paste);
+
+    // Small socket buffer, like an RFCOMM socket.
+    const int sndbuf = 16 * 1024;
+    setsockopt(link[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(link[0], F_SETFL, fcntl(link[0], F_GETFL) | O_NONBLOCK);
+
+    StreamOptions opts;
+    opts.rate = paste_rate;
+    auto enc = std::make_unique<TelnetEncoderBuffer>();
+    const auto encp = enc.get();
+    if (frames) {
+        encp->use_frames();
+    }
+    Shuffler shuf;
+    shuf.copy(paste[0], link[0], std::move(enc), -1, opts);
+
+    const auto start = clock_type::now();
+    const auto end = start
+                     + std::chrono::duration_cast<clock_type::duration>(
+                         std::chrono::duration<double>(duration));
+    std::atomic<bool> done{ false };
+    std::vector<clock_type::time_point> resize_sent;
+    std::mutex resize_mu;
+
+    // Rows count up, to tell the changes apart.
+    std::function<void()> resize = [&] {
+        const auto now = clock_type::now();
+        if (now >= end) {
+            done = true;
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lk(resize_mu);
+            resize_sent.push_back(now);
+            encp->window_size(resize_sent.size(), 80);
+        }
+        shuf.at(now + resize_interval, resize);
+    };
+    shuf.at(start, resize);
+
+    std::thread paste_thread([&] {
+        std::string chunk(4096, 'p');
+        for (size_t i = 0; i < chunk.size(); i += 64) {
+            chunk[i] = static_cast<char>(0xff);
+        }
+        while (!done) {
+            write_all(paste[1], chunk);
+        }
+        close(paste[1]);
+    });
+
+    std::vector<double> lat;
+    size_t received = 0;
+    uint64_t paste_bytes = 0;
+    std::thread recv_thread([&] {
+        TelnetDecoderBuffer dec(
+            [&](uint16_t rows, uint16_t) {
+                const auto now = clock_type::now();
+                std::lock_guard<std::mutex> lk(resize_mu);
+                while (lat.size() < rows) {
+                    lat.push_back(std::chrono::duration<double, std::milli>(
+                                      now - resize_sent[lat.size()])
+                                      .count());
+                }
+                received++;
+            },
+            [](uint32_t) {},
+            [](uint32_t) {});
+        std::vector<char> buf(64 * 1024);
+        const auto tick = std::chrono::milliseconds(1);
+        const size_t per_tick = std::max<size_t>(1, link_rate / 1000);
+        for (;;) {
+            // Drain at link rate while measuring, then as fast as
+            // possible.
+            const auto want = done ? buf.size() : per_tick;
+            const auto rc = read(link[1], buf.data(), want);
+            if (rc <= 0) {
+                break;
+            }
+            dec.write({ buf.data(), static_cast<size_t>(rc) });
+            if (!done) {
+                paste_bytes += dec.peek().size();
+                std::this_thread::sleep_for(tick);
+            }
+            dec.ack(dec.peek().size());
+        }
+    });
+
+    shuf.run();
+    close(link[0]);
+    paste_thread.join();
+    recv_thread.join();
+
+    std::sort(lat.begin(), lat.end());
+    printf("link_Bps=%.0f paste_limit_Bps=%.0f resizes=%zu coalesced=%zu "
+           "paste_kBps=%.1f latency_ms_p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+           link_rate,
+           paste_rate,
+           resize_sent.size(),
+           resize_sent.size() - received,
+           paste_bytes / duration / 1000,
+           percentile(lat, 50),
+           percentile(lat, 90),
+           percentile(lat, 99),
+           lat.empty() ? 0 : lat.back());
+    return EXIT_SUCCESS;
+}
+} // namespace
+
+int wrapmain(int argc, char** argv)
+{
+    std::string mode = "raw";
+    double speed = 1;
+    bool dynamic = false;
+    double link_rate = 0;
+    double bulk_rate = 0;
+    double duration = 5;
+    double alloc_budget = -1;
+    StreamOptions opts;
+    bool pipelined = false;
+    std::optional<uint32_t> session;
+    {
+        int opt;
+        while ((opt = getopt(argc, argv, "a:b:Cd:hI:k:m:Ps:V")) != -1) {
+            switch (opt) {
+            case 'P':
+                pipelined = true;
+                break;
+            case 'C':
+                opts.cut_through = false;
+                break;
+            case 'a': {
+                char* end = nullptr;
+                alloc_budget = strtod(optarg, &end);
+                if (*end || alloc_budget < 0) {
+                    fprintf(stderr, "Invalid allocation budget <%s>\n", optarg);
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                if (!alloc::enabled) {
+                    fprintf(stderr, "-a needs a build with --enable-alloc-stats\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS);
+            case 'I': {
+                char* end = nullptr;
+                const auto v = strtoul(optarg, &end, 10);
+                if (*end || !*optarg || v > UINT32_MAX) {
+                    fprintf(stderr, "Invalid session <%s>\n", optarg);
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                session = v;
+                break;
+            }
+            case 'm':
+                mode = optarg;
+                if (mode != "raw" && mode != "telnet" && mode != "frames") {
+                    fprintf(stderr, "Unknown mode <%s>\n", optarg);
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            case 's': {
+                char* end = nullptr;
+                speed = strtod(optarg, &end);
+                if (*end || speed < 0) {
+                    fprintf(stderr, "Invalid speed <%s>\n", optarg);
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'V':
+                dynamic = true;
+                break;
+            case 'b':
+            case 'd':
+            case 'k': {
+                char* end = nullptr;
+                const auto v = strtod(optarg, &end);
+                if (*end || v <= 0) {
+                    fprintf(stderr, "Invalid -%c <%s>\n", opt, optarg);
+                    usage(argv[0], EXIT_FAILURE);
+                }
+                (opt == 'b' ? bulk_rate : opt == 'd' ? duration : link_rate) = v;
+                break;
+            }
+            default:
+                usage(argv[0], EXIT_FAILURE);
+            }
+        }
+    }
+    if (link_rate > 0) {
+        if (optind != argc) {
+            usage(argv[0], EXIT_FAILURE);
+        }
+        if (mode != "raw") {
+            return resize_bench(link_rate, bulk_rate, duration, mode == "frames");
+        }
+        return keystroke_bench(link_rate, bulk_rate, duration);
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    // Load capture, of one session, timed from its first event.
+    std::map<uint8_t, Direction> dirs;
+    std::set<uint32_t> others;
+    {
+        CaptureReader reader(argv[optind]);
+        CaptureEvent ev;
+        std::optional<uint64_t> first_usec;
+        while (reader.next(&ev)) {
+            if (!session) {
+                session = ev.session;
+            }
+            if (ev.session != *session) {
+                others.insert(ev.session);
+                continue;
+            }
+            if (!first_usec) {
+                first_usec = ev.usec;
+            }
+            ev.usec -= *first_usec;
+            auto& d = dirs[ev.dir];
+            d.dir = ev.dir;
+            const uint64_t prev = d.end_offset.empty() ? 0 : d.end_offset.back();
+            d.end_offset.push_back(prev + ev.len);
+            d.events.push_back(std::move(ev));
+        }
+    }
+    if (dirs.empty()) {
+        fprintf(stderr, "%s: no events for the session\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (!others.empty()) {
+        fprintf(stderr,
+                "Replaying session %u, skipping %zu others. Pick one with -I.\n",
+                *session,
+                others.size());
+    }
+
+    Shuffler shuf;
+    std::unique_ptr<Pipeline> pipe;
+    if (pipelined) {
+        pipe = std::make_unique<Pipeline>(shuf);
+        shuf.persist(true);
+        opts.on_close = [&shuf, open = std::make_shared<size_t>(dirs.size())](
+                            CloseReason, std::error_code) {
+            if (!--*open) {
+                shuf.stop();
+            }
+        };
+    }
+    for (auto& [_, d] : dirs) {
+        d.sent = std::make_unique<std::atomic<int64_t>[]>(d.events.size());
+        make_pair(d.in);
+        make_pair(d.out);
+        if (pipe) {
+            std::unique_ptr<Buffer> buf;
+            if (mode != "raw") {
+                buf = std::make_unique<ChainBuffer>(mode == "frames");
+            }
+            pipe->copy(d.in[0], d.out[0], std::move(buf), opts);
+        } else if (dynamic) {
+            std::unique_ptr<Buffer> buf;
+            if (mode != "raw") {
+                buf = std::make_unique<ChainBuffer>(mode == "frames");
+            } else {
+                buf = std::make_unique<RawBuffer>();
+            }
+            shuf.copy(d.in[0], d.out[0], std::move(buf), -1, opts);
+        } else if (mode != "raw") {
+            shuf.copy(d.in[0], d.out[0], ChainBuffer(mode == "frames"), -1, opts);
+        } else {
+            shuf.copy(d.in[0], d.out[0], RawBuffer(), -1, opts);
+        }
+    }
+
+    const auto start = clock_type::now();
+    std::vector<std::thread> threads;
+    for (auto& [_, d] : dirs) {
+        threads.emplace_back(feeder, &d, speed, start);
+        threads.emplace_back(receiver, &d, start);
+    }
+    const auto allocs_before = alloc::snapshot();
+    if (pipe) {
+        pipe->start();
+    }
+    shuf.run();
+    const auto allocs = alloc::since(allocs_before);
+    const auto stats = pipe ? pipe->stats() : shuf.stats();
+    pipe.reset();
+    for (auto& [_, d] : dirs) {
+        close(d.in[0]);
+        close(d.out[0]);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    uint64_t bytes = 0;
+    for (const auto& [_, d] : dirs) {
+        report(d, start);
+        bytes += d.end_offset.empty() ? 0 : d.end_offset.back();
+    }
+    report_stats(stats, bytes);
+    if (alloc::enabled && !report_allocs(allocs, bytes, alloc_budget)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -14,10 +14,13 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 #include "buffer.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <map>
+#include <random>
 #include <stdexcept>
 
 namespace {
@@ -26,11 +29,89 @@ constexpr char iac = static_cast<char>(255);
 constexpr char iac_window_size = 1;
 constexpr char iac_ping = 2;
 constexpr char iac_pong = 3;
+
+// Pings that negotiate v2 framing, rather than check the link.
+constexpr uint32_t hello_cookie = 0x42547632; // "BTv2"
+constexpr uint32_t frames_cookie = 0x4254676f; // "BTgo"
+
+// Sent back by a listener that understands v2 framing, with the nonce
+// the client sent after the hello. Shaped like a telnet subnegotiation,
+// IAC SB ... IAC SE. The nonce only ever goes over the link as a ping,
+// which no listener passes on, so a program can't print the reply
+// itself.
+std::string hello_reply(uint32_t nonce)
+{
+    std::string ret = "\xFF\xFA"
+                      "BTv2";
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        ret.push_back(static_cast<char>(nonce >> shift));
+    }
+    return ret + "\xFF\xF0";
+}
+
+// A listener replies after output it had already queued, at most about
+// a high watermark. Past this much output, stop looking: it's an old
+// listener, and the program may print the reply's bytes itself.
+constexpr size_t hello_reply_window = 256 * 1024;
 } // namespace telnet
 
+// v2 frames are <type> <length, 2 bytes> <length bytes>.
+namespace frames {
+constexpr char data = 0;
+constexpr size_t header_size = 3;
+constexpr size_t max_length = 0xffff;
+
+size_t length(const char* header)
+{
+    return static_cast<uint8_t>(header[1]) << 8 | static_cast<uint8_t>(header[2]);
+}
+} // namespace frames
+
+uint32_t get_be32(const char* p)
+{
+    return uint32_t{ static_cast<uint8_t>(p[0]) } << 24
+           | uint32_t{ static_cast<uint8_t>(p[1]) } << 16
+           | uint32_t{ static_cast<uint8_t>(p[2]) } << 8 | static_cast<uint8_t>(p[3]);
+}
+
 } // namespace
 
-void TelnetDecoderBuffer::write(std::string_view sv)
+// A control message, in either framing. Unknown types are only an error
+// in the IAC framing, where their length isn't known.
+void TelnetDecoderBuffer::control(char type, const char* arg)
+{
+    PROBE(iac, static_cast<uint8_t>(type));
+    switch (type) {
+    case telnet::iac_ping: {
+        const auto cookie = get_be32(arg);
+        if (nonce_next_) {
+            nonce_next_ = false;
+            if (hello_) {
+                hello_(telnet::hello_reply(cookie));
+            }
+        } else if (cookie == telnet::hello_cookie) {
+            nonce_next_ = true;
+        } else if (cookie == telnet::frames_cookie) {
+            frames_ = true;
+        } else {
+            ping_(cookie);
+        }
+        break;
+    }
+    case telnet::iac_pong:
+        pong_(get_be32(arg));
+        break;
+    case telnet::iac_window_size: {
+        const auto ws = get_be32(arg);
+        winch_(ws >> 16, ws & 0xffff);
+        break;
+    }
+    }
+}
+
+// Returns how much was used, which is less than all of it if the rest
+// is in v2 framing.
+size_t TelnetDecoderBuffer::write_iac(std::string_view sv)
 {
     static const std::map<char, int> iac_sizes = {
         { telnet::iac, 2 },
@@ -38,119 +119,199 @@ void TelnetDecoderBuffer::write(std::string_view sv)
         { telnet::iac_ping, 6 },
         { telnet::iac_pong, 6 },
     };
-    std::vector<char> to_add;
-    std::vector<char> tbuf = iac_buffer_;
-    for (const auto& ch : sv) {
-        // Normal data.
-        if (tbuf.empty() && (ch != telnet::iac)) {
-            to_add.push_back(ch);
-            continue;
+    size_t used = 0;
+    while (used < sv.size() && !frames_) {
+        // Normal data, up to the next IAC.
+        if (iac_buffer_.empty()) {
+            const auto end = std::min(sv.find(telnet::iac, used), sv.size());
+            data_.insert(data_.end(), sv.begin() + used, sv.begin() + end);
+            used = end;
+            if (used == sv.size()) {
+                break;
+            }
         }
 
         // Add to iac buffer.
-        tbuf.push_back(ch);
-        if (tbuf.size() == 1) {
+        iac_buffer_.push_back(sv[used++]);
+        if (iac_buffer_.size() == 1) {
             continue;
         }
 
         // Check if iac buffer is full.
-        const auto type = tbuf[1];
+        const auto type = iac_buffer_[1];
         const auto siz = iac_sizes.find(type);
         if (siz == iac_sizes.end()) {
             throw std::runtime_error("invalid iac");
         }
-        if (tbuf.size() == siz->second) {
-            switch (type) {
-            case telnet::iac:
-                to_add.push_back(telnet::iac);
-                break;
-            case telnet::iac_ping: {
-                uint32_t cookie = 0;
-                cookie |= tbuf[2] << 24;
-                cookie |= tbuf[3] << 16;
-                cookie |= tbuf[4] << 8;
-                cookie |= tbuf[5];
-                ping_(cookie);
-                break;
-            }
-            case telnet::iac_pong: {
-                uint32_t cookie = 0;
-                cookie |= tbuf[2] << 24;
-                cookie |= tbuf[3] << 16;
-                cookie |= tbuf[4] << 8;
-                cookie |= tbuf[5];
-                pong_(cookie);
-                break;
-            }
-            case telnet::iac_window_size: {
-                uint16_t rows = 0;
-                uint16_t cols = 0;
-                rows |= tbuf[2] << 8;
-                rows |= tbuf[3];
-                cols |= tbuf[4] << 8;
-                cols |= tbuf[5];
-                winch_(rows, cols);
-                break;
+        if (iac_buffer_.size() == siz->second) {
+            if (type == telnet::iac) {
+                data_.push_back(telnet::iac);
+            } else {
+                control(type, &iac_buffer_[2]);
             }
-            }
-            tbuf.clear();
+            iac_buffer_.clear();
+        }
+    }
+    return used;
+}
+
+// Payload is copied a frame at a time. Only headers and control frames
+// go through iac_buffer_.
+void TelnetDecoderBuffer::write_frames(std::string_view sv)
+{
+    while (!sv.empty()) {
+        if (frame_left_) {
+            const auto n = std::min(frame_left_, sv.size());
+            data_.insert(data_.end(), sv.begin(), sv.begin() + n);
+            sv.remove_prefix(n);
+            frame_left_ -= n;
+            continue;
         }
+        iac_buffer_.push_back(sv.front());
+        sv.remove_prefix(1);
+        if (iac_buffer_.size() < frames::header_size) {
+            continue;
+        }
+        const auto type = iac_buffer_[0];
+        const auto len = frames::length(&iac_buffer_[0]);
+        if (type == frames::data) {
+            frame_left_ = len;
+            iac_buffer_.clear();
+            continue;
+        }
+        if (iac_buffer_.size() < frames::header_size + len) {
+            continue;
+        }
+        if (len == 4) {
+            control(type, &iac_buffer_[frames::header_size]);
+        }
+        iac_buffer_.clear();
+    }
+}
+
+void TelnetDecoderBuffer::write(std::string_view sv)
+{
+    if (!frames_) {
+        sv.remove_prefix(write_iac(sv));
+    }
+    if (frames_) {
+        write_frames(sv);
     }
-    iac_buffer_ = tbuf;
-    data_.insert(data_.end(), to_add.begin(), to_add.end());
 }
 
+// In v2 framing, data is copied as is into a frame, merging with the
+// frame at the end if that hasn't started being sent.
 void TelnetEncoderBuffer::write(std::string_view sv)
 {
-    for (const auto& ch : sv) {
-        data_.push_back(ch);
-        if (ch == telnet::iac) {
-            data_.push_back(ch);
+    if (!frames_) {
+        while (!sv.empty()) {
+            const auto n = std::min(sv.find(telnet::iac), sv.size() - 1) + 1;
+            data_.insert(data_.end(), sv.begin(), sv.begin() + n);
+            if (data_.back() == telnet::iac) {
+                data_.push_back(telnet::iac);
+            }
+            sv.remove_prefix(n);
+        }
+        return;
+    }
+    while (!sv.empty()) {
+        if (last_data_at_ == std::string_view::npos
+            || frames::length(&data_[last_data_at_]) == frames::max_length) {
+            last_data_at_ = data_.size();
+            data_.insert(data_.end(), { frames::data, 0, 0 });
         }
+        auto* header = &data_[last_data_at_];
+        const auto len = frames::length(header);
+        const auto n = std::min(frames::max_length - len, sv.size());
+        header[1] = 0xff & ((len + n) >> 8);
+        header[2] = 0xff & (len + n);
+        data_.insert(data_.end(), sv.begin(), sv.begin() + n);
+        sv.remove_prefix(n);
     }
 }
 
+// Insert a control message after the urgent bytes. Data after them
+// starts on an IAC or frame boundary, so this can't split an escape or
+// a frame. Returns where its argument is.
+size_t TelnetEncoderBuffer::queue_control(char type, uint32_t arg)
+{
+    const char arg_bytes[] = {
+        static_cast<char>(0xff & (arg >> 24)),
+        static_cast<char>(0xff & (arg >> 16)),
+        static_cast<char>(0xff & (arg >> 8)),
+        static_cast<char>(0xff & arg),
+    };
+    char msg[frames::header_size + sizeof arg_bytes];
+    size_t len = 0;
+    if (frames_) {
+        msg[len++] = type;
+        msg[len++] = 0;
+        msg[len++] = sizeof arg_bytes;
+    } else {
+        msg[len++] = telnet::iac;
+        msg[len++] = type;
+    }
+    std::copy(std::begin(arg_bytes), std::end(arg_bytes), msg + len);
+    len += sizeof arg_bytes;
+    data_.insert(data_.begin() + urgent_, msg, msg + len);
+    if (last_data_at_ != std::string_view::npos) {
+        last_data_at_ += len;
+    }
+    urgent_ += len;
+    return urgent_ - sizeof arg_bytes;
+}
+
 void TelnetEncoderBuffer::window_size(uint16_t rows, uint16_t cols)
 {
-    data_.push_back(telnet::iac);
-    data_.push_back(telnet::iac_window_size);
-    data_.push_back(0xff & (rows >> 8));
-    data_.push_back(0xff & rows);
-    data_.push_back(0xff & (cols >> 8));
-    data_.push_back(0xff & cols);
+    if (window_at_ != std::string_view::npos) {
+        data_[window_at_] = 0xff & (rows >> 8);
+        data_[window_at_ + 1] = 0xff & rows;
+        data_[window_at_ + 2] = 0xff & (cols >> 8);
+        data_[window_at_ + 3] = 0xff & cols;
+        return;
+    }
+    window_at_ = queue_control(telnet::iac_window_size, uint32_t{ rows } << 16 | cols);
 }
 
 void TelnetEncoderBuffer::ping(uint32_t cookie)
 {
-    data_.push_back(telnet::iac);
-    data_.push_back(telnet::iac_ping);
-    data_.push_back(0xff & (cookie >> 24));
-    data_.push_back(0xff & (cookie >> 16));
-    data_.push_back(0xff & (cookie >> 8));
-    data_.push_back(0xff & cookie);
+    queue_control(telnet::iac_ping, cookie);
 }
 
 void TelnetEncoderBuffer::pong(uint32_t cookie)
 {
-    data_.push_back(telnet::iac);
-    data_.push_back(telnet::iac_pong);
-    data_.push_back(0xff & (cookie >> 24));
-    data_.push_back(0xff & (cookie >> 16));
-    data_.push_back(0xff & (cookie >> 8));
-    data_.push_back(0xff & cookie);
+    queue_control(telnet::iac_pong, cookie);
 }
 
-void RawBuffer::write(std::string_view sv)
+uint32_t TelnetEncoderBuffer::hello()
 {
-    data_.insert(data_.end(), sv.begin(), sv.end());
+    std::random_device rd;
+    uint32_t nonce;
+    do {
+        nonce = rd();
+    } while (nonce == telnet::hello_cookie || nonce == telnet::frames_cookie);
+    queue_control(telnet::iac_ping, telnet::hello_cookie);
+    queue_control(telnet::iac_ping, nonce);
+    return nonce;
 }
 
-std::string_view RawBuffer::peek() const
+void TelnetEncoderBuffer::use_frames()
 {
+    if (frames_) {
+        return;
+    }
+    frames_pending_ = true;
     if (data_.empty()) {
-        return {};
+        start_frames();
     }
-    return { &data_[0], data_.size() };
+}
+
+// Everything queued has been sent, so the switch can go at the front.
+void TelnetEncoderBuffer::start_frames()
+{
+    queue_control(telnet::iac_ping, telnet::frames_cookie);
+    frames_pending_ = false;
+    frames_ = true;
 }
 
 std::string_view TelnetEncoderBuffer::peek() const
@@ -176,7 +337,35 @@ void TelnetEncoderBuffer::ack(size_t n)
                                     + std::to_string(n) + " > "
                                     + std::to_string(data_.size()));
     }
+    if (window_at_ != std::string_view::npos) {
+        window_at_ = window_at_ < n ? std::string_view::npos : window_at_ - n;
+    }
+    if (last_data_at_ != std::string_view::npos) {
+        last_data_at_ = last_data_at_ < n ? std::string_view::npos : last_data_at_ - n;
+    }
+    if (n <= urgent_) {
+        urgent_ -= n;
+    } else if (frames_) {
+        // Data sent starts on a frame boundary. The rest of the last
+        // frame it got into is still to go.
+        auto end = urgent_;
+        while (end < n) {
+            end += frames::header_size + frames::length(&data_[end]);
+        }
+        urgent_ = end - n;
+    } else {
+        // Data sent starts on an IAC boundary, so an odd run of IACs at
+        // its end means the rest of an escape is still to go.
+        size_t run = 0;
+        while (n - run > urgent_ && data_[n - run - 1] == telnet::iac) {
+            run++;
+        }
+        urgent_ = run % 2;
+    }
     data_.erase(data_.begin(), data_.begin() + n);
+    if (frames_pending_ && data_.empty()) {
+        start_frames();
+    }
 }
 
 void TelnetDecoderBuffer::ack(size_t n)
@@ -189,14 +378,98 @@ void TelnetDecoderBuffer::ack(size_t n)
     data_.erase(data_.begin(), data_.begin() + n);
 }
 
-void RawBuffer::ack(size_t n)
+void TelnetEncoderBuffer::restore(std::string_view output, std::string_view)
 {
-    if (n > data_.size()) {
-        throw std::invalid_argument("RawBuffer::ack(): n > data_.size(): "
-                                    + std::to_string(n) + " > "
-                                    + std::to_string(data_.size()));
+    // Where the control messages and escapes are isn't handed over, so
+    // new control messages go after all of it.
+    data_.assign(output.begin(), output.end());
+    urgent_ = data_.size();
+    window_at_ = std::string_view::npos;
+    last_data_at_ = std::string_view::npos;
+    frames_ = frames_pending_ = false;
+}
+
+// In v2 framing, "v2" and then the frame read so far. Half way through
+// a data frame's payload, that's a header for the rest of it.
+std::string_view TelnetDecoderBuffer::partial() const
+{
+    if (frames_) {
+        partial_ = "v2";
+        if (frame_left_) {
+            partial_ += frames::data;
+            partial_ += static_cast<char>(0xff & (frame_left_ >> 8));
+            partial_ += static_cast<char>(0xff & frame_left_);
+        } else {
+            partial_.append(iac_buffer_.begin(), iac_buffer_.end());
+        }
+        return partial_;
     }
-    data_.erase(data_.begin(), data_.begin() + n);
+    if (iac_buffer_.empty()) {
+        return {};
+    }
+    return { &iac_buffer_[0], iac_buffer_.size() };
+}
+
+void TelnetDecoderBuffer::restore(std::string_view output, std::string_view partial)
+{
+    data_.assign(output.begin(), output.end());
+    frame_left_ = 0;
+    iac_buffer_.clear();
+    frames_ = partial.substr(0, 2) == "v2";
+    if (frames_) {
+        // Never a whole control frame, so no callbacks.
+        write_frames(partial.substr(2));
+    } else {
+        iac_buffer_.assign(partial.begin(), partial.end());
+    }
+}
+
+HelloReplyTap::HelloReplyTap(std::unique_ptr<Buffer> next,
+                             uint32_t nonce,
+                             std::function<void()> on_reply)
+    : next_(std::move(next)),
+      on_reply_(std::move(on_reply)),
+      reply_(telnet::hello_reply(nonce))
+{
+}
+
+void HelloReplyTap::write(std::string_view sv)
+{
+    if (done_) {
+        next_->write(sv);
+        return;
+    }
+    std::string joined;
+    if (!held_.empty()) {
+        joined = held_ + std::string(sv);
+        held_.clear();
+        sv = joined;
+    }
+    scanned_ += sv.size();
+    if (scanned_ > telnet::hello_reply_window) {
+        done_ = true;
+        next_->write(sv);
+        return;
+    }
+    const auto pos = sv.find(reply_);
+    if (pos != std::string_view::npos) {
+        done_ = true;
+        next_->write(sv.substr(0, pos));
+        on_reply_();
+        next_->write(sv.substr(pos + reply_.size()));
+        return;
+    }
+
+    // Hold back what could be the start of the reply.
+    const std::string_view reply = reply_;
+    for (auto n = std::min(sv.size(), reply.size() - 1); n > 0; n--) {
+        if (sv.substr(sv.size() - n) == reply.substr(0, n)) {
+            held_ = sv.substr(sv.size() - n);
+            sv.remove_suffix(n);
+            break;
+        }
+    }
+    next_->write(sv);
 }
 
 #if 0
@@ -222,8 +495,8 @@ int main()
         assert(buf.peek() == "y\xFF\xFFo");
         buf.ping(0x41424344);
         assert(buf.peek()
-               == "y\xFF\xFFo\xFF\x02"
-                  "ABCD");
+               == "\xFF\x02"
+                  "ABCDy\xFF\xFFo");
         buf.ack(buf.peek().size());
 
         // Pong.
@@ -238,7 +511,39 @@ int main()
         buf.write("yo");
         buf.window_size(0x4142, 0x4344);
         buf.write("plait");
-        assert(buf.peek() == "yo\xFF\x01\x41\x42\x43\x44plait");
+        assert(buf.peek() == "\xFF\x01\x41\x42\x43\x44yoplait");
+        buf.ack(buf.peek().size());
+
+        // Coalesced until sent, and kept in order with pings.
+        buf.write("ab");
+        buf.window_size(1, 2);
+        buf.ping(0x41424344);
+        buf.window_size(0x4142, 0x4344);
+        assert(buf.peek() == "\xFF\x01\x41\x42\x43\x44\xFF\x02"
+                             "ABCDab");
+        buf.ack(2);
+        buf.window_size(1, 2);
+        assert(buf.peek()
+               == std::string_view("\x00\x01\x00\x02\xFF\x02"
+                                   "ABCDab",
+                                   12));
+        buf.ack(1);
+        buf.window_size(3, 4);
+        assert(buf.peek()
+               == std::string_view("\x01\x00\x02\xFF\x02"
+                                   "ABCD\xFF\x01\x00\x03\x00\x04"
+                                   "ab",
+                                   17));
+        buf.ack(buf.peek().size());
+
+        // Not inside an escape.
+        buf.write("a\xFF"
+                  "b");
+        buf.ack(2);
+        buf.pong(0x44434241);
+        assert(buf.peek()
+               == "\xFF\xFF\x03"
+                  "DCBAb");
     }
 
     {
@@ -276,5 +581,79 @@ int main()
 	std::vector<std::pair<uint16_t, uint16_t>> want = {{0x4142, 0x4344}};
 	assert(winchs == want);
     }
+
+    {
+        // Handshake, and then v2 framing.
+        TelnetEncoderBuffer enc;
+        std::string reply;
+        std::vector<std::pair<uint16_t, uint16_t>> winchs;
+        TelnetDecoderBuffer dec(
+            [&winchs](uint16_t rows, uint16_t cols) { winchs.push_back({ rows, cols }); },
+            [](uint32_t) {},
+            [](uint32_t) {},
+            [&reply](std::string_view r) { reply = r; });
+        const auto nonce = enc.hello();
+        enc.write("a\xFF");
+        dec.write(enc.peek());
+        enc.ack(enc.peek().size());
+        assert(reply == telnet::hello_reply(nonce));
+        assert(dec.peek() == "a\xFF");
+        dec.ack(2);
+
+        enc.use_frames();
+        enc.write("b\xFF");
+        enc.write("c");
+        assert(enc.peek()
+               == std::string_view("\xFF\x02"
+                                   "BTgo\x00\x00\x03"
+                                   "b\xFF"
+                                   "c",
+                                   12));
+        dec.write(enc.peek().substr(0, 8));
+        dec.write(enc.peek().substr(8));
+        enc.ack(enc.peek().size());
+        assert(dec.peek() == "b\xFF"
+                             "c");
+        dec.ack(3);
+
+        // Control frames go ahead, even of a frame half sent.
+        enc.write("hello");
+        dec.write(enc.peek().substr(0, 5));
+        enc.ack(5);
+        assert(dec.partial() == std::string_view("v2\x00\x00\x03", 5));
+        enc.window_size(1, 2);
+        enc.write("!");
+        assert(enc.peek()
+               == std::string_view("llo\x01\x00\x04\x00\x01\x00\x02\x00\x00\x01!", 14));
+        dec.write(enc.peek());
+        assert(dec.peek() == "hello!");
+        assert(winchs == (std::vector<std::pair<uint16_t, uint16_t>>{ { 1, 2 } }));
+    }
+
+    {
+        bool seen = false;
+        HelloReplyTap tap2(
+            std::make_unique<RawBuffer>(), 0x01020304, [&seen] { seen = true; });
+        // Without the nonce, it's program output.
+        tap2.write("\xFF\xFA"
+                   "BTv2\xFF\xF0");
+        assert(!seen);
+        tap2.ack(tap2.peek().size());
+        tap2.write("x\xFF");
+        assert(tap2.peek() == "x");
+        tap2.write("\xFA"
+                   "BTv2\x01\x02\x03\x04\xFF\xF0y");
+        assert(seen);
+        assert(tap2.peek() == "xy");
+
+        // Gives up on old listeners.
+        bool late = false;
+        HelloReplyTap tap3(
+            std::make_unique<RawBuffer>(), 0x01020304, [&late] { late = true; });
+        tap3.write(std::string(300 * 1024, 'x'));
+        tap3.write(telnet::hello_reply(0x01020304));
+        assert(!late);
+        assert(tap3.peek().size() == 300 * 1024 + 12);
+    }
 }
 #endif
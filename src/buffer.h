@@ -18,6 +18,9 @@ limitations under the License.
 #include <cstdint>
 #include <string_view>
 #include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 class Buffer
@@ -46,14 +49,51 @@ public:
     virtual void ack(size_t n) = 0;
 
     bool empty() const { return peek().empty(); }
+
+    // Input written but not yet turned into output, e.g. half an escape
+    // sequence. Used to carry a buffer over to another process.
+    virtual std::string_view partial() const { return {}; }
+
+    // Set state from what peek() and partial() returned for a buffer of
+    // the same type. Only buffers a listener hands over implement it.
+    virtual void restore(std::string_view, std::string_view)
+    {
+        throw std::logic_error("Buffer::restore(): not supported");
+    }
 };
 
-class RawBuffer : public Buffer
+// Defined inline, so that the stream path can be inlined when the
+// buffer type is known at compile time.
+class RawBuffer final : public Buffer
 {
 public:
-    void write(std::string_view sv) override;
-    std::string_view peek() const override;
-    void ack(size_t n) override;
+    void write(std::string_view sv) override
+    {
+        data_.insert(data_.end(), sv.begin(), sv.end());
+    }
+
+    std::string_view peek() const override
+    {
+        if (data_.empty()) {
+            return {};
+        }
+        return { &data_[0], data_.size() };
+    }
+
+    void ack(size_t n) override
+    {
+        if (n > data_.size()) {
+            throw std::invalid_argument("RawBuffer::ack(): n > data_.size(): "
+                                        + std::to_string(n) + " > "
+                                        + std::to_string(data_.size()));
+        }
+        data_.erase(data_.begin(), data_.begin() + n);
+    }
+
+    void restore(std::string_view output, std::string_view) override
+    {
+        data_.assign(output.begin(), output.end());
+    }
 
 private:
     // TODO: optimization opportunity: partial consumtion of data could
@@ -61,42 +101,182 @@ private:
     std::vector<char> data_;
 };
 
-class TelnetEncoderBuffer : public Buffer
+// Terminal sessions are sent in one of two framings:
+//
+// * IAC: data as is, except for 0xff which is doubled, and control
+//   messages as 0xff <type> <4 bytes>. Every byte has to be looked at.
+// * v2: <type> <length, 2 bytes> <payload> frames. Type 0 is data, the
+//   others are control messages. Data is copied without looking at it.
+//
+// Sessions start in IAC framing. A client offers v2 with hello(), which
+// a listener that understands it answers with a reply in its output,
+// carrying a nonce from the client. Once the client has seen that,
+// use_frames() sends a marker, and everything after it is in v2 framing.
+// Old listeners take the hello, the nonce and the marker for pings, and
+// old clients never send them.
+class TelnetEncoderBuffer final : public Buffer
 {
 public:
     void write(std::string_view sv) override;
     std::string_view peek() const override;
     void ack(size_t n) override;
+    void restore(std::string_view output, std::string_view partial) override;
 
+    // Control messages skip ahead of data not yet sent, staying in
+    // order among themselves. A window size not yet started being sent
+    // is replaced by a newer one.
     void ping(uint32_t cookie);
     void pong(uint32_t cookie);
     void window_size(uint16_t rows, uint16_t cols);
 
+    // Offer v2 framing. Returns the nonce the reply will carry.
+    uint32_t hello();
+
+    // Switch to v2 framing, once everything already queued has been
+    // sent.
+    void use_frames();
+
 private:
+    size_t queue_control(char type, uint32_t arg);
+    void start_frames();
+
     std::vector<char> data_;
+    bool frames_ = false;
+    bool frames_pending_ = false;
+
+    // Bytes at the start of data_ that must go before any new control
+    // message: earlier control messages, or the rest of an escaped IAC
+    // or a frame that has started being sent.
+    size_t urgent_ = 0;
+
+    // Offset in data_ of the size in a window size message not yet sent,
+    // if any.
+    size_t window_at_ = std::string_view::npos;
+
+    // Offset in data_ of the last data frame, if it hasn't started being
+    // sent.
+    size_t last_data_at_ = std::string_view::npos;
 };
 
-class TelnetDecoderBuffer : public Buffer
+class TelnetDecoderBuffer final : public Buffer
 {
 public:
     using ping_handler_t = std::function<void(uint32_t)>;
     using window_size_handler_t = std::function<void(uint16_t, uint16_t)>;
+
+    // Called with what to send back to a client offering v2 framing.
+    // Without it, the offer is ignored.
+    using hello_handler_t = std::function<void(std::string_view)>;
+
     TelnetDecoderBuffer(window_size_handler_t winch,
                         ping_handler_t ping,
-                        ping_handler_t pong)
-        : winch_(std::move(winch)), ping_(std::move(ping)), pong_(std::move(pong))
+                        ping_handler_t pong,
+                        hello_handler_t hello = nullptr)
+        : winch_(std::move(winch)),
+          ping_(std::move(ping)),
+          pong_(std::move(pong)),
+          hello_(std::move(hello))
     {
     }
 
     void write(std::string_view sv) override;
     std::string_view peek() const override;
     void ack(size_t n) override;
+    std::string_view partial() const override;
+    void restore(std::string_view output, std::string_view partial) override;
 
 private:
+    void control(char type, const char* arg);
+    size_t write_iac(std::string_view sv);
+    void write_frames(std::string_view sv);
+
     ping_handler_t ping_;
     ping_handler_t pong_;
     window_size_handler_t winch_;
+    hello_handler_t hello_;
     std::vector<char> data_;
+
+    // Escape or frame header read so far, or the whole control frame.
     std::vector<char> iac_buffer_;
+
+    bool frames_ = false;
+
+    // The next ping is the nonce following a hello.
+    bool nonce_next_ = false;
+
+    // Payload left of the current data frame.
+    size_t frame_left_ = 0;
+
+    mutable std::string partial_;
+};
+
+// Passes output from a listener on to another buffer, taking out the
+// reply to TelnetEncoderBuffer::hello() that returned nonce, and calling
+// on_reply when it's seen. Only the start of the output is searched, so
+// that an old listener's sessions aren't scanned throughout.
+class HelloReplyTap final : public Buffer
+{
+public:
+    HelloReplyTap(std::unique_ptr<Buffer> next,
+                  uint32_t nonce,
+                  std::function<void()> on_reply);
+
+    void write(std::string_view sv) override;
+    std::string_view peek() const override { return next_->peek(); }
+    void ack(size_t n) override { next_->ack(n); }
+
+private:
+    std::unique_ptr<Buffer> next_;
+    std::function<void()> on_reply_;
+    std::string reply_;
+
+    // Reply seen, or given up on.
+    bool done_ = false;
+    size_t scanned_ = 0;
+
+    // End of the last write, if it could be the start of the reply.
+    std::string held_;
+};
+
+// Buf's output, followed by replies to the other direction (e.g. to
+// TelnetEncoderBuffer::hello()) whenever all of that has been sent, so
+// that a reply never lands inside an escape sequence. Replies are
+// appended to the shared string.
+template <typename Buf>
+class ReplyBuffer final : public Buffer
+{
+public:
+    ReplyBuffer(Buf&& buf, std::shared_ptr<std::string> replies)
+        : buf_(std::move(buf)), replies_(std::move(replies))
+    {
+    }
+
+    void write(std::string_view sv) override { buf_.write(sv); }
+
+    std::string_view peek() const override
+    {
+        const auto ret = buf_.peek();
+        return ret.empty() ? std::string_view(*replies_) : ret;
+    }
+
+    void ack(size_t n) override
+    {
+        if (buf_.peek().empty()) {
+            replies_->erase(0, n);
+        } else {
+            buf_.ack(n);
+        }
+    }
+
+    std::string_view partial() const override { return buf_.partial(); }
+
+    void restore(std::string_view output, std::string_view partial) override
+    {
+        buf_.restore(output, partial);
+    }
+
+private:
+    Buf buf_;
+    std::shared_ptr<std::string> replies_;
 };
 #endif
@@ -0,0 +1,169 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "capture.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace bthelper {
+
+namespace {
+const std::string magic = "BTHCAP2\n";
+constexpr size_t header_size = 8 + 4 + 1 + 1 + 4;
+constexpr uint8_t flag_payload = 1;
+
+// Flush to disk once this much is buffered.
+constexpr size_t flush_size = 64 * 1024;
+
+void put_be(std::vector<char>& out, uint64_t v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--) {
+        out.push_back(0xff & (v >> (8 * i)));
+    }
+}
+
+uint64_t get_be(const char* p, int bytes)
+{
+    uint64_t ret = 0;
+    for (int i = 0; i < bytes; i++) {
+        ret = (ret << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return ret;
+}
+} // namespace
+
+CaptureWriter::CaptureWriter(const std::string& fn, bool payload)
+    : payload_(payload), start_(std::chrono::steady_clock::now())
+{
+    fd_ = open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd_ < 0) {
+        throw std::system_error(errno, std::generic_category(), "open(" + fn + ")");
+    }
+    buf_.insert(buf_.end(), magic.begin(), magic.end());
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    flush();
+    close(fd_);
+}
+
+void CaptureWriter::record(uint8_t dir, std::string_view data, uint32_t session)
+{
+    const auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start_)
+                          .count();
+    put_be(buf_, usec, 8);
+    put_be(buf_, session, 4);
+    put_be(buf_, dir, 1);
+    put_be(buf_, payload_ ? flag_payload : 0, 1);
+    put_be(buf_, data.size(), 4);
+    if (payload_) {
+        buf_.insert(buf_.end(), data.begin(), data.end());
+    }
+    if (buf_.size() >= flush_size) {
+        flush();
+    }
+}
+
+std::function<void(std::string_view)> CaptureWriter::observer(uint8_t dir,
+                                                              uint32_t session)
+{
+    return [this, dir, session](std::string_view data) { record(dir, data, session); };
+}
+
+void CaptureWriter::flush()
+{
+    size_t pos = 0;
+    while (pos < buf_.size()) {
+        const auto rc = write(fd_, buf_.data() + pos, buf_.size() - pos);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Not worth killing the session over.
+            LOG(error) << "Capture write failed, dropping data: " << strerror(errno);
+            break;
+        }
+        pos += rc;
+    }
+    buf_.clear();
+}
+
+CaptureReader::CaptureReader(const std::string& fn)
+{
+    fd_ = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+        throw std::system_error(errno, std::generic_category(), "open(" + fn + ")");
+    }
+    std::string m(magic.size(), 0);
+    if (!read_exact(m.data(), m.size()) || m != magic) {
+        close(fd_);
+        throw std::runtime_error(fn + " is not a capture file");
+    }
+}
+
+CaptureReader::~CaptureReader() { close(fd_); }
+
+bool CaptureReader::read_exact(char* p, size_t n)
+{
+    size_t got = 0;
+    while (got < n) {
+        const auto rc = read(fd_, p + got, n - got);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "read(capture)");
+        }
+        if (rc == 0) {
+            if (got) {
+                throw std::runtime_error("truncated capture record");
+            }
+            return false;
+        }
+        got += rc;
+    }
+    return true;
+}
+
+bool CaptureReader::next(CaptureEvent* ev)
+{
+    char hdr[header_size];
+    if (!read_exact(hdr, sizeof(hdr))) {
+        return false;
+    }
+    ev->usec = get_be(hdr, 8);
+    ev->session = get_be(hdr + 8, 4);
+    ev->dir = get_be(hdr + 12, 1);
+    const auto flags = get_be(hdr + 13, 1);
+    ev->len = get_be(hdr + 14, 4);
+    ev->has_payload = flags & flag_payload;
+    ev->payload.clear();
+    if (ev->has_payload) {
+        ev->payload.resize(ev->len);
+        if (ev->len && !read_exact(ev->payload.data(), ev->len)) {
+            throw std::runtime_error("truncated capture payload");
+        }
+    }
+    return true;
+}
+
+} // namespace bthelper
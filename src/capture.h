@@ -0,0 +1,97 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Traffic capture, for replaying real sessions in benchmarks.
+ *
+ * File format, all integers big endian:
+ *   "BTHCAP2\n"
+ *   Records:
+ *     u64 microseconds since capture start
+ *     u32 session, to tell apart those of a listener serving several
+ *     u8  direction (see below)
+ *     u8  flags (bit 0: payload follows)
+ *     u32 length of the read
+ *     payload, if flagged
+ */
+#ifndef __INCLUDE_CAPTURE_H__
+#define __INCLUDE_CAPTURE_H__
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bthelper {
+
+// Directions, as seen from the local end.
+constexpr uint8_t dir_from_bt = 0;
+constexpr uint8_t dir_to_bt = 1;
+
+class CaptureWriter
+{
+public:
+    // Throws std::system_error if the file can't be created.
+    CaptureWriter(const std::string& fn, bool payload);
+    ~CaptureWriter();
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    void record(uint8_t dir, std::string_view data, uint32_t session = 0);
+
+    // For use as StreamOptions::on_read.
+    std::function<void(std::string_view)> observer(uint8_t dir, uint32_t session = 0);
+
+    void flush();
+
+private:
+    int fd_ = -1;
+    const bool payload_;
+    const std::chrono::steady_clock::time_point start_;
+    std::vector<char> buf_;
+};
+
+struct CaptureEvent {
+    uint64_t usec;
+    uint32_t session;
+    uint8_t dir;
+    uint32_t len;
+    bool has_payload;
+    std::string payload;
+};
+
+class CaptureReader
+{
+public:
+    // Throws std::system_error if the file can't be opened, and
+    // std::runtime_error if it's not a capture file.
+    explicit CaptureReader(const std::string& fn);
+    ~CaptureReader();
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    // Returns false at end of file. Throws std::runtime_error on
+    // truncated records.
+    bool next(CaptureEvent* ev);
+
+private:
+    bool read_exact(char* p, size_t n);
+    int fd_ = -1;
+};
+
+} // namespace bthelper
+#endif
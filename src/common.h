@@ -13,6 +13,8 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#ifndef __INCLUDE_COMMON_H__
+#define __INCLUDE_COMMON_H__
 #include "buffer.h"
 #include <sys/socket.h>
 
@@ -34,6 +36,11 @@ struct sockaddr_rc {
     uint8_t rc_channel;
 };
 constexpr int BTPROTO_RFCOMM = 3;
+constexpr int BT_SNDMTU = 12;
+
+// The kernel default RFCOMM MTU is the L2CAP MTU (1013) minus RFCOMM
+// framing. Used when the socket won't tell us.
+constexpr size_t RFCOMM_DEFAULT_MTU = 1008;
 
 bool parse_addr(const std::string& in, bdaddr_t* out);
 std::string stringify_addr(const bdaddr_t* out);
@@ -42,3 +49,4 @@ std::pair<int, bool> xatoi(const char* v);
 
 
 } // namespace bthelper
+#endif
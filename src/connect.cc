@@ -0,0 +1,212 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "connect.h"
+#include "log.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace bthelper {
+
+bool parse_candidate(const std::string& in, Candidate* out)
+{
+    const std::string unix_prefix = "unix:";
+    if (in.compare(0, unix_prefix.size(), unix_prefix) == 0) {
+        out->unix_path = in.substr(unix_prefix.size());
+        out->name = in;
+        return !out->unix_path.empty()
+               && out->unix_path.size() < sizeof(sockaddr_un::sun_path);
+    }
+    const auto pos = in.find('/');
+    if (pos == std::string::npos) {
+        return false;
+    }
+    if (!parse_candidate(in.substr(0, pos), in.substr(pos + 1), out)) {
+        return false;
+    }
+    out->name = in;
+    return true;
+}
+
+bool parse_candidate(const std::string& addr, const std::string& channel, Candidate* out)
+{
+    if (!parse_addr(addr, &out->addr)) {
+        return false;
+    }
+    const auto ch_ok = xatoi(channel.c_str());
+    if (!ch_ok.second || ch_ok.first < 1 || ch_ok.first > 30) {
+        return false;
+    }
+    out->channel = ch_ok.first;
+    out->name = addr + "/" + channel;
+    return true;
+}
+
+namespace {
+int start_connect_unix(const std::string& path)
+{
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    struct sockaddr_un addr {
+    };
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    PROBE(connect_start, sock, path.c_str());
+    if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+        && errno != EINPROGRESS) {
+        const auto err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+} // namespace
+
+int start_connect(const Candidate& c)
+{
+    if (!c.unix_path.empty()) {
+        return start_connect_unix(c.unix_path);
+    }
+    const int sock = socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_NONBLOCK, BTPROTO_RFCOMM);
+    if (sock == -1) {
+        return -1;
+    }
+
+    // Bind to zeroes.
+    struct sockaddr_rc laddr {
+    };
+    laddr.rc_family = AF_BLUETOOTH;
+    if (bind(sock, reinterpret_cast<sockaddr*>(&laddr), sizeof(laddr))) {
+        const auto err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    struct sockaddr_rc addr {
+    };
+    addr.rc_family = AF_BLUETOOTH;
+    addr.rc_bdaddr = c.addr;
+    addr.rc_channel = c.channel;
+    PROBE(connect_start, sock, c.name.c_str());
+    if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))
+        && errno != EINPROGRESS) {
+        const auto err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+int finish_connect(int sock)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len)) {
+        return errno;
+    }
+    PROBE(connect_finish, sock, err);
+    if (err) {
+        return err;
+    }
+    // Back to blocking, like a plain connect() would leave it.
+    const int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags & ~O_NONBLOCK)) {
+        return errno;
+    }
+    return 0;
+}
+
+RaceResult race_connect(const std::vector<Candidate>& cands,
+                        std::chrono::milliseconds timeout)
+{
+    const auto start = std::chrono::steady_clock::now();
+    RaceResult ret;
+
+    // Index into cands for each entry in pfds.
+    std::vector<size_t> idx;
+    std::vector<struct pollfd> pfds;
+    for (size_t i = 0; i < cands.size(); i++) {
+        const auto sock = start_connect(cands[i]);
+        if (sock == -1) {
+            LOG(info).kv("candidate", cands[i].name) << "connect(): " << strerror(errno);
+            continue;
+        }
+        idx.push_back(i);
+        pfds.push_back({ .fd = sock, .events = POLLOUT, .revents = 0 });
+    }
+
+    while (!pfds.empty() && ret.sock == -1) {
+        int wait = -1;
+        if (timeout.count() >= 0) {
+            const auto left =
+                timeout
+                - std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start);
+            if (left.count() <= 0) {
+                LOG(debug) << "Connect timed out";
+                break;
+            }
+            wait = left.count();
+        }
+        const auto rc = poll(pfds.data(), pfds.size(), wait);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(error) << "poll(): " << strerror(errno);
+            break;
+        }
+        for (size_t i = 0; i < pfds.size();) {
+            if (!pfds[i].revents) {
+                i++;
+                continue;
+            }
+            const auto& cand = cands[idx[i]];
+            const auto err = finish_connect(pfds[i].fd);
+            if (!err && ret.sock == -1) {
+                ret.sock = pfds[i].fd;
+                ret.winner = idx[i];
+            } else {
+                if (err) {
+                    LOG(info).kv("candidate", cand.name) << "connect(): " << strerror(err);
+                }
+                close(pfds[i].fd);
+            }
+            pfds.erase(pfds.begin() + i);
+            idx.erase(idx.begin() + i);
+        }
+    }
+
+    // Losers, or everything on timeout.
+    for (const auto& p : pfds) {
+        close(p.fd);
+    }
+    ret.elapsed = std::chrono::steady_clock::now() - start;
+    return ret;
+}
+
+} // namespace bthelper
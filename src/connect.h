@@ -0,0 +1,70 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Client side RFCOMM connection setup.
+ */
+#ifndef __INCLUDE_CONNECT_H__
+#define __INCLUDE_CONNECT_H__
+#include "common.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace bthelper {
+
+struct Candidate {
+    bdaddr_t addr;
+    int channel;
+
+    // If set, a Unix socket to connect to instead, e.g. bt-linkemu.
+    std::string unix_path;
+
+    // As given on the command line.
+    std::string name;
+};
+
+// Parse "AA:BB:CC:DD:EE:FF/5", or "unix:<path>".
+bool parse_candidate(const std::string& in, Candidate* out);
+
+// Parse address and channel given separately.
+bool parse_candidate(const std::string& addr, const std::string& channel, Candidate* out);
+
+// Start a non-blocking connect. Returns the socket, or -1 with errno
+// set. The connect completes when the socket becomes writable.
+int start_connect(const Candidate& c);
+
+// Get the result of a connect started with start_connect(), once the
+// socket is writable. 0 on success, else the errno value.
+int finish_connect(int sock);
+
+struct RaceResult {
+    // Connected socket, in blocking mode. -1 if all failed.
+    int sock = -1;
+
+    // Index of the candidate that won.
+    size_t winner = 0;
+
+    std::chrono::steady_clock::duration elapsed{};
+};
+
+// Connect to all candidates concurrently, keep the first to succeed and
+// close the rest. A negative timeout waits until all have failed.
+RaceResult race_connect(const std::vector<Candidate>& cands,
+                        std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+
+} // namespace bthelper
+#endif
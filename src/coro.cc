@@ -0,0 +1,175 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "coro.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <array>
+#include <new>
+
+namespace bthelper::coro {
+
+namespace {
+// Frames are rounded up to a multiple of this...
+constexpr size_t granule = 64;
+
+// ... and pooled up to this size. Larger ones go straight to the system.
+constexpr size_t max_pooled = 2048;
+constexpr size_t num_classes = max_pooled / granule;
+
+// Frames kept per size class. Beyond that, they're given back.
+constexpr size_t max_free = 64;
+
+struct FreeNode {
+    FreeNode* next;
+};
+
+struct FreeList {
+    FreeNode* head = nullptr;
+    size_t count = 0;
+};
+
+thread_local std::array<FreeList, num_classes> pool;
+thread_local PoolStats stats;
+
+size_t size_class(size_t n) { return (n + granule - 1) / granule - 1; }
+} // namespace
+
+void* frame_alloc(size_t n)
+{
+    if (n > max_pooled) {
+        stats.system_allocs++;
+        return ::operator new(n);
+    }
+    auto& fl = pool[size_class(n)];
+    if (fl.head) {
+        stats.pool_allocs++;
+        auto p = fl.head;
+        fl.head = p->next;
+        fl.count--;
+        return p;
+    }
+    stats.system_allocs++;
+    return ::operator new((size_class(n) + 1) * granule);
+}
+
+void frame_free(void* p, size_t n)
+{
+    if (n > max_pooled) {
+        ::operator delete(p);
+        return;
+    }
+    auto& fl = pool[size_class(n)];
+    if (fl.count >= max_free) {
+        ::operator delete(p);
+        return;
+    }
+    auto node = static_cast<FreeNode*>(p);
+    node->next = fl.head;
+    fl.head = node;
+    fl.count++;
+}
+
+PoolStats pool_stats() { return stats; }
+
+void detail::report_detached(std::exception_ptr e)
+{
+    try {
+        std::rethrow_exception(e);
+    } catch (const std::exception& ex) {
+        LOG(error) << "Coroutine failed: " << ex.what();
+    } catch (...) {
+        LOG(error) << "Coroutine failed with unknown exception";
+    }
+}
+
+Task<shuffle_detail::IoResult> async_read(Shuffler& shuf, int fd, char* buf, size_t n)
+{
+    for (;;) {
+        const auto r = shuffle_detail::read_some(fd, buf, n);
+        if (!r.again) {
+            co_return r;
+        }
+        co_await readable(shuf, fd);
+    }
+}
+
+Task<shuffle_detail::IoResult>
+async_write(Shuffler& shuf, int fd, std::string_view data)
+{
+    shuffle_detail::IoResult ret;
+    while (ret.n < data.size()) {
+        const auto r = shuffle_detail::write_some(fd, data.substr(ret.n));
+        if (!r.ok()) {
+            ret.err = r.err;
+            co_return ret;
+        }
+        ret.n += r.n;
+        if (r.again) {
+            co_await writable(shuf, fd);
+        }
+    }
+    co_return ret;
+}
+
+Task<std::error_code>
+async_connect(Shuffler& shuf, int fd, const sockaddr* addr, socklen_t len)
+{
+    if (!connect(fd, addr, len)) {
+        co_return std::error_code{};
+    }
+    if (errno != EINPROGRESS) {
+        co_return std::error_code(errno, std::generic_category());
+    }
+    co_await writable(shuf, fd);
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen)) {
+        err = errno;
+    }
+    co_return std::error_code(err, std::generic_category());
+}
+
+} // namespace bthelper::coro
+
+#if 0
+#include <iostream>
+using namespace bthelper;
+
+coro::Task<void> echo(Shuffler& shuf, int in, int out)
+{
+    char buf[128];
+    for (;;) {
+        const auto r = co_await coro::async_read(shuf, in, buf, sizeof(buf));
+        if (!r.ok() || !r.n) {
+            co_return;
+        }
+        co_await coro::sleep_for(shuf, std::chrono::milliseconds(100));
+        co_await coro::async_write(shuf, out, { buf, r.n });
+    }
+}
+
+int main()
+{
+    fcntl(0, F_SETFL, O_NONBLOCK);
+    Shuffler shuf;
+    coro::spawn(echo(shuf, 0, 1));
+    shuf.run();
+    std::cerr << "pool allocs: " << coro::pool_stats().pool_allocs << "\n";
+}
+#endif
@@ -0,0 +1,258 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Coroutines driven by the Shuffler event loop.
+ *
+ * Lets multi-step exchanges (handshakes, negotiation, transfer control)
+ * be written as straight-line code, without blocking other sessions:
+ *
+ *   coro::Task<void> hello(Shuffler& shuf, int fd)
+ *   {
+ *       co_await coro::async_write(shuf, fd, "HELLO\n");
+ *       co_await coro::sleep_for(shuf, std::chrono::seconds(1));
+ *       char buf[64];
+ *       const auto r = co_await coro::async_read(shuf, fd, buf, sizeof(buf));
+ *       ...
+ *   }
+ *   coro::spawn(hello(shuf, fd));
+ *   shuf.run();
+ *
+ * fds must be non-blocking. Everything runs on the thread calling
+ * Shuffler::run(). Coroutine frames come from a pool of free lists, so
+ * that once warmed up, sessions don't hit the allocator.
+ */
+#ifndef __INCLUDE_CORO_H__
+#define __INCLUDE_CORO_H__
+
+#include "shuffle.h"
+
+#include <sys/socket.h>
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <system_error>
+#include <utility>
+
+namespace bthelper::coro {
+
+// Frame allocation, from per-size free lists.
+void* frame_alloc(size_t n);
+void frame_free(void* p, size_t n);
+
+// Frame allocations served by the system allocator, and by the pool.
+struct PoolStats {
+    uint64_t system_allocs = 0;
+    uint64_t pool_allocs = 0;
+};
+PoolStats pool_stats();
+
+template <typename T>
+class Task;
+
+namespace detail {
+// Log an exception that escaped a spawn()ed task.
+void report_detached(std::exception_ptr e);
+
+struct PromiseBase {
+    static void* operator new(size_t n) { return frame_alloc(n); }
+    static void operator delete(void* p, size_t n) { frame_free(p, n); }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // Resume whoever is awaiting, or clean up if nobody is.
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            auto& p = h.promise();
+            if (p.continuation) {
+                return p.continuation;
+            }
+            if (p.detached) {
+                if (p.error) {
+                    report_detached(p.error);
+                }
+                h.destroy();
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { error = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+    std::exception_ptr error;
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    Task<T> get_return_object();
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T result()
+    {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+    std::optional<T> value;
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result()
+    {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+} // namespace detail
+
+// A lazily started coroutine, run by co_await-ing it, or by spawn().
+template <typename T = void>
+class [[nodiscard]] Task
+{
+public:
+    using promise_type = detail::Promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit Task(handle_type h) : h_(h) {}
+    Task(Task&& o) noexcept : h_(std::exchange(o.h_, {})) {}
+    Task& operator=(Task&& o) noexcept
+    {
+        if (this != &o) {
+            reset();
+            h_ = std::exchange(o.h_, {});
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { reset(); }
+
+    auto operator co_await() && noexcept
+    {
+        struct Awaiter {
+            handle_type h;
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+            {
+                h.promise().continuation = cont;
+                return h;
+            }
+            T await_resume() { return h.promise().result(); }
+        };
+        return Awaiter{ h_ };
+    }
+
+    // Start running, with nobody awaiting. The frame frees itself when
+    // done.
+    void detach() &&
+    {
+        auto h = std::exchange(h_, {});
+        h.promise().detached = true;
+        h.resume();
+    }
+
+private:
+    void reset()
+    {
+        if (h_) {
+            h_.destroy();
+            h_ = {};
+        }
+    }
+
+    handle_type h_;
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object()
+{
+    return Task<T>(Task<T>::handle_type::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object()
+{
+    return Task<void>(Task<void>::handle_type::from_promise(*this));
+}
+
+// Run a task in the background of shuf.run().
+inline void spawn(Task<void>&& t) { std::move(t).detach(); }
+
+// Suspend until fd is readable / writable.
+struct Readable {
+    Shuffler& shuf;
+    int fd;
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        shuf.when_readable(fd, [h] { h.resume(); });
+    }
+    void await_resume() noexcept {}
+};
+
+struct Writable {
+    Shuffler& shuf;
+    int fd;
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        shuf.when_writable(fd, [h] { h.resume(); });
+    }
+    void await_resume() noexcept {}
+};
+
+struct Sleep {
+    Shuffler& shuf;
+    Shuffler::clock::time_point until;
+    bool await_ready() noexcept { return Shuffler::clock::now() >= until; }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        shuf.at(until, [h] { h.resume(); });
+    }
+    void await_resume() noexcept {}
+};
+
+inline Readable readable(Shuffler& shuf, int fd) { return { shuf, fd }; }
+inline Writable writable(Shuffler& shuf, int fd) { return { shuf, fd }; }
+inline Sleep sleep_for(Shuffler& shuf, Shuffler::clock::duration d)
+{
+    return { shuf, Shuffler::clock::now() + d };
+}
+
+// Read up to n bytes, once some are available. n == 0 in the result
+// means EOF.
+Task<shuffle_detail::IoResult> async_read(Shuffler& shuf, int fd, char* buf, size_t n);
+
+// Write all of data. On error, n is how much was written.
+Task<shuffle_detail::IoResult>
+async_write(Shuffler& shuf, int fd, std::string_view data);
+
+// Connect a non-blocking socket.
+Task<std::error_code>
+async_connect(Shuffler& shuf, int fd, const sockaddr* addr, socklen_t len);
+
+} // namespace bthelper::coro
+#endif
@@ -0,0 +1,359 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "handoff.h"
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+namespace bthelper {
+
+namespace {
+// Set in the new process to the fd of the handoff channel, and to the
+// pid of the helper sending the state.
+const char* handoff_env = "BT_LISTENER_HANDOFF_FD";
+const char* helper_env = "BT_LISTENER_HANDOFF_HELPER";
+const std::string magic = "BTHANDOFF4";
+// SCM_MAX_FD.
+constexpr size_t max_fds = 253;
+
+bool write_all(int fd, std::string_view data)
+{
+    while (!data.empty()) {
+        const auto rc = write(fd, data.data(), data.size());
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(error) << "handoff write(): " << strerror(errno);
+            return false;
+        }
+        data.remove_prefix(rc);
+    }
+    return true;
+}
+
+bool read_all(int fd, char* buf, size_t n)
+{
+    while (n) {
+        const auto rc = read(fd, buf, n);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            LOG(error) << "handoff read(): " << (rc ? strerror(errno) : "EOF");
+            return false;
+        }
+        buf += rc;
+        n -= rc;
+    }
+    return true;
+}
+
+// Append fd to fds, and return its index. -1 stays -1.
+int fd_index(std::vector<int>& fds, int fd)
+{
+    if (fd < 0) {
+        return -1;
+    }
+    fds.push_back(fd);
+    return fds.size() - 1;
+}
+
+// Adapters are addresses, so have no spaces, but may be empty.
+std::string adapter_token(const std::string& adapter)
+{
+    return adapter.empty() ? "-" : adapter;
+}
+
+std::string adapter_from_token(const std::string& token)
+{
+    return token == "-" ? "" : token;
+}
+
+// The state as sent: header length and fds, then header, then the
+// buffered data.
+struct Encoded {
+    std::vector<int> fds;
+    std::string header;
+    std::string payload;
+};
+
+std::optional<Encoded> encode_state(const HandoffState& state)
+{
+    Encoded enc;
+    auto& fds = enc.fds;
+    std::ostringstream hdr;
+    hdr << magic << "\n";
+    for (const auto& l : state.listeners) {
+        hdr << "listener " << l.channel << " " << adapter_token(l.adapter) << " "
+            << fd_index(fds, l.sock) << "\n";
+    }
+    auto& payload = enc.payload;
+    for (const auto& s : state.sessions) {
+        hdr << "session " << s.kind << " " << s.remote << " " << s.channel << " "
+            << adapter_token(s.adapter) << " " << fd_index(fds, s.sock) << " " << fd_index(fds, s.peer) << " " << s.pid
+            << " " << s.to_bt.size() << " " << s.to_bt_partial.size() << " "
+            << s.from_bt.size() << " " << s.from_bt_partial.size() << "\n";
+        payload += s.to_bt + s.to_bt_partial + s.from_bt + s.from_bt_partial;
+    }
+    hdr << "end\n";
+    enc.header = hdr.str();
+    if (fds.size() > max_fds) {
+        LOG(error).kv("fds", fds.size()) << "Too many fds to hand over";
+        return std::nullopt;
+    }
+    return enc;
+}
+
+bool send_state(int chan, const Encoded& enc)
+{
+    const auto& fds = enc.fds;
+    const uint32_t len = htonl(enc.header.size());
+    struct iovec iov {
+    };
+    iov.iov_base = const_cast<uint32_t*>(&len);
+    iov.iov_len = sizeof(len);
+    struct msghdr msg {
+    };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    std::vector<cmsghdr> cbuf(CMSG_SPACE(sizeof(int) * max_fds) / sizeof(cmsghdr) + 1);
+    if (!fds.empty()) {
+        msg.msg_control = cbuf.data();
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+    if (sendmsg(chan, &msg, 0) != sizeof(len)) {
+        LOG(error) << "handoff sendmsg(): " << strerror(errno);
+        return false;
+    }
+    return write_all(chan, enc.header) && write_all(chan, enc.payload);
+}
+
+// Read n bytes of payload into out.
+bool read_string(int chan, size_t n, std::string* out)
+{
+    out->resize(n);
+    return read_all(chan, out->data(), n);
+}
+
+std::optional<HandoffState> recv_state(int chan)
+{
+    uint32_t len;
+    struct iovec iov {
+    };
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    struct msghdr msg {
+    };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    std::vector<cmsghdr> cbuf(CMSG_SPACE(sizeof(int) * max_fds) / sizeof(cmsghdr) + 1);
+    msg.msg_control = cbuf.data();
+    msg.msg_controllen = cbuf.size() * sizeof(cmsghdr);
+    if (recvmsg(chan, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(len)) {
+        LOG(error) << "handoff recvmsg(): " << strerror(errno);
+        return std::nullopt;
+    }
+    std::vector<int> fds;
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            const auto n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            fds.resize(n);
+            memcpy(fds.data(), CMSG_DATA(cmsg), n * sizeof(int));
+        }
+    }
+    const auto fd_at = [&fds](int idx) {
+        return (idx >= 0 && idx < static_cast<int>(fds.size())) ? fds[idx] : -1;
+    };
+
+    std::string header;
+    if (!read_string(chan, ntohl(len), &header)) {
+        return std::nullopt;
+    }
+    std::istringstream in(header);
+    std::string line;
+    HandoffState state;
+    std::getline(in, line);
+    if (line != magic) {
+        LOG(error) << "Bad handoff header";
+        return std::nullopt;
+    }
+    while (std::getline(in, line) && line != "end") {
+        std::istringstream args(line);
+        std::string key;
+        args >> key;
+        if (key == "listener") {
+            HandoffListener l;
+            std::string adapter;
+            int idx;
+            args >> l.channel >> adapter >> idx;
+            if (!args) {
+                LOG(error) << "Bad handoff listener: " << line;
+                return std::nullopt;
+            }
+            l.adapter = adapter_from_token(adapter);
+            l.sock = fd_at(idx);
+            state.listeners.push_back(std::move(l));
+        } else if (key == "session") {
+            HandoffSession s;
+            std::string adapter;
+            int sock;
+            int peer;
+            size_t lens[4];
+            args >> s.kind >> s.remote >> s.channel >> adapter >> sock >> peer >> s.pid
+                >> lens[0] >> lens[1] >> lens[2] >> lens[3];
+            if (!args) {
+                LOG(error) << "Bad handoff session: " << line;
+                return std::nullopt;
+            }
+            s.adapter = adapter_from_token(adapter);
+            s.sock = fd_at(sock);
+            s.peer = fd_at(peer);
+            if (!read_string(chan, lens[0], &s.to_bt)
+                || !read_string(chan, lens[1], &s.to_bt_partial)
+                || !read_string(chan, lens[2], &s.from_bt)
+                || !read_string(chan, lens[3], &s.from_bt_partial)) {
+                return std::nullopt;
+            }
+            state.sessions.push_back(std::move(s));
+        }
+    }
+    return state;
+}
+
+void set_cloexec(int fd)
+{
+    if (fd >= 0 && fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+        LOG(warning) << "fcntl(FD_CLOEXEC): " << strerror(errno);
+    }
+}
+} // namespace
+
+std::string executable_path()
+{
+    char buf[PATH_MAX];
+    const auto n = readlink("/proc/self/exe", buf, sizeof(buf));
+    if (n <= 0 || n == sizeof(buf)) {
+        LOG(warning) << "readlink(/proc/self/exe): " << strerror(errno);
+        return "";
+    }
+    return std::string(buf, n);
+}
+
+void handoff(const std::string& binary, char** argv, const HandoffState& state)
+{
+    if (binary.empty()) {
+        LOG(error) << "Handoff failed: path of own binary unknown";
+        return;
+    }
+    // Everything that can fail is checked before forking, so that the
+    // new process isn't started only to find it has nothing to take over.
+    const auto enc = encode_state(state);
+    if (!enc) {
+        LOG(error) << "Handoff failed: can't hand over the current state";
+        return;
+    }
+    int chan[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, chan)) {
+        LOG(error) << "handoff socketpair(): " << strerror(errno);
+        return;
+    }
+
+    // The new process only gets the fds through the channel.
+    for (const auto& l : state.listeners) {
+        set_cloexec(l.sock);
+    }
+    for (const auto& s : state.sessions) {
+        set_cloexec(s.sock);
+        set_cloexec(s.peer);
+    }
+    set_cloexec(chan[1]);
+
+    const auto pid = fork();
+    if (pid == -1) {
+        LOG(error) << "handoff fork(): " << strerror(errno);
+        close(chan[0]);
+        close(chan[1]);
+        return;
+    }
+    if (!pid) {
+        log::forked_child();
+        close(chan[0]);
+        char ack;
+        const bool ok = send_state(chan[1], *enc) && read_all(chan[1], &ack, 1);
+        _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(chan[1]);
+
+    setenv(handoff_env, std::to_string(chan[0]).c_str(), 1);
+    setenv(helper_env, std::to_string(pid).c_str(), 1);
+    LOG(info).kv("binary", binary) << "Handing over to new binary";
+    log::stop();
+    execv(binary.c_str(), argv);
+    const auto err = errno;
+    log::start();
+    LOG(error).kv("binary", binary) << "Handoff failed: exec(): " << strerror(err);
+    unsetenv(handoff_env);
+    unsetenv(helper_env);
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    close(chan[0]);
+}
+
+std::optional<HandoffState> receive_handoff()
+{
+    const char* env = getenv(handoff_env);
+    if (!env) {
+        return std::nullopt;
+    }
+    const int chan = atoi(env);
+    const char* helper_str = getenv(helper_env);
+    const pid_t helper = helper_str ? atoi(helper_str) : -1;
+    unsetenv(handoff_env);
+    unsetenv(helper_env);
+
+    auto state = recv_state(chan);
+    if (state && !write_all(chan, "k")) {
+        LOG(warning) << "Failed to acknowledge handoff";
+    }
+    // Without the ack, the helper gives up. Either way, wait for it to
+    // exit, so that its copies of the listening sockets are gone.
+    close(chan);
+    if (helper > 0 && waitpid(helper, nullptr, 0) == -1) {
+        LOG(warning) << "waitpid(handoff helper): " << strerror(errno);
+    }
+    if (!state) {
+        LOG(error) << "Failed to receive handoff state, starting afresh";
+    }
+    return state;
+}
+
+} // namespace bthelper
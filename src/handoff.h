@@ -0,0 +1,96 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Handing a running bt-listener over to a new binary, without dropping
+ * the listening sockets or the live sessions.
+ *
+ * The old process forks. The parent execs the new binary with the same
+ * arguments, so that it keeps its pid and its children. The child sends
+ * the state over a unix socket, with the fds as SCM_RIGHTS, waits for the
+ * new process to acknowledge, and exits.
+ */
+#ifndef __INCLUDE_HANDOFF_H__
+#define __INCLUDE_HANDOFF_H__
+
+#include <sys/types.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace bthelper {
+
+struct HandoffSession {
+    // "target", "stdio" or "exec". "connect" for a session still
+    // connecting to its target, which the new process starts over.
+    std::string kind;
+    std::string remote;
+
+    // Index of the binding (listening socket) it came in on, in this
+    // process. The bindings may have changed across a handoff, so it's
+    // handed over as the binding's channel and adapter instead.
+    int binding = 0;
+    int channel = -1;
+    std::string adapter;
+
+    // -1 for a detached screen mode session, whose screen is then in
+    // to_bt_partial.
+    int sock = -1;
+
+    // Target socket or pty master. -1 for stdio.
+    int peer = -1;
+
+    // Child process, for exec.
+    pid_t pid = -1;
+
+    // Buffered, not yet written, data of each direction. See
+    // Buffer::partial().
+    std::string to_bt;
+    std::string to_bt_partial;
+    std::string from_bt;
+    std::string from_bt_partial;
+};
+
+struct HandoffListener {
+    // As bound. -1 for an inherited socket. Empty adapter means any.
+    int channel = -1;
+    std::string adapter;
+    int sock = -1;
+};
+
+struct HandoffState {
+    // One per listening binding. Empty if handling a single inherited
+    // connection.
+    std::vector<HandoffListener> listeners;
+    std::vector<HandoffSession> sessions;
+};
+
+// Absolute path of the running binary. Call at startup: once the file
+// has been replaced, /proc/self/exe points at the deleted old one.
+// Empty if it can't be found.
+std::string executable_path();
+
+// Exec binary with argv, handing over state. Only returns on failure,
+// in which case the caller still owns everything and can carry on.
+void handoff(const std::string& binary, char** argv, const HandoffState& state);
+
+// In the new process: the state handed over, or nullopt if not started
+// by handoff(), or if receiving the state failed. In that case nothing
+// was handed over, and the caller starts afresh from its arguments.
+std::optional<HandoffState> receive_handoff();
+
+} // namespace bthelper
+#endif
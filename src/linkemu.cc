@@ -0,0 +1,168 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "linkemu.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace bthelper {
+
+namespace {
+void set_nonblock(int fd)
+{
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+        throw std::system_error(errno, std::generic_category(), "fcntl(O_NONBLOCK)");
+    }
+}
+} // namespace
+
+LinkDirection::LinkDirection(
+    Shuffler& shuf, int in, int out, const LinkParams& p, uint64_t seed)
+    : shuf_(shuf), in_(in), out_(out), params_(p), rng_(seed)
+{
+}
+
+Shuffler::clock::duration LinkDirection::jitter()
+{
+    const auto us = params_.jitter.count();
+    if (us <= 0) {
+        return {};
+    }
+    // Not std::uniform_int_distribution, which may differ between
+    // standard libraries.
+    return std::chrono::microseconds(rng_() % (us + 1));
+}
+
+coro::Task<void> LinkDirection::send()
+{
+    std::vector<char> buf(std::max<size_t>(1, params_.mtu));
+    for (;;) {
+        auto now = Shuffler::clock::now();
+        if (now < link_free_) {
+            co_await coro::sleep_for(shuf_, link_free_ - now);
+        }
+        while (params_.window && queued_ >= params_.window) {
+            co_await WindowWait{ *this };
+        }
+        const auto r = co_await coro::async_read(shuf_, in_, buf.data(), buf.size());
+        now = Shuffler::clock::now();
+        if (!r.ok() || !r.n) {
+            if (!r.ok()) {
+                LOG(debug) << "Link read: " << r.err.message();
+            }
+            queue(Frame{ now, std::max(last_due_, now + params_.latency), {} });
+            read_done_ = true;
+            break;
+        }
+        auto air = Shuffler::clock::duration{};
+        if (params_.rate > 0) {
+            air = std::chrono::duration_cast<Shuffler::clock::duration>(
+                std::chrono::duration<double>((r.n + params_.overhead) / params_.rate));
+        }
+        link_free_ = now + air;
+        const auto due = std::max(last_due_, link_free_ + params_.latency + jitter());
+        queue(Frame{ now, due, std::string(buf.data(), r.n) });
+    }
+    if (done() && on_done) {
+        on_done();
+    }
+}
+
+void LinkDirection::queue(Frame&& f)
+{
+    last_due_ = f.due;
+    queued_ += f.data.size();
+    inflight_.push_back(std::move(f));
+    if (!delivering_) {
+        delivering_ = true;
+        coro::spawn(deliver());
+    }
+}
+
+coro::Task<void> LinkDirection::deliver()
+{
+    while (!inflight_.empty()) {
+        // deque::push_back() doesn't invalidate references.
+        auto& f = inflight_.front();
+        const auto now = Shuffler::clock::now();
+        if (now < f.due) {
+            co_await coro::sleep_for(shuf_, f.due - now);
+        }
+        if (f.data.empty()) {
+            if (!failed_ && shutdown(out_, SHUT_WR) && errno != ENOTCONN) {
+                LOG(debug) << "Link shutdown(): " << strerror(errno);
+            }
+        } else if (!failed_) {
+            const auto r = co_await coro::async_write(shuf_, out_, f.data);
+            if (!r.ok()) {
+                LOG(debug) << "Link write: " << r.err.message();
+                failed_ = true;
+                if (on_fail) {
+                    on_fail();
+                }
+            } else {
+                const auto delay = Shuffler::clock::now() - f.read_at;
+                stats_.bytes += f.data.size();
+                stats_.frames++;
+                stats_.delay_sum += delay;
+                stats_.delay_max = std::max(stats_.delay_max, delay);
+            }
+        }
+        queued_ -= f.data.size();
+        inflight_.pop_front();
+        if (window_waiter_ && queued_ < params_.window) {
+            shuf_.at(Shuffler::clock::now(),
+                     [h = std::exchange(window_waiter_, {})] { h.resume(); });
+        }
+    }
+    delivering_ = false;
+    if (done() && on_done) {
+        on_done();
+    }
+}
+
+LinkEmulator::LinkEmulator(Shuffler& shuf,
+                           int a,
+                           int b,
+                           const LinkParams& p,
+                           std::function<void()> on_done)
+    : ab_(std::make_unique<LinkDirection>(shuf, a, b, p, p.seed)),
+      ba_(std::make_unique<LinkDirection>(shuf, b, a, p, ~p.seed))
+{
+    set_nonblock(a);
+    set_nonblock(b);
+    const auto check = [this, on_done = std::move(on_done)] {
+        if (ab_->done() && ba_->done() && on_done) {
+            on_done();
+        }
+    };
+    ab_->on_done = ba_->on_done = check;
+    ab_->on_fail = ba_->on_fail = [a, b] {
+        shutdown(a, SHUT_RDWR);
+        shutdown(b, SHUT_RDWR);
+    };
+    coro::spawn(ab_->send());
+    coro::spawn(ba_->send());
+}
+
+} // namespace bthelper
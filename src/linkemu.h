@@ -0,0 +1,156 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Emulated RFCOMM link, for repeatable performance tests of the real
+ * data paths without radios.
+ *
+ * Each direction is a FIFO link. Data read from one end is sent in
+ * frames of at most mtu bytes. A frame occupies the link for
+ * (size + overhead) / rate seconds, and arrives at the other end latency
+ * plus jitter after that. Nothing more is read while the link is busy,
+ * or while window bytes have been read but not yet delivered, so the
+ * sender's socket buffer fills up like it would over the air, also when
+ * the receiver stops reading.
+ *
+ * Jitter is uniform in [0, jitter], from a PRNG seeded with seed, so the
+ * same seed gives the same delays frame by frame. Frames never overtake
+ * each other.
+ */
+#ifndef __INCLUDE_LINKEMU_H__
+#define __INCLUDE_LINKEMU_H__
+
+#include "common.h"
+#include "coro.h"
+#include "shuffle.h"
+
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+
+namespace bthelper {
+
+struct LinkParams {
+    // Bytes per second on the link, counting overhead. 0 means unlimited.
+    double rate = 100000;
+
+    // Header bytes per frame (RFCOMM, L2CAP and ACL).
+    size_t overhead = 13;
+
+    size_t mtu = RFCOMM_DEFAULT_MTU;
+
+    // Bytes read but not yet delivered, at most. Like RFCOMM credits,
+    // which default to 7 frames. 0 means unlimited.
+    size_t window = 7 * RFCOMM_DEFAULT_MTU;
+
+    std::chrono::microseconds latency{ 20000 };
+    std::chrono::microseconds jitter{ 5000 };
+
+    uint64_t seed = 1;
+};
+
+struct LinkStats {
+    uint64_t bytes = 0;
+    uint64_t frames = 0;
+
+    // One way delay of frames, from read to written.
+    Shuffler::clock::duration delay_sum{};
+    Shuffler::clock::duration delay_max{};
+};
+
+// One direction of the link.
+class LinkDirection
+{
+public:
+    LinkDirection(Shuffler& shuf, int in, int out, const LinkParams& p, uint64_t seed);
+    LinkDirection(const LinkDirection&) = delete;
+    LinkDirection& operator=(const LinkDirection&) = delete;
+
+    // Read until EOF or error, and pass it on.
+    coro::Task<void> send();
+
+    const LinkStats& stats() const { return stats_; }
+    bool done() const { return read_done_ && inflight_.empty() && !delivering_; }
+
+    // Called when done, or when writing fails.
+    std::function<void()> on_done;
+    std::function<void()> on_fail;
+
+private:
+    struct Frame {
+        Shuffler::clock::time_point read_at;
+        Shuffler::clock::time_point due;
+        // Empty for EOF.
+        std::string data;
+    };
+
+    // Write frames as they become due, until none are left.
+    coro::Task<void> deliver();
+    void queue(Frame&& f);
+    Shuffler::clock::duration jitter();
+
+    // Suspends send() until deliver() has made room in the window.
+    struct WindowWait {
+        LinkDirection& link;
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { link.window_waiter_ = h; }
+        void await_resume() noexcept {}
+    };
+
+    Shuffler& shuf_;
+    int in_;
+    int out_;
+    LinkParams params_;
+    std::mt19937_64 rng_;
+    std::deque<Frame> inflight_;
+    // Data bytes in inflight_.
+    size_t queued_ = 0;
+    std::coroutine_handle<> window_waiter_;
+    Shuffler::clock::time_point link_free_{};
+    Shuffler::clock::time_point last_due_{};
+    bool delivering_ = false;
+    bool read_done_ = false;
+    bool failed_ = false;
+    LinkStats stats_;
+};
+
+// Carries data both ways between two sockets, on shuf's loop. The fds
+// stay owned by the caller, and are set non-blocking. If writing to one
+// end fails, both are shut down, like a dropped link.
+class LinkEmulator
+{
+public:
+    // on_done is called once both directions have ended. It may not
+    // destroy the LinkEmulator directly, only defer that.
+    LinkEmulator(Shuffler& shuf,
+                 int a,
+                 int b,
+                 const LinkParams& p,
+                 std::function<void()> on_done);
+
+    const LinkStats& a_to_b() const { return ab_->stats(); }
+    const LinkStats& b_to_a() const { return ba_->stats(); }
+
+private:
+    std::unique_ptr<LinkDirection> ab_;
+    std::unique_ptr<LinkDirection> ba_;
+};
+
+} // namespace bthelper
+#endif
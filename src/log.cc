@@ -0,0 +1,346 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "log.h"
+
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+namespace bthelper::log {
+
+std::atomic<int> min_level{ static_cast<int>(Level::info) };
+
+namespace {
+constexpr size_t ring_size = 512;
+static_assert((ring_size & (ring_size - 1)) == 0, "ring size must be a power of two");
+
+// How long the writer sleeps when there is nothing to do.
+constexpr auto idle_sleep = std::chrono::milliseconds(10);
+
+// Bounded multi-producer single-consumer ring. Each slot has a sequence
+// number telling whether it's free for the producer at a given position
+// (seq == pos) or holds a record for the consumer (seq == pos + 1).
+class Ring
+{
+public:
+    Ring()
+    {
+        for (size_t i = 0; i < ring_size; i++) {
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const Record& rec)
+    {
+        auto pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& slot = slots_[pos & (ring_size - 1)];
+            const auto seq = slot.seq.load(std::memory_order_acquire);
+            const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.rec = rec;
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Single consumer only.
+    bool pop(Record* rec)
+    {
+        auto& slot = slots_[tail_ & (ring_size - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) {
+            return false;
+        }
+        *rec = slot.rec;
+        slot.seq.store(tail_ + ring_size, std::memory_order_release);
+        tail_++;
+        return true;
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        Record rec;
+    };
+    std::array<Slot, ring_size> slots_;
+    alignas(64) std::atomic<size_t> head_{ 0 };
+    alignas(64) size_t tail_ = 0;
+};
+
+Ring ring;
+std::atomic<bool> running{ false };
+std::atomic<bool> to_syslog{ false };
+std::atomic<uint64_t> drops{ 0 };
+std::thread writer;
+
+const char* level_name(Level l)
+{
+    switch (l) {
+    case Level::trace:
+        return "trace";
+    case Level::debug:
+        return "debug";
+    case Level::info:
+        return "info";
+    case Level::warning:
+        return "warning";
+    case Level::error:
+        return "error";
+    }
+    return "unknown";
+}
+
+int syslog_priority(Level l)
+{
+    switch (l) {
+    case Level::trace:
+    case Level::debug:
+        return LOG_DEBUG;
+    case Level::info:
+        return LOG_INFO;
+    case Level::warning:
+        return LOG_WARNING;
+    case Level::error:
+        return LOG_ERR;
+    }
+    return LOG_NOTICE;
+}
+
+void write_all(std::string_view sv)
+{
+    while (!sv.empty()) {
+        const auto rc = ::write(STDERR_FILENO, sv.data(), sv.size());
+        if (rc <= 0) {
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        sv.remove_prefix(rc);
+    }
+}
+
+void output(const Record& rec)
+{
+    const std::string_view fields(rec.text, rec.msg_off);
+    const std::string_view msg(rec.text + rec.msg_off, rec.len - rec.msg_off);
+    if (to_syslog.load(std::memory_order_relaxed)) {
+        // syslog adds its own timestamp.
+        syslog(syslog_priority(rec.level),
+               "%.*smsg=\"%.*s\"",
+               static_cast<int>(fields.size()),
+               fields.data(),
+               static_cast<int>(msg.size()),
+               msg.data());
+        return;
+    }
+
+    // Terminal may be in raw mode (bt-connecter -t).
+    static const char* eol = isatty(STDERR_FILENO) ? "\r\n" : "\n";
+
+    char line[sizeof(rec.text) + 128];
+    const auto ms = rec.ts.tv_nsec / 1000000;
+    int n = snprintf(line,
+                     sizeof(line),
+                     "ts=%lld.%03ld level=%s ",
+                     static_cast<long long>(rec.ts.tv_sec),
+                     ms,
+                     level_name(rec.level));
+    n += snprintf(line + n,
+                  sizeof(line) - n,
+                  "%.*smsg=\"%.*s\"%s",
+                  static_cast<int>(fields.size()),
+                  fields.data(),
+                  static_cast<int>(msg.size()),
+                  msg.data(),
+                  eol);
+    write_all({ line, std::min<size_t>(n, sizeof(line) - 1) });
+}
+
+void drain()
+{
+    Record rec;
+    uint64_t reported_drops = 0;
+    for (;;) {
+        const bool stopping = !running.load(std::memory_order_acquire);
+        bool any = false;
+        while (ring.pop(&rec)) {
+            output(rec);
+            any = true;
+        }
+        const auto d = drops.load(std::memory_order_relaxed);
+        if (d != reported_drops) {
+            char buf[128];
+            const auto n = snprintf(buf,
+                                    sizeof(buf),
+                                    "level=warning dropped=%llu msg=\"Log ring full, "
+                                    "records dropped\"\n",
+                                    static_cast<unsigned long long>(d - reported_drops));
+            if (to_syslog.load(std::memory_order_relaxed)) {
+                syslog(LOG_WARNING, "%s", buf);
+            } else {
+                write_all({ buf, static_cast<size_t>(n) });
+            }
+            reported_drops = d;
+        }
+        if (stopping) {
+            return;
+        }
+        if (!any) {
+            std::this_thread::sleep_for(idle_sleep);
+        }
+    }
+}
+} // namespace
+
+void set_level(Level l) { min_level.store(static_cast<int>(l)); }
+
+Level verbosity(int verbose)
+{
+    switch (verbose) {
+    case 0:
+        return Level::info;
+    case 1:
+        return Level::debug;
+    default:
+        return Level::trace;
+    }
+}
+
+void use_syslog(const char* ident)
+{
+    openlog(ident, LOG_PID, LOG_DAEMON);
+    to_syslog.store(true);
+}
+
+void start()
+{
+    if (running.exchange(true)) {
+        return;
+    }
+    // The writer inherits this mask. Keep signals off it, so that those
+    // the main thread blocks for signalfd() aren't delivered here.
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    writer = std::thread(drain);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    std::atexit(stop);
+}
+
+void stop()
+{
+    if (!running.exchange(false)) {
+        return;
+    }
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+void forked_child()
+{
+    // The writer thread doesn't exist in the child. Children must leave
+    // with exec or _exit(), since the std::thread is still joinable.
+    running.store(false);
+}
+
+uint64_t dropped() { return drops.load(); }
+
+Line::Line(Level level) : rec_{}
+{
+    clock_gettime(CLOCK_REALTIME, &rec_.ts);
+    rec_.level = level;
+}
+
+Line::~Line()
+{
+    if (!running.load(std::memory_order_acquire)) {
+        output(rec_);
+        return;
+    }
+    if (!ring.push(rec_)) {
+        drops.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Line::append(std::string_view sv)
+{
+    const auto n = std::min(sv.size(), sizeof(rec_.text) - rec_.len);
+    std::copy_n(sv.data(), n, rec_.text + rec_.len);
+    rec_.len += n;
+}
+
+Line& Line::kv(std::string_view key, std::string_view value)
+{
+    if (rec_.msg_off != rec_.len) {
+        // Message already started.
+        return *this;
+    }
+    append(key);
+    append("=");
+    append(value);
+    append(" ");
+    rec_.msg_off = rec_.len;
+    return *this;
+}
+
+Line& Line::kv(std::string_view key, long long value)
+{
+    char buf[24];
+    const auto res = std::to_chars(buf, buf + sizeof(buf), value);
+    return kv(key, std::string_view(buf, res.ptr - buf));
+}
+
+Line& Line::operator<<(std::string_view sv)
+{
+    // Keep records on one line, and the message quotable.
+    for (const auto ch : sv) {
+        if (ch == '\n' || ch == '\r') {
+            continue;
+        }
+        if (ch == '"') {
+            append("'");
+            continue;
+        }
+        append({ &ch, 1 });
+    }
+    return *this;
+}
+
+Line& Line::operator<<(double v)
+{
+    char buf[32];
+    const auto n = snprintf(buf, sizeof(buf), "%.3f", v);
+    return *this << std::string_view(buf, n);
+}
+
+} // namespace bthelper::log
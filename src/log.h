@@ -0,0 +1,128 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Asynchronous logging.
+ *
+ * Records are formatted into fixed size slots of a lock-free ring, and
+ * written to stderr by a background thread. If the ring is full the
+ * record is dropped and counted, so a slow stderr never blocks the
+ * event loop.
+ *
+ * Usage:
+ *   LOG(info).kv("remote", remote) << "Client connected";
+ */
+#ifndef __INCLUDE_LOG_H__
+#define __INCLUDE_LOG_H__
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <time.h>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace bthelper::log {
+
+enum class Level { trace, debug, info, warning, error };
+
+// Levels below this are compiled out.
+#ifdef STRIP_DEBUG_LOG
+constexpr Level compiled_min = Level::info;
+#else
+constexpr Level compiled_min = Level::trace;
+#endif
+
+extern std::atomic<int> min_level;
+
+inline bool enabled(Level l)
+{
+    return static_cast<int>(l) >= min_level.load(std::memory_order_relaxed);
+}
+void set_level(Level l);
+
+// Level for a count of -v flags.
+Level verbosity(int verbose);
+
+// Send records to syslog instead of stderr, e.g. when stderr is a
+// client's connection.
+void use_syslog(const char* ident);
+
+// Start the background writer. Until this is called, and after stop(),
+// records are written synchronously.
+void start();
+
+// Flush and stop the background writer.
+void stop();
+
+// Call in the child after fork(), where there is no writer thread.
+void forked_child();
+
+// Number of records dropped because the ring was full.
+uint64_t dropped();
+
+struct Record {
+    struct timespec ts;
+    Level level;
+    // Text is "key=value key=value ", then the message at msg_off.
+    uint16_t msg_off;
+    uint16_t len;
+    char text[500];
+};
+
+class Line
+{
+public:
+    explicit Line(Level level);
+    ~Line();
+    Line(const Line&) = delete;
+    Line& operator=(const Line&) = delete;
+
+    // Structured field. Must come before any message text.
+    Line& kv(std::string_view key, std::string_view value);
+    Line& kv(std::string_view key, long long value);
+
+    Line& operator<<(std::string_view sv);
+    Line& operator<<(const char* s) { return *this << std::string_view(s); }
+    Line& operator<<(const std::string& s) { return *this << std::string_view(s); }
+    Line& operator<<(char ch) { return *this << std::string_view(&ch, 1); }
+
+    template <typename T>
+    std::enable_if_t<std::is_integral_v<T>, Line&> operator<<(T v)
+    {
+        char buf[24];
+        const auto res = std::to_chars(buf, buf + sizeof(buf), v);
+        return *this << std::string_view(buf, res.ptr - buf);
+    }
+    Line& operator<<(double v);
+
+private:
+    void append(std::string_view sv);
+    Record rec_;
+};
+
+} // namespace bthelper::log
+
+#define LOG(level)                                                                   \
+    if (!(::bthelper::log::Level::level >= ::bthelper::log::compiled_min            \
+          && ::bthelper::log::enabled(::bthelper::log::Level::level))) {            \
+    } else                                                                           \
+        ::bthelper::log::Line(::bthelper::log::Level::level)
+
+#endif
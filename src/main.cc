@@ -13,8 +13,11 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#include "log.h"
+
 #include <termios.h>
 #include <unistd.h>
+#include <cstring>
 #include <iostream>
 
 extern int wrapmain(int argc, char** argv);
@@ -28,7 +31,7 @@ void save_terminal()
 {
     if (isatty(STDIN_FILENO)) {
         if (tcgetattr(STDIN_FILENO, &orig_tio)) {
-            perror("tcgetattr(stdin)");
+            LOG(warning) << "tcgetattr(stdin): " << strerror(errno);
         } else {
             tio_saved = true;
         }
@@ -39,7 +42,7 @@ void restore_terminal()
 {
     if (tio_saved && isatty(STDIN_FILENO)) {
         if (tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_tio)) {
-            perror("tcsetattr(reset)");
+            LOG(warning) << "tcsetattr(reset): " << strerror(errno);
         }
     }
 }
@@ -47,6 +50,7 @@ void restore_terminal()
 
 int main(int argc, char** argv)
 {
+    bthelper::log::start();
     save_terminal();
     try {
         try {
@@ -58,13 +62,14 @@ int main(int argc, char** argv)
             throw;
         }
     } catch (const std::exception& e) {
-        std::cerr << argv[0] << ": Exception: " << e.what() << "\n";
+        LOG(error) << argv[0] << ": Exception: " << e.what();
         return 1;
     } catch (const char* e) {
-        std::cerr << argv[0] << ": Exception (string): " << e << "\n";
+        LOG(error) << argv[0] << ": Exception (string): " << e;
         return 1;
     } catch (...) {
-        std::cerr << argv[0] << ": Exception (other)\n";
+        LOG(error) << argv[0] << ": Exception (other)";
+        bthelper::log::stop();
         throw;
     }
 }
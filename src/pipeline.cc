@@ -0,0 +1,467 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "pipeline.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <system_error>
+
+namespace {
+size_t round_up_pow2(size_t n)
+{
+    size_t ret = 1;
+    while (ret < n) {
+        ret <<= 1;
+    }
+    return ret;
+}
+
+int make_eventfd()
+{
+    const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        throw std::system_error(errno, std::generic_category(), "eventfd()");
+    }
+    return fd;
+}
+
+void wake(int efd)
+{
+    const uint64_t one = 1;
+    if (-1 == write(efd, &one, sizeof one) && errno != EAGAIN) {
+        LOG(warning) << "write(eventfd): " << strerror(errno);
+    }
+}
+
+void drain(int efd)
+{
+    uint64_t tmp;
+    if (-1 == read(efd, &tmp, sizeof tmp) && errno != EAGAIN) {
+        LOG(warning) << "read(eventfd): " << strerror(errno);
+    }
+}
+
+void set_nonblock(int fd)
+{
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+        throw std::system_error(errno, std::generic_category(), "fcntl(O_NONBLOCK)");
+    }
+}
+
+// Poll, not counting EINTR as an error.
+void poll_fds(std::vector<pollfd>& pfds,
+              std::optional<TokenBucket::clock::duration> timeout)
+{
+    int ms = -1;
+    if (timeout) {
+        // Round up, or a wait of under a millisecond would spin.
+        ms = std::chrono::ceil<std::chrono::milliseconds>(*timeout).count();
+    }
+    if (poll(pfds.data(), pfds.size(), ms) < 0 && errno != EINTR) {
+        throw std::system_error(errno, std::generic_category(), "poll()");
+    }
+}
+} // namespace
+
+SpscRing::SpscRing(size_t capacity)
+    : buf_(std::make_unique<char[]>(round_up_pow2(capacity))),
+      mask_(round_up_pow2(capacity) - 1)
+{
+}
+
+std::string SpscRing::contents() const
+{
+    std::string ret;
+    const auto tail = tail_.load();
+    for (auto pos = tail; pos != head_.load(); pos++) {
+        ret += buf_[pos & mask_];
+    }
+    return ret;
+}
+
+struct Pipeline::Lane {
+    Lane(int src, int dst, std::unique_ptr<Buffer>&& buf, const StreamOptions& opts)
+        : src(src),
+          dst(dst),
+          buf(std::move(buf)),
+          opts(opts),
+          bucket(opts.rate, opts.rate_burst),
+          ring(opts.high_watermark + opts.read_size)
+    {
+    }
+
+    const int src;
+    const int dst;
+
+    // Reader thread only. nullptr when data goes straight into the
+    // ring.
+    std::unique_ptr<Buffer> buf;
+    bool read_eof = false;
+
+    const StreamOptions opts;
+
+    // Writer thread only.
+    TokenBucket bucket;
+
+    SpscRing ring;
+
+    // Set by the reader once all data from src is in the ring.
+    std::atomic<bool> src_eof{ false };
+
+    std::atomic<bool> ended{ false };
+
+    // Guarded by mu_.
+    CloseReason why = CloseReason::eof;
+    std::error_code err;
+};
+
+Pipeline::Pipeline(Shuffler& shuf)
+    : shuf_(shuf),
+      reader_wake_(make_eventfd()),
+      writer_wake_(make_eventfd()),
+      done_fd_(make_eventfd())
+{
+    shuf_.watch(done_fd_, [this](int) { report(); });
+}
+
+Pipeline::~Pipeline()
+{
+    pause();
+    shuf_.unwatch(done_fd_);
+    close(reader_wake_);
+    close(writer_wake_);
+    close(done_fd_);
+}
+
+void Pipeline::copy(int src,
+                    int dst,
+                    std::unique_ptr<Buffer>&& buf,
+                    const StreamOptions& opts)
+{
+    set_nonblock(src);
+    set_nonblock(dst);
+    std::string_view pending;
+    if (buf) {
+        pending = buf->peek();
+    }
+    auto o = opts;
+    o.high_watermark = std::max(o.high_watermark, pending.size());
+    if (!buf || dynamic_cast<RawBuffer*>(buf.get())) {
+        auto l = std::make_unique<Lane>(src, dst, nullptr, o);
+        const auto space = l->ring.space();
+        std::copy(pending.begin(), pending.end(), space.begin());
+        l->ring.commit(pending.size());
+        lanes_.push_back(std::move(l));
+        return;
+    }
+    lanes_.push_back(std::make_unique<Lane>(src, dst, std::move(buf), o));
+}
+
+void Pipeline::start()
+{
+    if (reader_.joinable()) {
+        return;
+    }
+    stop_ = false;
+    reader_ = std::thread([this] { reader(); });
+    writer_ = std::thread([this] { writer(); });
+}
+
+void Pipeline::pause()
+{
+    if (!reader_.joinable()) {
+        return;
+    }
+    stop_ = true;
+    wake(reader_wake_);
+    wake(writer_wake_);
+    reader_.join();
+    writer_.join();
+}
+
+void Pipeline::remove(int fd)
+{
+    for (auto& l : lanes_) {
+        if (l->src == fd || l->dst == fd) {
+            end(*l, CloseReason::removed, {}, -1);
+        }
+    }
+}
+
+std::vector<Shuffler::StreamState> Pipeline::snapshot() const
+{
+    std::vector<Shuffler::StreamState> ret;
+    for (const auto& l : lanes_) {
+        if (l->ended) {
+            continue;
+        }
+        auto output = l->ring.contents();
+        std::string partial;
+        if (l->buf) {
+            output += l->buf->peek();
+            partial = l->buf->partial();
+        }
+        ret.push_back({ l->src, l->dst, std::move(output), std::move(partial) });
+    }
+    return ret;
+}
+
+Shuffler::Stats Pipeline::stats() const
+{
+    Shuffler::Stats ret;
+    ret.wakeups = wakeups_;
+    ret.reads = reads_;
+    ret.writes = writes_;
+    return ret;
+}
+
+void Pipeline::end(Lane& l, CloseReason why, std::error_code err, int fd)
+{
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto& o : lanes_) {
+            const bool uses_fd = fd >= 0 && (o->src == fd || o->dst == fd);
+            if (o->ended || (o.get() != &l && !uses_fd)) {
+                continue;
+            }
+            o->why = o.get() == &l ? why : CloseReason::fd_error;
+            o->err = o.get() == &l ? err : std::error_code{};
+            o->ended = true;
+            ended_.push_back(o.get());
+        }
+    }
+    wake(done_fd_);
+    wake(reader_wake_);
+    wake(writer_wake_);
+}
+
+void Pipeline::report()
+{
+    drain(done_fd_);
+    std::vector<Lane*> ended;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        ended.swap(ended_);
+    }
+    for (const auto l : ended) {
+        if (l->opts.on_close) {
+            l->opts.on_close(l->why, l->err);
+        }
+    }
+}
+
+void Pipeline::commit(Lane& l, size_t n)
+{
+    l.ring.commit(n);
+    if (writer_waiting_) {
+        wake(writer_wake_);
+    }
+}
+
+bool Pipeline::flush(Lane& l)
+{
+    for (;;) {
+        const auto out = l.buf->peek();
+        if (out.empty()) {
+            return true;
+        }
+        const auto space = l.ring.space();
+        if (space.empty()) {
+            return false;
+        }
+        const auto n = std::min(out.size(), space.size());
+        std::copy(out.begin(), out.begin() + n, space.begin());
+        commit(l, n);
+        l.buf->ack(n);
+    }
+}
+
+void Pipeline::read_lane(Lane& l, std::vector<char>& scratch)
+{
+    char* dst = nullptr;
+    size_t want = l.opts.read_size;
+    if (l.buf) {
+        scratch.resize(want);
+        dst = scratch.data();
+    } else {
+        const auto space = l.ring.space();
+        dst = space.data();
+        want = std::min(want, space.size());
+    }
+    reads_++;
+    const auto r = shuffle_detail::read_some(l.src, dst, want);
+    if (!r.ok()) {
+        end(l, CloseReason::read_error, r.err, l.src);
+        return;
+    }
+    if (r.again) {
+        return;
+    }
+    if (!r.n) {
+        l.read_eof = true;
+        return;
+    }
+    const std::string_view data(dst, r.n);
+    if (l.opts.on_read) {
+        l.opts.on_read(data);
+    }
+    if (l.buf) {
+        l.buf->write(data);
+        flush(l);
+    } else {
+        commit(l, r.n);
+    }
+}
+
+void Pipeline::reader()
+{
+    std::vector<pollfd> pfds;
+    std::vector<Lane*> polled;
+    std::vector<char> scratch;
+    while (!stop_) {
+        // Say so before checking for room, so the writer can't make room
+        // in between without waking us.
+        reader_waiting_ = true;
+        bool waiting = false;
+        bool any = false;
+        pfds.clear();
+        polled.clear();
+        pfds.push_back({ reader_wake_, POLLIN, 0 });
+        for (auto& lp : lanes_) {
+            auto& l = *lp;
+            if (l.ended || l.src_eof) {
+                continue;
+            }
+            if (l.buf && !flush(l)) {
+                any = waiting = true;
+                continue;
+            }
+            if (l.read_eof) {
+                l.src_eof = true;
+                wake(writer_wake_);
+                continue;
+            }
+            any = true;
+            if (!l.buf && l.ring.space().empty()) {
+                waiting = true;
+                continue;
+            }
+            pfds.push_back({ l.src, POLLIN, 0 });
+            polled.push_back(&l);
+        }
+        if (!any) {
+            break;
+        }
+        if (!waiting) {
+            reader_waiting_ = false;
+        }
+        poll_fds(pfds, std::nullopt);
+        reader_waiting_ = false;
+        wakeups_++;
+        if (pfds[0].revents) {
+            drain(reader_wake_);
+        }
+        for (size_t i = 0; i < polled.size(); i++) {
+            auto& l = *polled[i];
+            if (pfds[i + 1].revents && !l.ended) {
+                read_lane(l, scratch);
+            }
+        }
+    }
+    reader_waiting_ = false;
+}
+
+void Pipeline::writer()
+{
+    std::vector<pollfd> pfds;
+    while (!stop_) {
+        writer_waiting_ = true;
+        bool waiting = false;
+        bool any = false;
+        bool progress = false;
+        std::optional<TokenBucket::clock::duration> timeout;
+        const auto now = TokenBucket::clock::now();
+        pfds.clear();
+        pfds.push_back({ writer_wake_, POLLIN, 0 });
+        for (auto& lp : lanes_) {
+            auto& l = *lp;
+            if (l.ended) {
+                continue;
+            }
+            const auto data = l.ring.data();
+            if (data.empty()) {
+                // EOF is only set after the last commit.
+                if (l.src_eof && l.ring.empty()) {
+                    end(l, CloseReason::eof, {}, -1);
+                    continue;
+                }
+                any = waiting = true;
+                continue;
+            }
+            any = true;
+            const auto limit = l.bucket.available(now);
+            if (!limit) {
+                const auto w = l.bucket.wait(std::min(data.size(), l.opts.io_unit), now);
+                timeout = timeout ? std::min(*timeout, w) : w;
+                continue;
+            }
+            auto want = std::min(limit, data.size());
+            if (l.opts.write_size) {
+                want = std::min(want, l.opts.write_size);
+            }
+            writes_++;
+            const auto r = shuffle_detail::write_some(l.dst, data.substr(0, want));
+            if (!r.ok()) {
+                end(l, CloseReason::write_error, r.err, l.dst);
+                continue;
+            }
+            if (r.again) {
+                pfds.push_back({ l.dst, POLLOUT, 0 });
+                continue;
+            }
+            l.bucket.consume(r.n);
+            l.ring.consume(r.n);
+            progress = true;
+            if (reader_waiting_) {
+                wake(reader_wake_);
+            }
+        }
+        if (!any) {
+            break;
+        }
+        if (progress || !waiting) {
+            writer_waiting_ = false;
+        }
+        if (progress) {
+            continue;
+        }
+        poll_fds(pfds, timeout);
+        writer_waiting_ = false;
+        wakeups_++;
+        if (pfds[0].revents) {
+            drain(writer_wake_);
+        }
+    }
+    writer_waiting_ = false;
+}
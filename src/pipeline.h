@@ -0,0 +1,176 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Forwarding on two threads.
+ *
+ * A Pipeline forwards a few streams ("lanes", e.g. both directions of a
+ * session) like Shuffler does, but with one thread reading from all
+ * sources and running the buffers (e.g. telnet coding), and another
+ * writing to all destinations. Each lane hands data from one to the
+ * other through a lock-free single-producer single-consumer ring.
+ *
+ * That lets a bulk session keep two cores busy. For interactive
+ * sessions the hand-over between threads only adds latency, so those
+ * should stay in the Shuffler.
+ *
+ * Lanes end like Shuffler streams do, and their on_close is called from
+ * the Shuffler given to the constructor. on_read is called on the
+ * reader thread. Escape characters are not supported.
+ */
+#ifndef __INCLUDE_PIPELINE_H__
+#define __INCLUDE_PIPELINE_H__
+#include "buffer.h"
+#include "shuffle.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Bounded byte ring for one producer thread and one consumer thread.
+// Positions count all bytes ever written and read, and wrap with the
+// size_t.
+class SpscRing
+{
+public:
+    // Capacity is rounded up to a power of two.
+    explicit SpscRing(size_t capacity);
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // Producer: contiguous free space, and making n bytes of it
+    // readable.
+    std::span<char> space()
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        const auto off = head & mask_;
+        const auto free = capacity() - (head - tail_.load());
+        return { &buf_[off], std::min(free, capacity() - off) };
+    }
+    void commit(size_t n) { head_.store(head_.load(std::memory_order_relaxed) + n); }
+
+    // Consumer: contiguous readable bytes, and freeing n of them.
+    std::string_view data() const
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        const auto off = tail & mask_;
+        return { &buf_[off], std::min(head_.load() - tail, capacity() - off) };
+    }
+    void consume(size_t n) { tail_.store(tail_.load(std::memory_order_relaxed) + n); }
+
+    bool empty() const { return head_.load() == tail_.load(); }
+
+    // Everything readable, in order. Only while neither side runs.
+    std::string contents() const;
+
+private:
+    std::unique_ptr<char[]> buf_;
+    size_t mask_;
+
+    // On separate cache lines, so that each side's writes don't keep
+    // taking the line from the other. Sequentially consistent, so that
+    // a side going to sleep and the other side checking whether it
+    // needs waking can't miss each other.
+    alignas(64) std::atomic<size_t> head_{ 0 };
+    alignas(64) std::atomic<size_t> tail_{ 0 };
+};
+
+class Pipeline
+{
+public:
+    // Ended lanes are reported from shuf's run().
+    explicit Pipeline(Shuffler& shuf);
+    ~Pipeline();
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    // Add a lane, before start(). fds are made non-blocking. With a
+    // RawBuffer (or nullptr), data is read straight into the ring, and
+    // anything already in the buffer put there first.
+    void copy(int src, int dst, std::unique_ptr<Buffer>&& buf, const StreamOptions& opts);
+
+    // Start the threads, or restart them after pause().
+    void start();
+
+    // Stop the threads, keeping all data where it is.
+    void pause();
+
+    // End all lanes reading from or writing to fd. Safe to call from
+    // on_close.
+    void remove(int fd);
+
+    // Buffered state of lanes not yet ended. Only while paused.
+    std::vector<Shuffler::StreamState> snapshot() const;
+
+    // Counts since construction, wakeups being of either thread.
+    Shuffler::Stats stats() const;
+
+private:
+    struct Lane;
+
+    void reader();
+    void writer();
+
+    // Reader thread: read what src has into l.
+    void read_lane(Lane& l, std::vector<char>& scratch);
+
+    // Reader thread: move what l's buffer has into the ring. Returns
+    // false if not all of it fit.
+    bool flush(Lane& l);
+
+    // Reader thread: make n more bytes of the ring readable, waking the
+    // writer if it's waiting for that.
+    void commit(Lane& l, size_t n);
+
+    // End l, and if fd >= 0, all other lanes using fd. Either thread,
+    // or the Shuffler's.
+    void end(Lane& l, CloseReason why, std::error_code err, int fd);
+
+    // Call on_close for lanes that have ended.
+    void report();
+
+    Shuffler& shuf_;
+    std::vector<std::unique_ptr<Lane>> lanes_;
+    std::thread reader_;
+    std::thread writer_;
+    std::atomic<bool> stop_{ false };
+
+    // eventfds that the threads poll(), to be woken by the other thread
+    // or by the Shuffler's. One side only wakes the other when it said
+    // it's waiting for room or data.
+    int reader_wake_ = -1;
+    int writer_wake_ = -1;
+    std::atomic<bool> reader_waiting_{ false };
+    std::atomic<bool> writer_waiting_{ false };
+
+    // eventfd the Shuffler watches, and the lanes ended since it last
+    // looked.
+    int done_fd_ = -1;
+    std::mutex mu_;
+    std::vector<Lane*> ended_;
+
+    std::atomic<uint64_t> wakeups_{ 0 };
+    std::atomic<uint64_t> reads_{ 0 };
+    std::atomic<uint64_t> writes_{ 0 };
+};
+#endif
@@ -0,0 +1,222 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "predict.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+namespace {
+// Echoes needed on a line before predictions are shown.
+constexpr int confidence_threshold = 2;
+
+// Give up on predictions not confirmed within this time.
+constexpr auto confirm_timeout = std::chrono::seconds(2);
+
+// Remote output containing these (lowercased) turns prediction off
+// until the next line is entered.
+const char* secret_prompts[] = { "password", "passphrase" };
+
+constexpr size_t max_line = 128;
+
+constexpr char esc = 0x1b;
+
+bool printable(char ch) { return ch >= 0x20 && ch < 0x7f; }
+} // namespace
+
+std::string_view PredictEchoBuffer::peek() const
+{
+    if (data_.empty()) {
+        return {};
+    }
+    return { &data_[0], data_.size() };
+}
+
+void PredictEchoBuffer::ack(size_t n)
+{
+    if (n > data_.size()) {
+        throw std::invalid_argument("PredictEchoBuffer::ack(): n > data_.size(): "
+                                    + std::to_string(n) + " > "
+                                    + std::to_string(data_.size()));
+    }
+    data_.erase(data_.begin(), data_.begin() + n);
+}
+
+void PredictEchoBuffer::emit(std::string_view sv)
+{
+    data_.insert(data_.end(), sv.begin(), sv.end());
+}
+
+size_t PredictEchoBuffer::shown() const
+{
+    return std::count_if(
+        pending_.begin(), pending_.end(), [](const auto& p) { return p.shown; });
+}
+
+void PredictEchoBuffer::erase_shown()
+{
+    const auto n = shown();
+    if (n) {
+        // Shown predictions are always at the end of the line.
+        emit("\x1b[" + std::to_string(n) + "D\x1b[K");
+    }
+    pending_.clear();
+}
+
+void PredictEchoBuffer::keystrokes(std::string_view sv)
+{
+    const auto now = clock::now();
+    for (const auto ch : sv) {
+        if (!printable(ch)) {
+            // Enter, editing, or cursor keys. Too hard to predict, and
+            // a new line needs to earn confidence again.
+            confirmed_ = 0;
+            if (ch == '\r' || ch == '\n') {
+                suppressed_ = false;
+                line_.clear();
+            }
+            continue;
+        }
+        const bool show = !suppressed_ && col_known_
+                          && confirmed_ >= confidence_threshold
+                          && col_ + static_cast<int>(pending_.size()) + 1 < width_
+                          && (pending_.empty() || pending_.back().shown);
+        pending_.push_back({ ch, show, now });
+        if (show) {
+            emit("\x1b[4m");
+            emit({ &ch, 1 });
+            emit("\x1b[24m");
+        }
+    }
+}
+
+void PredictEchoBuffer::tick()
+{
+    if (pending_.empty()) {
+        return;
+    }
+    if (clock::now() - pending_.front().when < confirm_timeout) {
+        return;
+    }
+    // Not echoing.
+    erase_shown();
+    confirmed_ = 0;
+}
+
+void PredictEchoBuffer::write(std::string_view sv)
+{
+    for (const auto ch : sv) {
+        remote_byte(ch);
+    }
+}
+
+void PredictEchoBuffer::remote_byte(char ch)
+{
+    if (!pending_.empty() && esc_ == Esc::none && ch == pending_.front().ch) {
+        // Echo of a keystroke.
+        const auto n = shown();
+        if (pending_.front().shown) {
+            // Redraw it without underline.
+            emit("\x1b[" + std::to_string(n) + "D");
+            emit({ &ch, 1 });
+            if (n > 1) {
+                emit("\x1b[" + std::to_string(n - 1) + "C");
+            }
+        } else {
+            emit({ &ch, 1 });
+        }
+        pending_.pop_front();
+        confirmed_++;
+        track_cursor(ch);
+        track_prompt(ch);
+        return;
+    }
+    if (!pending_.empty()) {
+        // Not what we predicted.
+        erase_shown();
+        confirmed_ = 0;
+    }
+    emit({ &ch, 1 });
+    track_cursor(ch);
+    track_prompt(ch);
+}
+
+void PredictEchoBuffer::track_cursor(char ch)
+{
+    switch (esc_) {
+    case Esc::esc:
+        if (ch == '[') {
+            esc_ = Esc::csi;
+        } else {
+            // Other escapes (charset, save/restore cursor, ...). Don't
+            // know where that leaves us.
+            esc_ = Esc::none;
+            col_known_ = false;
+        }
+        return;
+    case Esc::csi:
+        if (ch >= 0x40 && ch <= 0x7e) {
+            // Final byte. Only SGR is known to not move the cursor.
+            if (ch != 'm') {
+                col_known_ = false;
+            }
+            esc_ = Esc::none;
+        }
+        return;
+    case Esc::none:
+        break;
+    }
+
+    const auto uch = static_cast<unsigned char>(ch);
+    if (ch == esc) {
+        esc_ = Esc::esc;
+    } else if (ch == '\r') {
+        col_ = 0;
+        col_known_ = true;
+    } else if (ch == '\b') {
+        col_ = std::max(0, col_ - 1);
+    } else if (ch == '\t') {
+        col_ = (col_ / 8 + 1) * 8;
+    } else if (printable(ch) || (uch >= 0xc0 && uch < 0xf8)) {
+        // ASCII, or the first byte of a UTF-8 sequence.
+        col_++;
+    }
+    if (col_ >= width_) {
+        // Wrapped, or about to.
+        col_known_ = false;
+    }
+}
+
+void PredictEchoBuffer::track_prompt(char ch)
+{
+    if (ch == '\n') {
+        line_.clear();
+        return;
+    }
+    line_.push_back(std::tolower(static_cast<unsigned char>(ch)));
+    if (line_.size() > max_line) {
+        line_.erase(0, line_.size() - max_line);
+    }
+    for (const auto p : secret_prompts) {
+        if (line_.find(p) != std::string::npos) {
+            suppressed_ = true;
+            erase_shown();
+            confirmed_ = 0;
+            line_.clear();
+            return;
+        }
+    }
+}
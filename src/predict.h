@@ -0,0 +1,107 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Predictive local echo, in the style of mosh.
+ *
+ * Printable keystrokes are shown right away, underlined, and redrawn
+ * normally once the remote echo confirms them. Anything unexpected from
+ * the remote end wipes the predictions.
+ *
+ * Predictions are only shown once the remote end has been seen echoing
+ * a few keystrokes on the current line, and are disabled at what looks
+ * like password prompts.
+ */
+#ifndef __INCLUDE_PREDICT_H__
+#define __INCLUDE_PREDICT_H__
+#include "buffer.h"
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+
+// Output towards the local terminal, i.e. remote data plus predictions.
+class PredictEchoBuffer : public Buffer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // Remote data.
+    void write(std::string_view sv) override;
+    std::string_view peek() const override;
+    void ack(size_t n) override;
+
+    // Local keystrokes, on their way to the remote end.
+    void keystrokes(std::string_view sv);
+
+    // Terminal width, to not predict across line wraps.
+    void set_width(uint16_t cols) { width_ = cols; }
+
+    // Call periodically, to expire predictions that were never confirmed.
+    void tick();
+
+private:
+    struct Prediction {
+        char ch;
+        bool shown;
+        clock::time_point when;
+    };
+
+    void remote_byte(char ch);
+    void track_cursor(char ch);
+    void track_prompt(char ch);
+    void erase_shown();
+    void emit(std::string_view sv);
+    size_t shown() const;
+
+    std::vector<char> data_;
+    std::deque<Prediction> pending_;
+
+    // Lightweight terminal model.
+    int width_ = 80;
+    int col_ = 0;
+    bool col_known_ = false;
+    enum class Esc { none, esc, csi } esc_ = Esc::none;
+
+    // Echoes seen on this line, and whether to predict at all.
+    int confirmed_ = 0;
+    bool suppressed_ = false;
+    std::string line_;
+};
+
+// Passes keystrokes on to an inner buffer, telling the predictor
+// about them on the way.
+class KeystrokeTap : public Buffer
+{
+public:
+    KeystrokeTap(std::unique_ptr<Buffer>&& inner, PredictEchoBuffer* pred)
+        : inner_(std::move(inner)), pred_(pred)
+    {
+    }
+
+    void write(std::string_view sv) override
+    {
+        pred_->keystrokes(sv);
+        inner_->write(sv);
+    }
+    std::string_view peek() const override { return inner_->peek(); }
+    void ack(size_t n) override { inner_->ack(n); }
+
+private:
+    std::unique_ptr<Buffer> inner_;
+    PredictEchoBuffer* pred_;
+};
+#endif
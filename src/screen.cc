@@ -0,0 +1,815 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "screen.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+constexpr char esc = 0x1b;
+constexpr size_t max_params = 16;
+constexpr int tab_width = 8;
+
+// Rewriting this many unchanged cells is cheaper than moving the cursor
+// past them.
+constexpr int max_gap = 4;
+
+// Attr::flags, and their SGR codes.
+namespace attr {
+constexpr uint8_t bold = 1;
+constexpr uint8_t dim = 2;
+constexpr uint8_t italic = 4;
+constexpr uint8_t underline = 8;
+constexpr uint8_t blink = 16;
+constexpr uint8_t reverse = 32;
+constexpr uint8_t invisible = 64;
+constexpr uint8_t strike = 128;
+} // namespace attr
+constexpr std::pair<uint8_t, int> sgr_codes[] = {
+    { attr::bold, 1 },    { attr::dim, 2 },     { attr::italic, 3 },
+    { attr::underline, 4 }, { attr::blink, 5 }, { attr::reverse, 7 },
+    { attr::invisible, 8 }, { attr::strike, 9 },
+};
+
+constexpr int32_t true_colour = 1 << 24;
+
+std::string cup(int row, int col)
+{
+    return "\x1b[" + std::to_string(row + 1) + ";" + std::to_string(col + 1) + "H";
+}
+
+// base is 30 for foreground, 40 for background.
+void render_colour(std::string& out, int32_t c, int base)
+{
+    out += ';';
+    if (c & true_colour) {
+        out += std::to_string(base + 8) + ";2;" + std::to_string((c >> 16) & 0xff) + ";"
+               + std::to_string((c >> 8) & 0xff) + ";" + std::to_string(c & 0xff);
+    } else if (c < 8) {
+        out += std::to_string(base + c);
+    } else if (c < 16) {
+        out += std::to_string(base + 60 + c - 8);
+    } else {
+        out += std::to_string(base + 8) + ";5;" + std::to_string(c);
+    }
+}
+uint16_t clamp_size(uint16_t n) { return std::clamp<uint16_t>(n, 1, Screen::max_size); }
+} // namespace
+
+Screen::Screen(uint16_t rows, uint16_t cols)
+    : rows_(clamp_size(rows)),
+      cols_(clamp_size(cols)),
+      cells_(size_t{ rows_ } * cols_),
+      scroll_bottom_(rows_ - 1)
+{
+}
+
+Screen::Cell Screen::blank() const
+{
+    // Erasing uses the current background colour, like xterm.
+    Cell c;
+    c.attr.bg = cur_.pen.bg;
+    return c;
+}
+
+void Screen::write(std::string_view sv)
+{
+    for (const auto ch : sv) {
+        byte(ch);
+    }
+}
+
+void Screen::byte(char ch)
+{
+    const auto uc = static_cast<unsigned char>(ch);
+    switch (state_) {
+    case State::ground:
+        if (utf8_need_) {
+            if ((uc & 0xc0) == 0x80) {
+                utf8_ += ch;
+                if (!--utf8_need_) {
+                    print(utf8_);
+                }
+                return;
+            }
+            // Truncated sequence.
+            utf8_need_ = 0;
+            print("?");
+        }
+        if (uc < 0x20 || uc == 0x7f) {
+            control(ch);
+        } else if (uc < 0x80) {
+            print(std::string_view(&ch, 1));
+        } else if ((uc & 0xe0) == 0xc0) {
+            utf8_.assign(1, ch);
+            utf8_need_ = 1;
+        } else if ((uc & 0xf0) == 0xe0) {
+            utf8_.assign(1, ch);
+            utf8_need_ = 2;
+        } else if ((uc & 0xf8) == 0xf0) {
+            utf8_.assign(1, ch);
+            utf8_need_ = 3;
+        } else {
+            print("?");
+        }
+        return;
+    case State::esc:
+        escape(ch);
+        return;
+    case State::esc_skip:
+        // Charset designation and the like. Everything is UTF-8.
+        state_ = State::ground;
+        return;
+    case State::csi:
+        if (ch >= '0' && ch <= '9') {
+            if (params_.empty()) {
+                params_.push_back(0);
+            }
+            params_.back() = std::min(params_.back() * 10 + (ch - '0'), 0xffff);
+        } else if (ch == ';' || ch == ':') {
+            if (params_.empty()) {
+                params_.push_back(0);
+            }
+            if (params_.size() < max_params) {
+                params_.push_back(0);
+            }
+        } else if (ch >= 0x3c && ch <= 0x3f) {
+            private_ = ch;
+        } else if (ch >= 0x20 && ch <= 0x2f) {
+            intermediate_ = ch;
+        } else if (ch >= 0x40 && ch <= 0x7e) {
+            state_ = State::ground;
+            csi(ch);
+        } else if (uc < 0x20) {
+            control(ch);
+        }
+        return;
+    case State::osc:
+    case State::str:
+        // Ignored until BEL (OSC only) or ST. ESC starts ST, or aborts.
+        if (ch == esc) {
+            state_ = State::esc;
+        } else if ((ch == '\a' && state_ == State::osc) || ch == 0x18 || ch == 0x1a) {
+            state_ = State::ground;
+        }
+        return;
+    }
+}
+
+void Screen::control(char ch)
+{
+    switch (ch) {
+    case '\a':
+        bells_++;
+        break;
+    case '\b':
+        move_to(cur_.row, cur_.col - 1);
+        break;
+    case '\t':
+        move_to(cur_.row, (cur_.col / tab_width + 1) * tab_width);
+        break;
+    case '\n':
+    case '\v':
+    case '\f':
+        linefeed();
+        break;
+    case '\r':
+        move_to(cur_.row, 0);
+        break;
+    case esc:
+        state_ = State::esc;
+        break;
+    case 0x18: // CAN
+    case 0x1a: // SUB
+        state_ = State::ground;
+        break;
+    }
+}
+
+void Screen::escape(char ch)
+{
+    state_ = State::ground;
+    switch (ch) {
+    case '[':
+        state_ = State::csi;
+        params_.clear();
+        private_ = 0;
+        intermediate_ = 0;
+        break;
+    case ']':
+        state_ = State::osc;
+        break;
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+        state_ = State::str;
+        break;
+    case ' ':
+    case '#':
+    case '%':
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+    case '-':
+    case '.':
+    case '/':
+        state_ = State::esc_skip;
+        break;
+    case '7':
+        saved_ = cur_;
+        break;
+    case '8':
+        cur_ = saved_;
+        move_to(cur_.row, cur_.col);
+        break;
+    case 'D':
+        linefeed();
+        break;
+    case 'E':
+        move_to(cur_.row, 0);
+        linefeed();
+        break;
+    case 'M':
+        reverse_index();
+        break;
+    case 'c':
+        reset();
+        break;
+    case esc:
+        state_ = State::esc;
+        break;
+    }
+}
+
+int Screen::param(size_t n, int def) const
+{
+    if (n >= params_.size() || !params_[n]) {
+        return def;
+    }
+    return params_[n];
+}
+
+void Screen::csi(char final)
+{
+    if (intermediate_) {
+        // E.g. cursor style. Nothing on screen.
+        return;
+    }
+    if (private_ == '?') {
+        if (final == 'h' || final == 'l') {
+            mode(final == 'h');
+        }
+        return;
+    }
+    if (private_ == '>') {
+        if (final == 'c' && reply) {
+            // Secondary device attributes: a VT220.
+            reply("\x1b[>1;10;0c");
+        }
+        return;
+    }
+    if (private_) {
+        return;
+    }
+    const int n = param(0, 1);
+    const int row = cur_.row;
+    const int col = cur_.col;
+    switch (final) {
+    case 'A':
+        move_to(row - n, col);
+        break;
+    case 'B':
+    case 'e':
+        move_to(row + n, col);
+        break;
+    case 'C':
+    case 'a':
+        move_to(row, col + n);
+        break;
+    case 'D':
+        move_to(row, col - n);
+        break;
+    case 'E':
+        move_to(row + n, 0);
+        break;
+    case 'F':
+        move_to(row - n, 0);
+        break;
+    case 'G':
+    case '`':
+        move_to(row, n - 1);
+        break;
+    case 'd':
+        move_to(n - 1, col);
+        break;
+    case 'H':
+    case 'f':
+        move_to(param(0, 1) - 1, param(1, 1) - 1);
+        break;
+    case 'J':
+        switch (param(0, 0)) {
+        case 0:
+            erase(row, col, cols_);
+            for (int r = row + 1; r < rows_; r++) {
+                erase(r, 0, cols_);
+            }
+            break;
+        case 1:
+            for (int r = 0; r < row; r++) {
+                erase(r, 0, cols_);
+            }
+            erase(row, 0, col + 1);
+            break;
+        case 2:
+        case 3:
+            for (int r = 0; r < rows_; r++) {
+                erase(r, 0, cols_);
+            }
+            break;
+        }
+        break;
+    case 'K':
+        switch (param(0, 0)) {
+        case 0:
+            erase(row, col, cols_);
+            break;
+        case 1:
+            erase(row, 0, col + 1);
+            break;
+        case 2:
+            erase(row, 0, cols_);
+            break;
+        }
+        break;
+    case 'X':
+        erase(row, col, std::min<int>(cols_, col + n));
+        wrap_pending_ = false;
+        break;
+    case '@': {
+        const auto begin = cells_.begin() + row * cols_;
+        const int k = std::min(n, cols_ - col);
+        std::copy_backward(begin + col, begin + cols_ - k, begin + cols_);
+        erase(row, col, col + k);
+        wrap_pending_ = false;
+        break;
+    }
+    case 'P': {
+        const auto begin = cells_.begin() + row * cols_;
+        const int k = std::min(n, cols_ - col);
+        std::copy(begin + col + k, begin + cols_, begin + col);
+        erase(row, cols_ - k, cols_);
+        wrap_pending_ = false;
+        break;
+    }
+    case 'L':
+        if (row >= scroll_top_ && row <= scroll_bottom_) {
+            scroll_down(row, scroll_bottom_, n);
+            move_to(row, 0);
+        }
+        break;
+    case 'M':
+        if (row >= scroll_top_ && row <= scroll_bottom_) {
+            scroll_up(row, scroll_bottom_, n);
+            move_to(row, 0);
+        }
+        break;
+    case 'S':
+        scroll_up(scroll_top_, scroll_bottom_, n);
+        break;
+    case 'T':
+        // With more parameters, it's mouse tracking.
+        if (params_.size() <= 1) {
+            scroll_down(scroll_top_, scroll_bottom_, n);
+        }
+        break;
+    case 'r': {
+        const int top = param(0, 1) - 1;
+        const int bottom = param(1, rows_) - 1;
+        if (top < bottom && bottom < rows_) {
+            scroll_top_ = top;
+            scroll_bottom_ = bottom;
+            move_to(0, 0);
+        }
+        break;
+    }
+    case 's':
+        saved_ = cur_;
+        break;
+    case 'u':
+        cur_ = saved_;
+        move_to(cur_.row, cur_.col);
+        break;
+    case 'm':
+        sgr();
+        break;
+    case 'n':
+        if (!reply) {
+            break;
+        }
+        if (param(0, 0) == 5) {
+            reply("\x1b[0n");
+        } else if (param(0, 0) == 6) {
+            reply("\x1b[" + std::to_string(row + 1) + ";" + std::to_string(col + 1)
+                  + "R");
+        }
+        break;
+    case 'c':
+        if (param(0, 0) == 0 && reply) {
+            // A VT100 with advanced video.
+            reply("\x1b[?1;2c");
+        }
+        break;
+    }
+}
+
+void Screen::mode(bool on)
+{
+    for (const auto p : params_) {
+        switch (p) {
+        case 7:
+            autowrap_ = on;
+            break;
+        case 25:
+            cursor_visible_ = on;
+            break;
+        case 47:
+        case 1047:
+        case 1049:
+            if (on == alt_) {
+                break;
+            }
+            if (on) {
+                if (p == 1049) {
+                    saved_ = cur_;
+                }
+                main_cells_ = cells_;
+                std::fill(cells_.begin(), cells_.end(), blank());
+            } else {
+                cells_ = std::move(main_cells_);
+                main_cells_.clear();
+                if (p == 1049) {
+                    cur_ = saved_;
+                    move_to(cur_.row, cur_.col);
+                }
+            }
+            alt_ = on;
+            break;
+        }
+    }
+}
+
+void Screen::sgr()
+{
+    auto& pen = cur_.pen;
+    if (params_.empty()) {
+        pen = Attr{};
+    }
+    for (size_t i = 0; i < params_.size(); i++) {
+        const int p = params_[i];
+        if (p == 0) {
+            pen = Attr{};
+        } else if (p == 22) {
+            pen.flags &= ~(attr::bold | attr::dim);
+        } else if (p >= 30 && p <= 37) {
+            pen.fg = p - 30;
+        } else if (p == 39) {
+            pen.fg = -1;
+        } else if (p >= 40 && p <= 47) {
+            pen.bg = p - 40;
+        } else if (p == 49) {
+            pen.bg = -1;
+        } else if (p >= 90 && p <= 97) {
+            pen.fg = p - 90 + 8;
+        } else if (p >= 100 && p <= 107) {
+            pen.bg = p - 100 + 8;
+        } else if (p == 38 || p == 48) {
+            int32_t c;
+            if (i + 2 < params_.size() && params_[i + 1] == 5) {
+                c = params_[i + 2] & 0xff;
+                i += 2;
+            } else if (i + 4 < params_.size() && params_[i + 1] == 2) {
+                c = true_colour | (params_[i + 2] & 0xff) << 16
+                    | (params_[i + 3] & 0xff) << 8 | (params_[i + 4] & 0xff);
+                i += 4;
+            } else {
+                return;
+            }
+            (p == 38 ? pen.fg : pen.bg) = c;
+        } else {
+            for (const auto& [flag, code] : sgr_codes) {
+                if (p == code) {
+                    pen.flags |= flag;
+                } else if (p == code + 20) {
+                    pen.flags &= ~flag;
+                }
+            }
+        }
+    }
+}
+
+void Screen::print(std::string_view ch)
+{
+    if (wrap_pending_) {
+        move_to(cur_.row, 0);
+        linefeed();
+    }
+    auto& cell = at(cur_.row, cur_.col);
+    std::copy(ch.begin(), ch.end(), cell.ch);
+    cell.len = ch.size();
+    cell.attr = cur_.pen;
+    if (cur_.col + 1 < cols_) {
+        cur_.col++;
+    } else {
+        wrap_pending_ = autowrap_;
+    }
+}
+
+void Screen::move_to(int row, int col)
+{
+    cur_.row = std::clamp(row, 0, rows_ - 1);
+    cur_.col = std::clamp(col, 0, cols_ - 1);
+    wrap_pending_ = false;
+}
+
+void Screen::linefeed()
+{
+    wrap_pending_ = false;
+    if (cur_.row == scroll_bottom_) {
+        scroll_up(scroll_top_, scroll_bottom_, 1);
+    } else if (cur_.row + 1 < rows_) {
+        cur_.row++;
+    }
+}
+
+void Screen::reverse_index()
+{
+    wrap_pending_ = false;
+    if (cur_.row == scroll_top_) {
+        scroll_down(scroll_top_, scroll_bottom_, 1);
+    } else if (cur_.row > 0) {
+        cur_.row--;
+    }
+}
+
+void Screen::scroll_up(int top, int bottom, int n)
+{
+    n = std::min(n, bottom - top + 1);
+    const auto begin = cells_.begin();
+    std::copy(
+        begin + (top + n) * cols_, begin + (bottom + 1) * cols_, begin + top * cols_);
+    for (int r = bottom - n + 1; r <= bottom; r++) {
+        erase(r, 0, cols_);
+    }
+}
+
+void Screen::scroll_down(int top, int bottom, int n)
+{
+    n = std::min(n, bottom - top + 1);
+    const auto begin = cells_.begin();
+    std::copy_backward(begin + top * cols_,
+                       begin + (bottom + 1 - n) * cols_,
+                       begin + (bottom + 1) * cols_);
+    for (int r = top; r < top + n; r++) {
+        erase(r, 0, cols_);
+    }
+}
+
+void Screen::erase(int row, int from, int to)
+{
+    const auto begin = cells_.begin() + row * cols_;
+    std::fill(begin + from, begin + to, blank());
+}
+
+void Screen::reset()
+{
+    auto r = std::move(reply);
+    const auto bells = bells_;
+    *this = Screen(rows_, cols_);
+    reply = std::move(r);
+    bells_ = bells;
+}
+
+void Screen::resize(uint16_t rows, uint16_t cols)
+{
+    rows = clamp_size(rows);
+    cols = clamp_size(cols);
+    if (rows == rows_ && cols == cols_) {
+        return;
+    }
+    const auto resized = [&](const std::vector<Cell>& old) {
+        std::vector<Cell> ret(size_t{ rows } * cols);
+        for (size_t r = 0; r < std::min(rows, rows_); r++) {
+            std::copy_n(old.begin() + r * cols_,
+                        std::min(cols, cols_),
+                        ret.begin() + r * cols);
+        }
+        return ret;
+    };
+    cells_ = resized(cells_);
+    if (alt_) {
+        main_cells_ = resized(main_cells_);
+    }
+    rows_ = rows;
+    cols_ = cols;
+    scroll_top_ = 0;
+    scroll_bottom_ = rows_ - 1;
+    saved_.row = std::min<int>(saved_.row, rows_ - 1);
+    saved_.col = std::min<int>(saved_.col, cols_ - 1);
+    move_to(cur_.row, cur_.col);
+}
+
+void Screen::render_attr(std::string& out, const Attr& a)
+{
+    out += "\x1b[0";
+    for (const auto& [flag, code] : sgr_codes) {
+        if (a.flags & flag) {
+            out += ';' + std::to_string(code);
+        }
+    }
+    if (a.fg >= 0) {
+        render_colour(out, a.fg, 30);
+    }
+    if (a.bg >= 0) {
+        render_colour(out, a.bg, 40);
+    }
+    out += 'm';
+}
+
+void Screen::render_cells(std::string& out, int row, int from, int to, Attr& pen) const
+{
+    for (int c = from; c < to; c++) {
+        const auto& cell = at(row, c);
+        if (!(cell.attr == pen)) {
+            render_attr(out, cell.attr);
+            pen = cell.attr;
+        }
+        out.append(cell.ch, cell.len);
+    }
+}
+
+std::string Screen::diff(const Screen& prev) const
+{
+    if (prev.rows_ != rows_ || prev.cols_ != cols_) {
+        return snapshot();
+    }
+    // Frames start and end with default attributes.
+    std::string out;
+    Attr pen;
+    int out_row = -1;
+    int out_col = -1;
+    for (int r = 0; r < rows_; r++) {
+        int c = 0;
+        while (c < cols_) {
+            if (at(r, c) == prev.at(r, c)) {
+                c++;
+                continue;
+            }
+            int end = c + 1;
+            for (int i = end, gap = 0; i < cols_ && gap < max_gap; i++) {
+                if (at(r, i) == prev.at(r, i)) {
+                    gap++;
+                } else {
+                    end = i + 1;
+                    gap = 0;
+                }
+            }
+            if (r != out_row || c != out_col) {
+                out += cup(r, c);
+            }
+            render_cells(out, r, c, end, pen);
+            out_row = r;
+            out_col = end;
+            c = end;
+        }
+    }
+    if (!(pen == Attr{})) {
+        out += "\x1b[0m";
+    }
+    if (!out.empty() || cur_.row != prev.cur_.row || cur_.col != prev.cur_.col) {
+        out += cup(cur_.row, cur_.col);
+    }
+    if (cursor_visible_ != prev.cursor_visible_) {
+        out += cursor_visible_ ? "\x1b[?25h" : "\x1b[?25l";
+    }
+    if (bells_ != prev.bells_) {
+        out += '\a';
+    }
+    return out;
+}
+
+std::string Screen::snapshot() const
+{
+    std::string out = "\x1b[0m\x1b[H\x1b[2J";
+    Attr pen;
+    const Cell empty;
+    for (int r = 0; r < rows_; r++) {
+        int end = cols_;
+        while (end > 0 && at(r, end - 1) == empty) {
+            end--;
+        }
+        if (end) {
+            out += cup(r, 0);
+            render_cells(out, r, 0, end, pen);
+        }
+    }
+    if (!(pen == Attr{})) {
+        out += "\x1b[0m";
+    }
+    out += cup(cur_.row, cur_.col);
+    out += cursor_visible_ ? "\x1b[?25h" : "\x1b[?25l";
+    return out;
+}
+
+ScreenFeed::ScreenFeed(uint16_t rows, uint16_t cols)
+    : screen_(rows, cols), shown_(rows, cols)
+{
+}
+
+void ScreenFeed::write(std::string_view sv)
+{
+    screen_.write(sv);
+    if (!dirty_) {
+        dirty_ = true;
+        if (on_dirty) {
+            on_dirty();
+        }
+    }
+}
+
+bool ScreenFeed::render()
+{
+    if (!out_.empty()) {
+        return false;
+    }
+    if (dirty_) {
+        out_ = full_ ? screen_.snapshot() : screen_.diff(shown_);
+        shown_ = screen_;
+        dirty_ = full_ = false;
+    }
+    return true;
+}
+
+void ScreenFeed::redraw()
+{
+    out_.clear();
+    full_ = true;
+    if (!dirty_) {
+        dirty_ = true;
+        if (on_dirty) {
+            on_dirty();
+        }
+    }
+}
+
+void ScreenFeed::ack(size_t n)
+{
+    if (n > out_.size()) {
+        throw std::invalid_argument("ScreenFeed::ack(): n > out_.size(): "
+                                    + std::to_string(n) + " > "
+                                    + std::to_string(out_.size()));
+    }
+    out_.erase(0, n);
+}
+
+std::string_view ScreenBuffer::partial() const
+{
+    auto& s = feed_->screen();
+    partial_ = std::to_string(s.rows()) + " " + std::to_string(s.cols()) + "\n"
+               + s.snapshot();
+    return partial_;
+}
+
+void ScreenBuffer::restore(std::string_view, std::string_view partial)
+{
+    if (!partial.empty()) {
+        unsigned rows = 0;
+        unsigned cols = 0;
+        const auto nl = partial.find('\n');
+        const auto size = std::string(partial.substr(0, nl));
+        if (nl == std::string_view::npos
+            || 2 != sscanf(size.c_str(), "%u %u", &rows, &cols)) {
+            throw std::invalid_argument("ScreenBuffer::restore(): bad screen size");
+        }
+        feed_->screen().resize(rows, cols);
+        feed_->screen().write(partial.substr(nl + 1));
+    }
+    // The client's screen is unknown, so start over.
+    feed_->redraw();
+}
@@ -0,0 +1,201 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Server side terminal emulation.
+ *
+ * Screen follows what a program draws on a VT100 (xterm subset) terminal.
+ * Instead of passing every byte on to a client, only what it takes to
+ * bring the client's screen up to date is sent, at most once per frame.
+ * A flood of output then costs at most a screenful per frame, and a
+ * client that (re)connects gets one redraw instead of the history.
+ */
+#ifndef __INCLUDE_SCREEN_H__
+#define __INCLUDE_SCREEN_H__
+#include "buffer.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Screen
+{
+public:
+    // Sizes come from the client, so are clamped to 1-max_size.
+    static constexpr uint16_t max_size = 1000;
+
+    Screen(uint16_t rows = 24, uint16_t cols = 80);
+
+    // Output from the program.
+    void write(std::string_view sv);
+
+    // Keeps the top left of the screen.
+    void resize(uint16_t rows, uint16_t cols);
+
+    uint16_t rows() const { return rows_; }
+    uint16_t cols() const { return cols_; }
+
+    // Escape sequences that turn a terminal showing prev into showing
+    // this. A full redraw if the sizes differ.
+    std::string diff(const Screen& prev) const;
+
+    // Clear and redraw the whole screen.
+    std::string snapshot() const;
+
+    // Answers to queries (cursor position, device attributes) that the
+    // program expects from its terminal. The client's terminal never
+    // sees the queries, so they're answered here.
+    std::function<void(std::string_view)> reply;
+
+private:
+    struct Attr {
+        uint8_t flags = 0;
+        // -1 is the default colour, 0-255 the palette, and with
+        // true_colour set, 24 bit RGB.
+        int32_t fg = -1;
+        int32_t bg = -1;
+        bool operator==(const Attr&) const = default;
+    };
+    struct Cell {
+        // UTF-8, one character per cell.
+        char ch[4] = { ' ' };
+        uint8_t len = 1;
+        Attr attr;
+        bool operator==(const Cell& o) const
+        {
+            return len == o.len && attr == o.attr
+                   && std::string_view(ch, len) == std::string_view(o.ch, o.len);
+        }
+    };
+    struct Cursor {
+        int row = 0;
+        int col = 0;
+        Attr pen;
+    };
+    enum class State { ground, esc, esc_skip, csi, osc, str };
+
+    Cell& at(int row, int col) { return cells_[row * cols_ + col]; }
+    const Cell& at(int row, int col) const { return cells_[row * cols_ + col]; }
+    Cell blank() const;
+
+    void byte(char ch);
+    void control(char ch);
+    void escape(char ch);
+    void csi(char final);
+    void sgr();
+    void mode(bool on);
+    void print(std::string_view ch);
+
+    void move_to(int row, int col);
+    void linefeed();
+    void reverse_index();
+    void scroll_up(int top, int bottom, int n);
+    void scroll_down(int top, int bottom, int n);
+    void erase(int row, int from, int to);
+    void reset();
+
+    int param(size_t n, int def) const;
+
+    // Append cells [from, to) of a row, changing attributes from pen as
+    // needed.
+    void render_cells(std::string& out, int row, int from, int to, Attr& pen) const;
+    static void render_attr(std::string& out, const Attr& attr);
+
+    uint16_t rows_;
+    uint16_t cols_;
+    std::vector<Cell> cells_;
+
+    // The main screen, while the alternate screen is in use.
+    std::vector<Cell> main_cells_;
+    bool alt_ = false;
+
+    Cursor cur_;
+    Cursor saved_;
+    bool wrap_pending_ = false;
+    bool autowrap_ = true;
+    bool cursor_visible_ = true;
+    int scroll_top_ = 0;
+    int scroll_bottom_;
+
+    // Bells rung so far, to pass on in the next diff.
+    uint64_t bells_ = 0;
+
+    // Parser.
+    State state_ = State::ground;
+    std::vector<int> params_;
+    char private_ = 0;
+    char intermediate_ = 0;
+    std::string utf8_;
+    size_t utf8_need_ = 0;
+};
+
+// The output of a program towards one client, as screen updates.
+// Shared between the stream that sends it (through ScreenBuffer) and
+// whoever paces the frames.
+class ScreenFeed
+{
+public:
+    ScreenFeed(uint16_t rows = 24, uint16_t cols = 80);
+
+    Screen& screen() { return screen_; }
+
+    // Program output. Calls on_dirty when the screen first changes
+    // after a frame.
+    void write(std::string_view sv);
+    std::function<void()> on_dirty;
+
+    // Turn changes into output for the client. Returns false, doing
+    // nothing, while the last frame is still being sent.
+    bool render();
+    bool dirty() const { return dirty_; }
+
+    // Make the next frame a full redraw, dropping any unsent output. For
+    // a new client, or after a resize.
+    void redraw();
+
+    std::string_view peek() const { return out_; }
+    void ack(size_t n);
+
+private:
+    Screen screen_;
+    Screen shown_;
+    std::string out_;
+    bool dirty_ = false;
+    bool full_ = true;
+};
+
+class ScreenBuffer final : public Buffer
+{
+public:
+    explicit ScreenBuffer(std::shared_ptr<ScreenFeed> feed) : feed_(std::move(feed)) {}
+
+    void write(std::string_view sv) override { feed_->write(sv); }
+    std::string_view peek() const override { return feed_->peek(); }
+    void ack(size_t n) override { feed_->ack(n); }
+
+    // The whole screen, including its size, so that a new process can
+    // rebuild it. Unsent output isn't needed, since the client gets a
+    // full redraw after restore().
+    std::string_view partial() const override;
+    void restore(std::string_view output, std::string_view partial) override;
+
+private:
+    std::shared_ptr<ScreenFeed> feed_;
+    mutable std::string partial_;
+};
+#endif
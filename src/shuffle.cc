@@ -14,59 +14,126 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 #include "shuffle.h"
+#include "log.h"
 
 #include <fcntl.h>
+#include <cstring>
 #include <system_error>
 #include <unistd.h>
 #include <cstdio>
 #include <iostream>
 #include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <optional>
 #include <stdexcept>
-#include <sys/select.h>
+#include <sys/ioctl.h>
 
 namespace {
-bool set_nonblock(int fd)
+// Set O_NONBLOCK, returning the old flags, or -1 on error.
+int set_nonblock(int fd)
 {
     const int flags = fcntl(fd, F_GETFL, 0);
     if (flags < 0) {
-        perror("fcntl(F_GETFL)");
-        return false;
+        LOG(error) << "fcntl(F_GETFL): " << strerror(errno);
+        return -1;
     }
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
-        perror("fcntl(F_SETFL)");
-        return false;
+    if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+        LOG(error) << "fcntl(F_SETFL): " << strerror(errno);
+        return -1;
     }
-    return true;
+    return flags;
 }
 
-std::string do_read(int fd)
+shuffle_detail::IoResult io_result(ssize_t rc)
 {
-    constexpr size_t read_size = 64 * 1024;
-    std::vector<char> ret(read_size);
-    const auto s = read(fd, ret.data(), ret.size());
-    if (s < 0) {
-        throw std::system_error(errno, std::generic_category(), "read()");
+    shuffle_detail::IoResult ret;
+    if (rc >= 0) {
+        ret.n = rc;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        ret.again = true;
+    } else {
+        ret.err = std::error_code(errno, std::generic_category());
     }
-    ret.resize(s);
-    return { ret.begin(), ret.end() };
+    return ret;
 }
+} // namespace
 
-size_t do_write(int fd, const std::string_view data)
+const char* close_reason_name(CloseReason r)
 {
-    const auto rc = write(fd, data.data(), data.size());
-    if (rc < 0) {
-        throw std::system_error(errno, std::generic_category(), "write()");
+    switch (r) {
+    case CloseReason::eof:
+        return "eof";
+    case CloseReason::read_error:
+        return "read_error";
+    case CloseReason::write_error:
+        return "write_error";
+    case CloseReason::fd_error:
+        return "fd_error";
+    case CloseReason::exception:
+        return "exception";
+    case CloseReason::removed:
+        return "removed";
     }
-    return rc;
+    return "unknown";
 }
-} // namespace
 
-void Shuffler::copy(int src, int dst, std::unique_ptr<Buffer>&& buf, int esc)
+namespace shuffle_detail {
+IoResult read_some(int fd, char* buf, size_t n) { return io_result(::read(fd, buf, n)); }
+
+IoResult write_some(int fd, const std::string_view data)
+{
+    // Another stream to the same fd may have filled it first.
+    return io_result(::write(fd, data.data(), data.size()));
+}
+} // namespace shuffle_detail
+
+void Shuffler::copy(
+    int src, int dst, std::unique_ptr<Buffer>&& buf, int esc, const StreamOptions& opts)
 {
     if (!buf) {
-        buf = std::make_unique<RawBuffer>();
+        copy(src, dst, RawBuffer(), esc, opts);
+        return;
+    }
+    copy(src, dst, shuffle_detail::DynamicBuffer(std::move(buf)), esc, opts);
+}
+
+void Shuffler::add(std::unique_ptr<Stream>&& s)
+{
+    const int src = s->src();
+    const int dst = s->dst();
+    const auto h = streams_.insert(std::move(s));
+    stream(h)->handle = h;
+    stream(h)->stats = &stats_;
+    for (const int fd : { src, dst }) {
+        if (fd >= static_cast<int>(by_fd_.size())) {
+            by_fd_.resize(fd + 1);
+        }
+        if (fd == dst && src == dst) {
+            break;
+        }
+        by_fd_[fd].push_back(h);
+    }
+    if (running_) {
+        track_fd(src);
+        track_fd(dst);
     }
-    streams_.emplace_back(src, dst, std::move(buf), esc);
+}
+
+Shuffler::Stream* Shuffler::stream(shuffle_detail::SlotHandle h)
+{
+    const auto p = streams_.get(h);
+    return p ? p->get() : nullptr;
+}
+
+const std::vector<shuffle_detail::SlotHandle>& Shuffler::streams_on(int fd) const
+{
+    static const std::vector<shuffle_detail::SlotHandle> none;
+    if (fd < 0 || fd >= static_cast<int>(by_fd_.size())) {
+        return none;
+    }
+    return by_fd_[fd];
 }
 
 void Shuffler::watch(int fd, Shuffler::watch_handler_t cb)
@@ -74,106 +141,591 @@ void Shuffler::watch(int fd, Shuffler::watch_handler_t cb)
     watchers_.emplace_back(Watcher{ .fd = fd, .cb = cb });
 }
 
+void Shuffler::unwatch(int fd)
+{
+    watchers_.erase(std::remove_if(watchers_.begin(),
+                                   watchers_.end(),
+                                   [fd](const Watcher& w) { return w.fd == fd; }),
+                    watchers_.end());
+}
+
+void Shuffler::remove(int fd)
+{
+    for (const auto h : streams_on(fd)) {
+        stream(h)->fail(CloseReason::removed, fd, {});
+        doomed_.push_back(h);
+    }
+}
+
+void Shuffler::track_fd(int fd)
+{
+    if (saved_flags_.count(fd)) {
+        return;
+    }
+    const auto flags = set_nonblock(fd);
+    if (flags >= 0) {
+        saved_flags_[fd] = flags;
+    }
+}
+
+void Shuffler::restore_flags()
+{
+    for (const auto& [fd, flags] : saved_flags_) {
+        if (!(flags & O_NONBLOCK)) {
+            fcntl(fd, F_SETFL, flags);
+        }
+    }
+    saved_flags_.clear();
+}
+
+void Shuffler::release_fd(int fd)
+{
+    if (!streams_on(fd).empty()) {
+        return;
+    }
+    const auto it = saved_flags_.find(fd);
+    if (it == saved_flags_.end()) {
+        return;
+    }
+    if (!(it->second & O_NONBLOCK)) {
+        fcntl(fd, F_SETFL, it->second);
+    }
+    saved_flags_.erase(it);
+}
+
+void Shuffler::poll_for(int fd, short events)
+{
+    if (fd >= static_cast<int>(pfd_index_.size())) {
+        pfd_index_.resize(fd + 1, -1);
+    }
+    auto& idx = pfd_index_[fd];
+    if (idx < 0) {
+        idx = pfds_.size();
+        pfds_.push_back(pollfd{ .fd = fd, .events = 0, .revents = 0 });
+    }
+    pfds_[idx].events |= events;
+}
+
+bool Shuffler::ready(int fd, short events) const
+{
+    if (fd < 0 || fd >= static_cast<int>(pfd_index_.size()) || pfd_index_[fd] < 0) {
+        return false;
+    }
+    const auto& p = pfds_[pfd_index_[fd]];
+    return (p.events & events) && (p.revents & (events | POLLHUP | POLLERR));
+}
+
+void Shuffler::when_readable(int fd, std::function<void()> cb)
+{
+    read_waits_.push_back(Wait{ fd, std::move(cb) });
+}
+
+void Shuffler::when_writable(int fd, std::function<void()> cb)
+{
+    write_waits_.push_back(Wait{ fd, std::move(cb) });
+}
+
+void Shuffler::at(clock::time_point when, std::function<void()> cb)
+{
+    timers_.push_back(Timer{ when, std::move(cb) });
+    std::push_heap(timers_.begin(), timers_.end());
+}
+
+void Shuffler::take_ready(std::vector<Wait>& waits, short events)
+{
+    for (size_t i = 0; i < waits.size();) {
+        if (ready(waits[i].fd, events)) {
+            fired_.push_back(std::move(waits[i].cb));
+            waits[i] = std::move(waits.back());
+            waits.pop_back();
+            continue;
+        }
+        i++;
+    }
+}
+
+// Call what's due. Everything is taken off the lists first, since the
+// callbacks may add new waits.
+void Shuffler::fire()
+{
+    const auto now = clock::now();
+    while (!timers_.empty() && timers_.front().when <= now) {
+        std::pop_heap(timers_.begin(), timers_.end());
+        fired_.push_back(std::move(timers_.back().cb));
+        timers_.pop_back();
+    }
+    for (auto& cb : fired_) {
+        cb();
+    }
+    fired_.clear();
+}
+
+void Shuffler::write_ready()
+{
+    const auto now = TokenBucket::clock::now();
+    // Streams only compete with others writing to the same fd, so
+    // schedule each writable fd on its own.
+    for (const auto& p : pfds_) {
+        if (!ready(p.fd, POLLOUT)) {
+            continue;
+        }
+        ready_.clear();
+        for (const auto h : streams_on(p.fd)) {
+            const auto s = stream(h);
+            if (s->dst() == p.fd && !s->empty()) {
+                ready_.push_back(s);
+            }
+        }
+
+        // Interactive first. Rotate the bulk streams so that no stream
+        // always gets to fill the link first. Like std::stable_partition,
+        // but without allocating a temporary buffer every round.
+        auto bulk = ready_.begin();
+        ready_bulk_.clear();
+        for (const auto s : ready_) {
+            if (s->interactive()) {
+                *bulk++ = s;
+            } else {
+                ready_bulk_.push_back(s);
+            }
+        }
+        std::copy(ready_bulk_.begin(), ready_bulk_.end(), bulk);
+        if (const auto nbulk = ready_.end() - bulk; nbulk > 1) {
+            std::rotate(bulk, bulk + (rr_++ % nbulk), ready_.end());
+        }
+
+        // Only share out the link if there's someone to share it with.
+        const bool contended = ready_.size() > 1;
+        for (auto it = ready_.begin(); it != ready_.end(); ++it) {
+            auto& s = **it;
+            auto limit = s.bucket().available(now);
+            const bool is_bulk = contended && it >= bulk;
+            if (is_bulk) {
+                s.deficit = std::min(s.deficit + shuffle_detail::bulk_quantum,
+                                     shuffle_detail::bulk_max_deficit);
+                limit = std::min(limit, s.deficit);
+            }
+            if (!limit) {
+                continue;
+            }
+            const auto n = s.write(limit);
+            s.bucket().consume(n);
+            if (is_bulk) {
+                s.deficit = s.empty() ? 0 : s.deficit - n;
+            }
+            if (s.failed() || (s.eof() && s.empty())) {
+                doomed_.push_back(s.handle);
+            }
+        }
+    }
+}
+
+size_t Shuffler::cut_limit(Stream& s)
+{
+    if (!s.cut_through() || !s.empty()) {
+        return 0;
+    }
+    for (const auto h : streams_on(s.dst())) {
+        const auto o = stream(h);
+        if (o && o != &s && o->dst() == s.dst() && !o->empty()) {
+            return 0;
+        }
+    }
+    return s.bucket().available(TokenBucket::clock::now());
+}
+
+std::vector<Shuffler::StreamState> Shuffler::snapshot() const
+{
+    std::vector<StreamState> ret;
+    for (const auto& s : streams_) {
+        ret.push_back(s->state());
+    }
+    return ret;
+}
+
+void Shuffler::remove_failed()
+{
+    if (doomed_.empty()) {
+        return;
+    }
+
+    // Streams on an fd that failed can't carry on either. The list grows
+    // as they're added.
+    for (size_t i = 0; i < doomed_.size(); i++) {
+        const auto s = stream(doomed_[i]);
+        if (!s || !s->failed() || s->failed_fd() < 0) {
+            continue;
+        }
+        const int fd = s->failed_fd();
+        const auto err = s->error();
+        for (const auto h : streams_on(fd)) {
+            const auto o = stream(h);
+            if (!o->failed()) {
+                o->fail(CloseReason::fd_error, fd, err);
+                doomed_.push_back(h);
+            }
+        }
+    }
+
+    // Callbacks may add streams, or doom more, so work on a copy.
+    auto doomed = std::move(doomed_);
+    doomed_.clear();
+    for (const auto h : doomed) {
+        const auto p = stream(h);
+        if (!p) {
+            // Listed twice.
+            continue;
+        }
+        if (!p->failed() && !(p->eof() && p->empty())) {
+            // EOF with data still to write.
+            continue;
+        }
+        for (const int fd : { p->src(), p->dst() }) {
+            auto& on = by_fd_[fd];
+            on.erase(std::find(on.begin(), on.end(), h));
+            if (p->src() == p->dst()) {
+                break;
+            }
+        }
+        const auto s = streams_.erase(h);
+        release_fd(s->src());
+        release_fd(s->dst());
+        if (s->failed()) {
+            s->closed(s->close_reason(), s->error());
+        } else {
+            s->closed(CloseReason::eof, {});
+        }
+    }
+}
+
 void Shuffler::run()
 {
-    // Set nonblock.
+    bthelper::alloc::Scope scope(bthelper::alloc::Tag::loop);
+    stop_ = false;
+
+    // Set nonblock, for the duration of the run.
+    struct Running {
+        Shuffler* shuf;
+        ~Running()
+        {
+            shuf->restore_flags();
+            shuf->running_ = false;
+        }
+    } running{ this };
+    running_ = true;
     for (const auto& s : streams_) {
-        set_nonblock(s.src());
+        track_fd(s->src());
+        track_fd(s->dst());
     }
 
     // Event loop.
     for (;;) {
-        if (streams_.empty()) {
+        remove_failed();
+        if (streams_.empty() && read_waits_.empty() && write_waits_.empty()
+            && timers_.empty() && !persist_) {
             return;
         }
 
-        fd_set rfds;
-        fd_set wfds;
-        fd_set efds;
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        FD_ZERO(&efds);
-        int mx = -1;
-
-        // Add readers & writers.
-        for (const auto& s : streams_) {
-            FD_SET(s.src(), &efds);
-            FD_SET(s.dst(), &efds);
-            mx = std::max({ mx, s.dst(), s.src() });
-            if (s.empty()) {
-                FD_SET(s.src(), &rfds);
-            } else {
-                FD_SET(s.dst(), &wfds);
+        for (const auto& p : pfds_) {
+            pfd_index_[p.fd] = -1;
+        }
+        pfds_.clear();
+
+        // Add readers & writers. Keep reading ahead while a write is
+        // pending, as long as the buffer stays under the watermark.
+        // Rate limited streams instead wake up when they may write.
+        // Exceptional conditions are only watched for on fds polled
+        // anyway, since poll() can't be asked to ignore hangups.
+        const auto now = TokenBucket::clock::now();
+        std::optional<TokenBucket::clock::duration> timeout;
+        for (auto& s : streams_) {
+            s->polled_read = s->want_read();
+            if (s->polled_read) {
+                poll_for(s->src(), POLLIN | POLLPRI);
+            }
+            if (s->empty()) {
+                continue;
+            }
+            if (s->bucket().available(now) >= s->min_write()) {
+                poll_for(s->dst(), POLLOUT | POLLPRI);
+                continue;
             }
+            const auto wait = s->bucket().wait(s->min_write(), now);
+            timeout = std::min(wait, timeout.value_or(wait));
         }
 
-        // Add watchers.
+        // Add watchers and one-shot waits.
         for (const auto& w : watchers_) {
-            mx = std::max(mx, w.fd);
-            FD_SET(w.fd, &rfds);
+            poll_for(w.fd, POLLIN);
+        }
+        for (const auto& w : read_waits_) {
+            poll_for(w.fd, POLLIN);
+        }
+        for (const auto& w : write_waits_) {
+            poll_for(w.fd, POLLOUT);
+        }
+        if (!timers_.empty()) {
+            const auto wait = std::max(timers_.front().when - now, clock::duration{});
+            timeout = std::min(wait, timeout.value_or(wait));
         }
 
-        // select()
-        const auto rc = select(mx + 1, &rfds, &wfds, &efds, NULL);
+        // poll()
+        struct timespec ts {
+        };
+        if (timeout) {
+            const auto ns =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(*timeout).count()
+                + 1000;
+            ts.tv_sec = ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+        }
+        PROBE(loop_sleep,
+              pfds_.size(),
+              timeout ? ts.tv_sec * 1000000 + ts.tv_nsec / 1000 : -1);
+        const auto rc = ppoll(pfds_.data(), pfds_.size(), timeout ? &ts : NULL, NULL);
         if (rc < 0) {
-            throw std::system_error(errno, std::generic_category(), "select()");
+            throw std::system_error(errno, std::generic_category(), "poll()");
+        }
+        PROBE(loop_wakeup, rc);
+        stats_.wakeups++;
+        for (const auto& p : pfds_) {
+            if (p.revents & POLLNVAL) {
+                throw std::system_error(EBADF, std::generic_category(), "poll()");
+            }
         }
 
-        // Check watchers.
+        // Check watchers. They may watch or unwatch fds.
+        ready_fds_.clear();
         for (const auto& w : watchers_) {
-            if (FD_ISSET(w.fd, &rfds)) {
-                w.cb(w.fd);
+            if (ready(w.fd, POLLIN)) {
+                ready_fds_.push_back(w.fd);
             }
         }
+        for (const auto fd : ready_fds_) {
+            const auto w = std::find_if(watchers_.begin(),
+                                        watchers_.end(),
+                                        [fd](const Watcher& w) { return w.fd == fd; });
+            if (w != watchers_.end()) {
+                const auto cb = w->cb;
+                cb(fd);
+            }
+        }
+        take_ready(read_waits_, POLLIN);
+        take_ready(write_waits_, POLLOUT);
+        fire();
+        if (stop_) {
+            return;
+        }
 
         // Check for errors.
-        for (int c = 0; c < streams_.size();) {
-            auto& s = streams_[c];
-            if (FD_ISSET(s.src(), &efds) || FD_ISSET(s.dst(), &efds)) {
-                streams_.erase(streams_.begin() + c);
+        for (const auto& p : pfds_) {
+            if (!(p.revents & POLLPRI)) {
                 continue;
             }
-            c++;
-        }
-
-        // Write.
-        for (auto& s : streams_) {
-            if (FD_ISSET(s.dst(), &wfds)) {
-                s.ack(do_write(s.dst(), s.peek()));
+            for (const auto h : streams_on(p.fd)) {
+                if (const auto s = stream(h)) {
+                    s->fail(CloseReason::exception, -1, {});
+                    doomed_.push_back(h);
+                }
             }
         }
+        remove_failed();
 
-        // Read.
-        for (int c = 0; c < streams_.size();) {
-            auto& s = streams_[c];
+        // Write.
+        write_ready();
+        remove_failed();
 
-            if (FD_ISSET(s.src(), &rfds)) {
-                auto buf = do_read(s.src());
-                if (buf.empty()) {
-                    streams_.erase(streams_.begin() + c);
+        // Read. Streams are only marked here, not removed.
+        for (const auto& p : pfds_) {
+            if (!ready(p.fd, POLLIN)) {
+                continue;
+            }
+            for (const auto h : streams_on(p.fd)) {
+                const auto s = stream(h);
+                if (s->src() != p.fd || !s->polled_read || s->failed()) {
                     continue;
                 }
-                s.write(buf);
-                if (s.check_esc()) {
+                switch (s->read(scratch_, cut_limit(*s))) {
+                case Stream::ReadResult::ok:
+                    if (s->cut_written) {
+                        s->bucket().consume(s->cut_written);
+                    }
+                    if (s->failed()) {
+                        doomed_.push_back(h);
+                    }
+                    break;
+                case Stream::ReadResult::error:
+                    doomed_.push_back(h);
+                    break;
+                case Stream::ReadResult::eof:
+                    // Dropped once everything it read has been written.
+                    s->set_eof();
+                    doomed_.push_back(h);
+                    break;
+                case Stream::ReadResult::escape:
                     return;
                 }
             }
-            c++;
         }
+        remove_failed();
+    }
+}
+
+Shuffler::Stream::Stream(int src, int dst, int esc, const StreamOptions& opts)
+    : src_(src), dst_(dst), esc_(esc), opts_(opts), bucket_(opts.rate, opts.rate_burst)
+{
+    if (opts.low_watermark > opts.high_watermark) {
+        throw std::invalid_argument("Shuffler::copy(): low watermark above high");
+    }
+    if (opts.io_unit == 0 || opts.read_size == 0) {
+        throw std::invalid_argument("Shuffler::copy(): zero io_unit or read_size");
+    }
+}
+
+namespace {
+// Round n down to a multiple of unit, unless that would make it zero.
+size_t round_down(size_t n, size_t unit)
+{
+    if (n < unit) {
+        return n;
+    }
+    return n - n % unit;
+}
+} // namespace
+
+size_t Shuffler::Stream::write_size(size_t avail) const
+{
+    if (!opts_.write_size || avail <= opts_.write_size) {
+        return avail;
+    }
+    return round_down(opts_.write_size, opts_.io_unit);
+}
+
+size_t Shuffler::Stream::read_size() const
+{
+    if (!opts_.adaptive_read) {
+        return opts_.read_size;
+    }
+    int avail = 0;
+    if (ioctl(src_, FIONREAD, &avail)) {
+        // Not supported for this fd type.
+        return opts_.read_size;
+    }
+    if (avail <= 0) {
+        // EOF or error pending. A single unit is enough to find out.
+        return std::min(opts_.io_unit, opts_.read_size);
+    }
+    // Round up to whole units, so that a trailing partial unit doesn't
+    // need a separate wakeup.
+    const size_t want = (avail + opts_.io_unit - 1) / opts_.io_unit * opts_.io_unit;
+    return std::min(want, opts_.read_size);
+}
+
+bool Shuffler::Stream::want_read()
+{
+    if (eof_) {
+        return false;
+    }
+    const auto buffered = this->buffered();
+    if (reading_ && buffered >= opts_.high_watermark) {
+        reading_ = false;
+    } else if (!reading_ && buffered <= opts_.low_watermark) {
+        reading_ = true;
+    }
+    return reading_;
+}
+
+bool Shuffler::Stream::interactive() const
+{
+    switch (opts_.latency) {
+    case LatencyClass::interactive:
+        return true;
+    case LatencyClass::bulk:
+        return false;
+    case LatencyClass::automatic:
+        break;
+    }
+    return buffered() <= shuffle_detail::interactive_max;
+}
+
+size_t Shuffler::Stream::min_write() const
+{
+    // Don't wake up more than about 100 times per second per stream,
+    // but never ask for more than the bucket can hold, or it's never
+    // writable.
+    auto granule = std::max(opts_.io_unit, static_cast<size_t>(opts_.rate / 100));
+    if (bucket_.limited()) {
+        granule = std::min(granule, bucket_.burst());
+    }
+    return std::min(buffered(), granule);
+}
+
+TokenBucket::TokenBucket(double rate, size_t burst)
+    : rate_(rate), burst_(burst), tokens_(burst), last_(clock::now())
+{
+}
+
+void TokenBucket::refill(clock::time_point now)
+{
+    const std::chrono::duration<double> dt = now - last_;
+    tokens_ = std::min(burst_, tokens_ + dt.count() * rate_);
+    last_ = now;
+}
+
+size_t TokenBucket::available(clock::time_point now)
+{
+    if (!limited()) {
+        return SIZE_MAX;
+    }
+    refill(now);
+    return static_cast<size_t>(tokens_);
+}
+
+void TokenBucket::consume(size_t n)
+{
+    if (limited()) {
+        tokens_ -= n;
     }
 }
 
-Shuffler::Stream::Stream(int src, int dst, std::unique_ptr<Buffer>&& buf, int esc)
-    : src_(src), dst_(dst), buf_(std::move(buf)), esc_(esc)
+TokenBucket::clock::duration TokenBucket::wait(size_t n, clock::time_point now)
 {
+    if (!limited()) {
+        return {};
+    }
+    refill(now);
+    // Never wait for more than a full bucket.
+    const double want = std::min(static_cast<double>(n), burst_);
+    if (tokens_ >= want) {
+        return {};
+    }
+    return std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>((want - tokens_) / rate_));
+}
+
+void Shuffler::Stream::fail(CloseReason why, int fd, std::error_code err)
+{
+    if (failed()) {
+        return;
+    }
+    failed_ = true;
+    close_reason_ = why;
+    failed_fd_ = fd;
+    error_ = err;
+}
+
+void Shuffler::Stream::closed(CloseReason why, std::error_code err) const
+{
+    if (opts_.on_close) {
+        opts_.on_close(why, err);
+    }
 }
 
-bool Shuffler::Stream::check_esc()
+bool Shuffler::Stream::check_esc(std::string_view b) const
 {
     if (esc_ < 0) {
         return false;
     }
-    auto b = buf_->peek();
     return std::find(b.begin(), b.end(), esc_) != b.end();
 }
 
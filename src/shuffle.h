@@ -13,38 +13,421 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#ifndef __INCLUDE_SHUFFLE_H__
+#define __INCLUDE_SHUFFLE_H__
+#include "alloc.h"
 #include "buffer.h"
+#include "slotmap.h"
+#include "trace.h"
+#include <poll.h>
+#include <chrono>
 #include <functional>
+#include <map>
 #include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
 #include <vector>
+
+// Scheduling class of a stream. Interactive streams are written before
+// bulk streams.
+enum class LatencyClass {
+    // Interactive while little data is queued, else bulk.
+    automatic,
+    interactive,
+    bulk,
+};
+
+// Why a stream was removed from its Shuffler.
+enum class CloseReason {
+    // src hit EOF, and everything read from it has been written.
+    eof,
+    // read() from src failed.
+    read_error,
+    // write() to dst failed.
+    write_error,
+    // Another stream failed on an fd this one uses.
+    fd_error,
+    // select() reported an exceptional condition on src or dst.
+    exception,
+    // Removed with Shuffler::remove().
+    removed,
+};
+
+const char* close_reason_name(CloseReason);
+
+// Per-stream tuning knobs.
+struct StreamOptions {
+    // Stop reading from src once this much data is buffered for dst...
+    size_t high_watermark = 128 * 1024;
+
+    // ... and resume once the buffer drains below this.
+    size_t low_watermark = 32 * 1024;
+
+    // Largest single read() from src.
+    size_t read_size = 64 * 1024;
+
+    // Largest single write() to dst. 0 means no limit.
+    size_t write_size = 0;
+
+    // Reads and writes are sized in multiples of this, where possible.
+    // Typically the link MTU.
+    size_t io_unit = 1;
+
+    // Use FIONREAD to only read what's available, instead of always
+    // asking for read_size bytes.
+    bool adaptive_read = false;
+
+    // Called with every chunk read from src, before it's written to the
+    // buffer. This and on_close stay std::function even in specialized
+    // streams: they run at most once per read, not per byte.
+    std::function<void(std::string_view)> on_read;
+
+    // If nothing is buffered ahead of it, write what was read to dst
+    // right away, instead of after the next poll() says dst is
+    // writable. Only what doesn't fit is buffered.
+    bool cut_through = true;
+
+    // Limit writes to dst to this many bytes per second, allowing bursts
+    // of rate_burst bytes. 0 means unlimited.
+    double rate = 0;
+    size_t rate_burst = 16 * 1024;
+
+    LatencyClass latency = LatencyClass::automatic;
+
+    // Called when the stream is removed, with the error if any. May add
+    // streams, or remove() fds.
+    std::function<void(CloseReason, std::error_code)> on_close;
+};
+
+class TokenBucket
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // 0 rate means unlimited.
+    TokenBucket(double rate = 0, size_t burst = 0);
+
+    bool limited() const { return rate_ > 0; }
+    size_t burst() const { return static_cast<size_t>(burst_); }
+
+    // Bytes that may be sent now.
+    size_t available(clock::time_point now);
+    void consume(size_t n);
+
+    // Time until n bytes may be sent.
+    clock::duration wait(size_t n, clock::time_point now);
+
+private:
+    void refill(clock::time_point now);
+
+    double rate_;
+    double burst_;
+    double tokens_;
+    clock::time_point last_;
+};
+
+namespace shuffle_detail {
+// Outcome of one read() or write(). A call that would block or was
+// interrupted is not an error, it just transferred nothing.
+struct IoResult {
+    size_t n = 0;
+    std::error_code err;
+    bool again = false;
+
+    bool ok() const { return !err; }
+};
+
+// Plain read()/write(). Zero bytes read with no error or again is EOF.
+IoResult read_some(int fd, char* buf, size_t n);
+IoResult write_some(int fd, std::string_view data);
+
+// Size of buffer at or below which an automatic-class stream counts as
+// interactive.
+constexpr size_t interactive_max = 512;
+
+// Bulk streams are served deficit round robin, with this quantum.
+constexpr size_t bulk_quantum = 4096;
+constexpr size_t bulk_max_deficit = 4 * bulk_quantum;
+
+// Lets a runtime-polymorphic Buffer be used as a stream buffer policy.
+class DynamicBuffer
+{
+public:
+    explicit DynamicBuffer(std::unique_ptr<Buffer>&& buf) : buf_(std::move(buf)) {}
+    void write(std::string_view sv) { buf_->write(sv); }
+    std::string_view peek() const { return buf_->peek(); }
+    void ack(size_t n) { buf_->ack(n); }
+    std::string_view partial() const { return buf_->partial(); }
+
+private:
+    std::unique_ptr<Buffer> buf_;
+};
+} // namespace shuffle_detail
+
 class Shuffler
 {
 public:
     using watch_handler_t = std::function<void(int)>;
+    using clock = TokenBucket::clock;
+
+    // What a stream has buffered. See Buffer::partial().
+    struct StreamState {
+        int src;
+        int dst;
+        std::string output;
+        std::string partial;
+    };
+
+    // Copy using a runtime-polymorphic buffer. Defaults to RawBuffer.
+    void copy(int src,
+              int dst,
+              std::unique_ptr<Buffer>&& buf = nullptr,
+              int escape = -1,
+              const StreamOptions& opts = {});
+
+    // Copy using a buffer of known type. The whole read->buffer->write
+    // path is compiled for that type, with no virtual calls per buffer
+    // operation. Buf needs write(), peek(), ack() and partial() like
+    // Buffer.
+    template <typename Buf>
+    std::enable_if_t<!std::is_convertible_v<Buf, std::unique_ptr<Buffer>>>
+    copy(int src, int dst, Buf&& buf, int escape = -1, const StreamOptions& opts = {})
+    {
+        add(std::make_unique<BasicStream<std::decay_t<Buf>>>(
+            src, dst, std::forward<Buf>(buf), escape, opts));
+    }
 
-    void copy(int src, int dst, std::unique_ptr<Buffer>&& buf = nullptr, int escape = -1);
     void watch(int fd, watch_handler_t);
+    void unwatch(int fd);
+
+    // Remove all streams reading from or writing to fd, before the next
+    // wait. Safe to call from callbacks.
+    void remove(int fd);
+
+    // Keep run() going even with no streams or waits, until stop().
+    void persist(bool on) { persist_ = on; }
+
+    // One-shot waits, e.g. for coroutines. cb is called once from run(),
+    // when fd is readable or writable, or the time has come. run() keeps
+    // going while any are pending. Callbacks that fit in std::function's
+    // small buffer (e.g. a coroutine handle) don't allocate.
+    void when_readable(int fd, std::function<void()> cb);
+    void when_writable(int fd, std::function<void()> cb);
+    void at(clock::time_point when, std::function<void()> cb);
+
     void run();
 
+    // Make run() return after the current wakeup, before any more I/O.
+    // Can be called from watchers. run() can be called again to resume.
+    void stop() { stop_ = true; }
+
+    // Buffered state of all streams, e.g. for handing them over to
+    // another process after stop().
+    std::vector<StreamState> snapshot() const;
+
+    // Counts since construction, e.g. for benchmarks.
+    struct Stats {
+        uint64_t wakeups = 0; // poll() returns.
+        uint64_t reads = 0;   // read() calls.
+        uint64_t writes = 0;  // write() calls, of which...
+        uint64_t cut_through = 0; // ... made right after a read.
+    };
+    const Stats& stats() const { return stats_; }
+
 private:
+    // Buffer-independent parts of a stream.
     class Stream
     {
     public:
-        Stream(int src, int dst, std::unique_ptr<Buffer>&& buf, int esc);
+        enum class ReadResult { ok, eof, escape, error };
+
+        Stream(int src, int dst, int esc, const StreamOptions& opts);
+        virtual ~Stream() = default;
+        Stream(const Stream&) = delete;
+        Stream& operator=(const Stream&) = delete;
+
         int src() const { return src_; }
         int dst() const { return dst_; };
-        bool empty() const { return buf_->peek().empty(); }
-        std::string_view peek() const { return buf_->peek(); }
-        void write(std::string_view v) { buf_->write(v); }
-        void ack(size_t n) { buf_->ack(n); }
-        bool check_esc();
+        bool empty() const { return buffered() == 0; }
+        void set_eof() { eof_ = true; }
+        bool eof() const { return eof_; }
+
+        // Mark the stream as failed because of fd (or -1), to be removed.
+        void fail(CloseReason why, int fd, std::error_code err);
+        bool failed() const { return failed_; }
+        int failed_fd() const { return failed_fd_; }
+        std::error_code error() const { return error_; }
+        CloseReason close_reason() const { return close_reason_; }
+
+        // Report removal to the on_close callback, if any.
+        void closed(CloseReason why, std::error_code err) const;
+
+        // Whether src should be polled for reading. Updates the
+        // watermark hysteresis state.
+        bool want_read();
+
+        // Read from src into the buffer, using scratch as read buffer.
+        // If cut is non-zero, write up to that much of it to dst
+        // straight away, which is only right if the buffer was empty.
+        // On error, the stream is marked failed.
+        virtual ReadResult read(std::vector<char>& scratch, size_t cut) = 0;
+
+        // Write at most limit bytes of the buffer to dst. Returns bytes
+        // written. On error, the stream is marked failed.
+        virtual size_t write(size_t limit) = 0;
+
+        virtual size_t buffered() const = 0;
+        virtual StreamState state() const = 0;
+
+        bool interactive() const;
+        bool cut_through() const { return opts_.cut_through; }
+        TokenBucket& bucket() { return bucket_; }
+
+        // DRR deficit, for bulk scheduling.
+        size_t deficit = 0;
+
+        // Registry handle, and whether src was polled for reading this
+        // round.
+        shuffle_detail::SlotHandle handle;
+        bool polled_read = false;
+
+        // Shuffler's counters.
+        Stats* stats = nullptr;
+
+        // Bytes written by the last read(), with cut-through.
+        size_t cut_written = 0;
+
+        // Smallest write worth waking up for when rate limited.
+        size_t min_write() const;
+
+    protected:
+        // Largest chunk to write, of avail buffered bytes.
+        size_t write_size(size_t avail) const;
+
+        // How much to ask for in the next read().
+        size_t read_size() const;
+
+        bool check_esc(std::string_view b) const;
 
-    private:
         // fds unowned.
         int src_ = -1;
         int dst_ = -1;
-        std::unique_ptr<Buffer> buf_;
         int esc_;
+        StreamOptions opts_;
+        bool reading_ = true;
+        bool eof_ = false;
+        TokenBucket bucket_;
+        CloseReason close_reason_ = CloseReason::eof;
+        bool failed_ = false;
+        int failed_fd_ = -1;
+        std::error_code error_;
+    };
+
+    template <typename Buf>
+    class BasicStream final : public Stream
+    {
+    public:
+        BasicStream(int src, int dst, Buf&& buf, int esc, const StreamOptions& opts)
+            : Stream(src, dst, esc, opts), buf_(std::move(buf))
+        {
+        }
+
+        ReadResult read(std::vector<char>& scratch, size_t cut) override
+        {
+            bthelper::alloc::Scope scope(bthelper::alloc::Tag::read);
+            cut_written = 0;
+            const auto want = read_size();
+            if (scratch.size() < want) {
+                scratch.resize(want);
+            }
+            stats->reads++;
+            const auto r = shuffle_detail::read_some(src_, scratch.data(), want);
+            if (!r.ok()) {
+                fail(CloseReason::read_error, src_, r.err);
+                return ReadResult::error;
+            }
+            if (r.again) {
+                return ReadResult::ok;
+            }
+            PROBE(stream_read, src_, dst_, r.n);
+            if (!r.n) {
+                return ReadResult::eof;
+            }
+            const std::string_view data(scratch.data(), r.n);
+            if (check_esc(data)) {
+                return ReadResult::escape;
+            }
+            if (opts_.on_read) {
+                opts_.on_read(data);
+            }
+            if (!cut) {
+                bthelper::alloc::Scope buffer_scope(bthelper::alloc::Tag::buffer);
+                buf_.write(data);
+                return ReadResult::ok;
+            }
+            if constexpr (std::is_same_v<Buf, RawBuffer>) {
+                // Nothing to transform, so only the rest is copied.
+                stats->cut_through++;
+                cut_written = write_data(data, cut);
+                if (!failed_) {
+                    PROBE(buffer_ack, src_, dst_, cut_written, data.size() - cut_written);
+                    bthelper::alloc::Scope buffer_scope(bthelper::alloc::Tag::buffer);
+                    buf_.write(data.substr(cut_written));
+                }
+            } else {
+                {
+                    bthelper::alloc::Scope buffer_scope(bthelper::alloc::Tag::buffer);
+                    buf_.write(data);
+                }
+                // E.g. only a control message, with no output.
+                if (!buf_.peek().empty()) {
+                    stats->cut_through++;
+                    cut_written = write(cut);
+                }
+            }
+            return ReadResult::ok;
+        }
+
+        size_t write(size_t limit) override
+        {
+            bthelper::alloc::Scope scope(bthelper::alloc::Tag::write);
+            const auto data = buf_.peek();
+            const auto n = write_data(data, limit);
+            if (failed_) {
+                return 0;
+            }
+            buf_.ack(n);
+            PROBE(buffer_ack, src_, dst_, n, data.size() - n);
+            return n;
+        }
+
+        size_t buffered() const override { return buf_.peek().size(); }
+
+        StreamState state() const override
+        {
+            return { src_, dst_, std::string(buf_.peek()), std::string(buf_.partial()) };
+        }
+
+    private:
+        // Write at most limit bytes of data to dst.
+        size_t write_data(std::string_view data, size_t limit)
+        {
+            const auto want = std::min(limit, write_size(data.size()));
+            stats->writes++;
+            const auto r = shuffle_detail::write_some(dst_, data.substr(0, want));
+            if (!r.ok()) {
+                fail(CloseReason::write_error, dst_, r.err);
+                return 0;
+            }
+            PROBE(stream_write, src_, dst_, r.n, want);
+            if (r.n < want) {
+                PROBE(short_write, src_, dst_, r.n, want);
+            }
+            return r.n;
+        }
+
+        Buf buf_;
     };
 
     struct Watcher {
@@ -52,6 +435,82 @@ private:
         watch_handler_t cb;
     };
 
-    std::vector<Stream> streams_;
+    struct Wait {
+        int fd;
+        std::function<void()> cb;
+    };
+
+    struct Timer {
+        clock::time_point when;
+        std::function<void()> cb;
+
+        // For a min-heap.
+        bool operator<(const Timer& o) const { return when > o.when; }
+    };
+
+    void add(std::unique_ptr<Stream>&& s);
+    Stream* stream(shuffle_detail::SlotHandle h);
+    const std::vector<shuffle_detail::SlotHandle>& streams_on(int fd) const;
+
+    // Add events to fd's entry in the poll set.
+    void poll_for(int fd, short events);
+
+    // Whether fd was polled for events, and poll() reported them (or a
+    // hangup or error, which the next read or write will find).
+    bool ready(int fd, short events) const;
+
+    // Move waits whose fd is ready to fired_.
+    void take_ready(std::vector<Wait>& waits, short events);
+    void fire();
+
+    // Write phase: serve ready streams, interactive first.
+    void write_ready();
+
+    // How much s may write to dst right after its next read, without
+    // jumping ahead of anything already buffered for dst, or its rate
+    // limit.
+    size_t cut_limit(Stream& s);
+
+    // Remove failed streams, and all other streams on the fds that
+    // failed, and streams done after EOF.
+    void remove_failed();
+
+    // fds are set non-blocking while run() is using them, and their
+    // original flags put back after, since they may be shared with other
+    // processes (e.g. a terminal).
+    void track_fd(int fd);
+    void restore_flags();
+
+    // Put back fd's flags if no stream uses it any more.
+    void release_fd(int fd);
+
+    shuffle_detail::SlotMap<std::unique_ptr<Stream>> streams_;
+
+    // Streams by src and dst fd.
+    std::vector<std::vector<shuffle_detail::SlotHandle>> by_fd_;
+
+    // Streams that have failed or hit EOF, for remove_failed() to look
+    // at.
+    std::vector<shuffle_detail::SlotHandle> doomed_;
+
+    // Poll set, and each fd's index in it, or -1.
+    std::vector<pollfd> pfds_;
+    std::vector<int> pfd_index_;
+
     std::vector<Watcher> watchers_;
+    std::vector<Wait> read_waits_;
+    std::vector<Wait> write_waits_;
+    std::vector<Timer> timers_;
+    std::vector<std::function<void()>> fired_;
+    std::vector<char> scratch_;
+    std::vector<Stream*> ready_;
+    std::vector<Stream*> ready_bulk_;
+    std::vector<int> ready_fds_;
+    Stats stats_;
+    size_t rr_ = 0;
+    bool stop_ = false;
+    bool persist_ = false;
+    bool running_ = false;
+    std::map<int, int> saved_flags_;
 };
+#endif
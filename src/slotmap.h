@@ -0,0 +1,125 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Generational slot map.
+ *
+ * Values live in a dense vector, for cache friendly iteration. A handle
+ * names a slot, which points into the dense vector. Removing swaps the
+ * last value into the hole, and bumps the slot's generation, so that
+ * stale handles no longer find anything. Insert, lookup and removal are
+ * all O(1).
+ *
+ * Iteration order is not insertion order, and removing invalidates
+ * references and iterators into the dense vector.
+ */
+#ifndef __INCLUDE_SLOTMAP_H__
+#define __INCLUDE_SLOTMAP_H__
+
+#include <cstdint>
+#include <vector>
+
+namespace shuffle_detail {
+
+struct SlotHandle {
+    uint32_t index = UINT32_MAX;
+    uint32_t gen = 0;
+
+    bool operator==(const SlotHandle&) const = default;
+};
+
+template <typename T>
+class SlotMap
+{
+public:
+    SlotHandle insert(T&& v)
+    {
+        uint32_t idx;
+        if (free_.empty()) {
+            idx = slots_.size();
+            slots_.emplace_back();
+        } else {
+            idx = free_.back();
+            free_.pop_back();
+        }
+        auto& slot = slots_[idx];
+        slot.dense = values_.size();
+        values_.push_back(std::move(v));
+        owners_.push_back(idx);
+        return { idx, slot.gen };
+    }
+
+    // nullptr if h has been erased.
+    T* get(SlotHandle h)
+    {
+        if (h.index >= slots_.size()) {
+            return nullptr;
+        }
+        const auto& slot = slots_[h.index];
+        if (slot.gen != h.gen || slot.dense == npos) {
+            return nullptr;
+        }
+        return &values_[slot.dense];
+    }
+
+    // Remove and return the value. h must be valid.
+    T erase(SlotHandle h)
+    {
+        auto& slot = slots_[h.index];
+        const auto pos = slot.dense;
+        T ret = std::move(values_[pos]);
+        if (pos != values_.size() - 1) {
+            values_[pos] = std::move(values_.back());
+            owners_[pos] = owners_.back();
+            slots_[owners_[pos]].dense = pos;
+        }
+        values_.pop_back();
+        owners_.pop_back();
+        slot.dense = npos;
+        slot.gen++;
+        free_.push_back(h.index);
+        return ret;
+    }
+
+    // Handle of the value at position pos of the dense vector.
+    SlotHandle handle_at(size_t pos) const
+    {
+        return { owners_[pos], slots_[owners_[pos]].gen };
+    }
+
+    size_t size() const { return values_.size(); }
+    bool empty() const { return values_.empty(); }
+    auto begin() { return values_.begin(); }
+    auto end() { return values_.end(); }
+    auto begin() const { return values_.begin(); }
+    auto end() const { return values_.end(); }
+
+private:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    struct Slot {
+        uint32_t dense = npos;
+        uint32_t gen = 0;
+    };
+
+    std::vector<T> values_;
+    // Slot of each value.
+    std::vector<uint32_t> owners_;
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_;
+};
+
+} // namespace shuffle_detail
+#endif
@@ -0,0 +1,46 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Static tracepoints (USDT).
+ *
+ * With ./configure --enable-usdt, each PROBE() becomes a systemtap/DTrace
+ * style probe in the "bthelper" provider, which is a single NOP until a
+ * tracer such as bpftrace attaches to it. Without it, probes and their
+ * arguments are compiled out. See examples/bpftrace/ for scripts using
+ * them.
+ *
+ * Arguments must be integers or pointers (e.g. a C string), and at most
+ * 12 of them.
+ *
+ * Usage:
+ *   PROBE(stream_read, src, dst, bytes);
+ */
+#ifndef __INCLUDE_TRACE_H__
+#define __INCLUDE_TRACE_H__
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(bthelper, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...)                                                                \
+    do {                                                                                \
+    } while (0)
+#endif
+
+#endif
@@ -0,0 +1,515 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "transfer.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+namespace bthelper {
+
+namespace {
+const std::string magic = "BTXFER1";
+constexpr size_t max_line = 1024;
+
+// Data is moved in chunks this large, to keep the link busy.
+constexpr size_t chunk_size = 256 * 1024;
+
+struct FdCloser {
+    explicit FdCloser(int f) : fd(f) {}
+    int fd;
+    ~FdCloser()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    FdCloser(const FdCloser&) = delete;
+    FdCloser& operator=(const FdCloser&) = delete;
+};
+
+bool write_all(int fd, std::string_view data)
+{
+    while (!data.empty()) {
+        const auto rc = write(fd, data.data(), data.size());
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(error) << "write(): " << strerror(errno);
+            return false;
+        }
+        data.remove_prefix(rc);
+    }
+    return true;
+}
+
+// Control lines are short, and followed by raw data, so read them a
+// byte at a time to not read past the newline.
+bool read_line(int fd, std::string* out)
+{
+    out->clear();
+    for (;;) {
+        char ch;
+        const auto rc = read(fd, &ch, 1);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            LOG(error) << "Connection closed while reading control message";
+            return false;
+        }
+        if (ch == '\n') {
+            return true;
+        }
+        if (out->size() >= max_line) {
+            LOG(error) << "Control message too long";
+            return false;
+        }
+        out->push_back(ch);
+    }
+}
+
+bool send_line(int fd, const std::string& line) { return write_all(fd, line + "\n"); }
+
+// Parse a reply, failing on ERR.
+bool expect(int fd, const std::string& word, std::istringstream* args)
+{
+    std::string line;
+    if (!read_line(fd, &line)) {
+        return false;
+    }
+    args->str(line);
+    args->clear();
+    std::string got;
+    *args >> got;
+    if (got != word) {
+        LOG(error) << "Transfer failed: " << line;
+        return false;
+    }
+    return true;
+}
+
+// Add the first len bytes of a file to the checksum.
+bool checksum_file(int fd, uint64_t len, Adler32* sum)
+{
+    std::vector<char> buf(chunk_size);
+    uint64_t off = 0;
+    while (off < len) {
+        const auto rc =
+            pread(fd, buf.data(), std::min<uint64_t>(len - off, buf.size()), off);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(error) << "pread(): " << strerror(errno);
+            return false;
+        }
+        if (rc == 0) {
+            LOG(error) << "File shrunk while checksumming";
+            return false;
+        }
+        sum->update({ buf.data(), static_cast<size_t>(rc) });
+        off += rc;
+    }
+    return true;
+}
+
+bool file_size(int fd, uint64_t* out)
+{
+    struct stat st;
+    if (fstat(fd, &st)) {
+        LOG(error) << "fstat(): " << strerror(errno);
+        return false;
+    }
+    *out = st.st_size;
+    return true;
+}
+
+// Send len bytes from file, starting at offset, adding them to the
+// checksum on the way. Not sendfile(), since then the data would have to
+// be read a second time to checksum it.
+bool send_range(int sock, int fd, uint64_t offset, uint64_t len, Adler32* sum)
+{
+    std::vector<char> buf(chunk_size);
+    while (len) {
+        const auto rc =
+            pread(fd, buf.data(), std::min<uint64_t>(len, buf.size()), offset);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(error) << "pread(): " << strerror(errno);
+            return false;
+        }
+        if (rc == 0) {
+            LOG(error) << "File shrunk while sending";
+            return false;
+        }
+        const std::string_view data{ buf.data(), static_cast<size_t>(rc) };
+        sum->update(data);
+        if (!write_all(sock, data)) {
+            return false;
+        }
+        offset += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+// Receive len bytes into file, starting at offset, adding them to the
+// checksum.
+bool recv_range(int sock, int fd, uint64_t offset, uint64_t len, Adler32* sum)
+{
+    std::vector<char> buf(chunk_size);
+    while (len) {
+        const auto rc = read(sock, buf.data(), std::min<uint64_t>(len, buf.size()));
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            LOG(error) << "Connection lost with " << len << " bytes left";
+            return false;
+        }
+        sum->update({ buf.data(), static_cast<size_t>(rc) });
+        for (ssize_t done = 0; done < rc;) {
+            const auto wrc = pwrite(fd, buf.data() + done, rc - done, offset);
+            if (wrc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG(error) << "pwrite(): " << strerror(errno);
+                return false;
+            }
+            done += wrc;
+            offset += wrc;
+        }
+        len -= rc;
+    }
+    return true;
+}
+
+std::string hex(uint32_t v)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08" PRIx32, v);
+    return buf;
+}
+
+void log_rate(const char* what,
+              const std::string& name,
+              uint64_t bytes,
+              std::chrono::steady_clock::time_point start)
+{
+    const double secs =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LOG(info).kv("file", name).kv("bytes", bytes)
+        << what << " in " << secs << "s, " << (secs > 0 ? bytes / secs : 0.0)
+        << " bytes/s";
+}
+
+std::string basename_of(const std::string& path)
+{
+    const auto pos = path.find_last_of('/');
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+bool serve_put(int sock, const std::string& dir, const std::string& name, uint64_t size)
+{
+    const auto final_path = dir + "/" + name;
+    const auto part_path = final_path + ".part";
+    FdCloser fd{ open(
+        part_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644) };
+    if (fd.fd < 0) {
+        LOG(error).kv("file", part_path) << "open(): " << strerror(errno);
+        send_line(sock, "ERR cannot create file");
+        return false;
+    }
+    uint64_t have;
+    Adler32 sum;
+    if (!file_size(fd.fd, &have)) {
+        return false;
+    }
+    have = std::min(have, size);
+    if (!checksum_file(fd.fd, have, &sum)) {
+        return false;
+    }
+    if (!send_line(sock, "OK " + std::to_string(have) + " " + hex(sum.value()))) {
+        return false;
+    }
+
+    std::istringstream args;
+    uint64_t from;
+    if (!expect(sock, "FROM", &args) || !(args >> from) || from > have) {
+        return false;
+    }
+    if (ftruncate(fd.fd, from)) {
+        LOG(error) << "ftruncate(): " << strerror(errno);
+        return false;
+    }
+    if (from) {
+        LOG(info).kv("file", name).kv("offset", from) << "Resuming upload";
+    }
+    if (from != have) {
+        sum = Adler32{};
+        if (!checksum_file(fd.fd, from, &sum)) {
+            return false;
+        }
+    }
+    const auto start = std::chrono::steady_clock::now();
+    if (!recv_range(sock, fd.fd, from, size - from, &sum)
+        || !send_line(sock, "DONE " + hex(sum.value()))) {
+        return false;
+    }
+    if (rename(part_path.c_str(), final_path.c_str())) {
+        LOG(error) << "rename(): " << strerror(errno);
+        return false;
+    }
+    log_rate("Received", name, size - from, start);
+    return true;
+}
+
+bool serve_get(int sock,
+               const std::string& dir,
+               const std::string& name,
+               uint64_t offset,
+               const std::string& their_sum)
+{
+    const auto path = dir + "/" + name;
+    FdCloser fd{ open(path.c_str(), O_RDONLY | O_CLOEXEC) };
+    if (fd.fd < 0) {
+        LOG(warning).kv("file", path) << "open(): " << strerror(errno);
+        send_line(sock, "ERR no such file");
+        return false;
+    }
+    uint64_t size;
+    Adler32 sum;
+    if (!file_size(fd.fd, &size)) {
+        return false;
+    }
+    if (offset > size) {
+        offset = 0;
+    } else if (offset) {
+        if (!checksum_file(fd.fd, offset, &sum)) {
+            return false;
+        }
+        if (hex(sum.value()) != their_sum) {
+            offset = 0;
+            sum = Adler32{};
+        }
+    }
+    if (!send_line(sock, "OK " + std::to_string(size) + " " + std::to_string(offset))) {
+        return false;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    if (!send_range(sock, fd.fd, offset, size - offset, &sum)
+        || !send_line(sock, "DONE " + hex(sum.value()))) {
+        return false;
+    }
+    log_rate("Sent", name, size - offset, start);
+    return true;
+}
+} // namespace
+
+void Adler32::update(std::string_view data)
+{
+    constexpr uint32_t mod = 65521;
+    // Largest n such that 255n(n+1)/2 + (n+1)(mod-1) fits in 32 bits.
+    constexpr size_t nmax = 5552;
+    while (!data.empty()) {
+        const auto n = std::min(data.size(), nmax);
+        for (size_t i = 0; i < n; i++) {
+            a_ += static_cast<uint8_t>(data[i]);
+            b_ += a_;
+        }
+        a_ %= mod;
+        b_ %= mod;
+        data.remove_prefix(n);
+    }
+}
+
+bool valid_transfer_name(const std::string& name)
+{
+    return !name.empty() && name.size() < 256 && name[0] != '.'
+           && name.find('/') == std::string::npos
+           && name.find('\0') == std::string::npos
+           && name.find(' ') == std::string::npos;
+}
+
+bool push_file(int sock, const std::string& path)
+{
+    const auto name = basename_of(path);
+    if (!valid_transfer_name(name)) {
+        LOG(error).kv("file", path) << "Invalid file name for transfer";
+        return false;
+    }
+    FdCloser fd{ open(path.c_str(), O_RDONLY | O_CLOEXEC) };
+    if (fd.fd < 0) {
+        LOG(error).kv("file", path) << "open(): " << strerror(errno);
+        return false;
+    }
+    uint64_t size;
+    if (!file_size(fd.fd, &size)) {
+        return false;
+    }
+    if (!send_line(sock, magic + " PUT " + name + " " + std::to_string(size))) {
+        return false;
+    }
+
+    // Resume if what the other side has matches.
+    std::istringstream args;
+    uint64_t have;
+    std::string their_sum;
+    if (!expect(sock, "OK", &args) || !(args >> have >> their_sum)) {
+        return false;
+    }
+    Adler32 sum;
+    if (have > size || !checksum_file(fd.fd, have, &sum)
+        || hex(sum.value()) != their_sum) {
+        have = 0;
+        sum = Adler32{};
+    }
+    if (have) {
+        LOG(info).kv("file", name).kv("offset", have) << "Resuming upload";
+    }
+    if (!send_line(sock, "FROM " + std::to_string(have))) {
+        return false;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    if (!send_range(sock, fd.fd, have, size - have, &sum)) {
+        return false;
+    }
+    if (!expect(sock, "DONE", &args) || !(args >> their_sum)) {
+        return false;
+    }
+    if (hex(sum.value()) != their_sum) {
+        LOG(error).kv("file", name) << "Checksum mismatch after upload";
+        return false;
+    }
+    log_rate("Sent", name, size - have, start);
+    return true;
+}
+
+bool pull_file(int sock, const std::string& name)
+{
+    if (!valid_transfer_name(name)) {
+        LOG(error).kv("file", name) << "Invalid file name for transfer";
+        return false;
+    }
+    const auto part_path = name + ".part";
+    FdCloser fd{ open(
+        part_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644) };
+    if (fd.fd < 0) {
+        LOG(error).kv("file", part_path) << "open(): " << strerror(errno);
+        return false;
+    }
+    uint64_t have;
+    Adler32 sum;
+    if (!file_size(fd.fd, &have) || !checksum_file(fd.fd, have, &sum)) {
+        return false;
+    }
+    if (!send_line(sock,
+                   magic + " GET " + name + " " + std::to_string(have) + " "
+                       + hex(sum.value()))) {
+        return false;
+    }
+
+    std::istringstream args;
+    uint64_t size;
+    uint64_t from;
+    if (!expect(sock, "OK", &args) || !(args >> size >> from) || from > size) {
+        return false;
+    }
+    if (ftruncate(fd.fd, from)) {
+        LOG(error) << "ftruncate(): " << strerror(errno);
+        return false;
+    }
+    if (from) {
+        LOG(info).kv("file", name).kv("offset", from) << "Resuming download";
+    }
+    if (from != have) {
+        sum = Adler32{};
+        if (!checksum_file(fd.fd, from, &sum)) {
+            return false;
+        }
+    }
+    const auto start = std::chrono::steady_clock::now();
+    if (!recv_range(sock, fd.fd, from, size - from, &sum)) {
+        return false;
+    }
+    std::string their_sum;
+    if (!expect(sock, "DONE", &args) || !(args >> their_sum)) {
+        return false;
+    }
+    if (hex(sum.value()) != their_sum) {
+        LOG(error).kv("file", name) << "Checksum mismatch after download";
+        return false;
+    }
+    if (rename(part_path.c_str(), name.c_str())) {
+        LOG(error) << "rename(): " << strerror(errno);
+        return false;
+    }
+    log_rate("Received", name, size - from, start);
+    return true;
+}
+
+bool serve_transfer(int sock, const std::string& dir)
+{
+    std::string line;
+    if (!read_line(sock, &line)) {
+        return false;
+    }
+    std::istringstream args(line);
+    std::string m;
+    std::string op;
+    std::string name;
+    args >> m >> op >> name;
+    if (m != magic) {
+        LOG(warning) << "Not a transfer request";
+        send_line(sock, "ERR not a transfer request");
+        return false;
+    }
+    if (!valid_transfer_name(name)) {
+        LOG(warning).kv("file", name) << "Rejected transfer of invalid file name";
+        send_line(sock, "ERR invalid file name");
+        return false;
+    }
+    if (op == "PUT") {
+        uint64_t size;
+        if (args >> size) {
+            return serve_put(sock, dir, name, size);
+        }
+    } else if (op == "GET") {
+        uint64_t offset;
+        std::string sum;
+        if (args >> offset >> sum) {
+            return serve_get(sock, dir, name, offset, sum);
+        }
+    }
+    send_line(sock, "ERR bad request");
+    return false;
+}
+
+} // namespace bthelper
@@ -0,0 +1,69 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Resumable file transfer straight over RFCOMM, without ssh.
+ *
+ * Control messages are single text lines, data is sent raw.
+ *
+ * Push:
+ *   C: BTXFER1 PUT <name> <size>
+ *   S: OK <offset> <adler32 of first offset bytes>   (offset: size of <name>.part)
+ *   C: FROM <offset>                                  (0 if checksum mismatch)
+ *   C: <size - offset bytes>
+ *   S: DONE <adler32 of whole file>
+ *
+ * Pull:
+ *   C: BTXFER1 GET <name> <offset> <adler32 of first offset bytes>
+ *   S: OK <size> <offset>                             (offset reset to 0 on mismatch)
+ *   S: <size - offset bytes>
+ *   S: DONE <adler32 of whole file>
+ *
+ * Either side may answer "ERR <message>" instead.
+ *
+ * Incomplete files are kept as <name>.part, and renamed when done.
+ */
+#ifndef __INCLUDE_TRANSFER_H__
+#define __INCLUDE_TRANSFER_H__
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace bthelper {
+
+class Adler32
+{
+public:
+    void update(std::string_view data);
+    uint32_t value() const { return (b_ << 16) | a_; }
+
+private:
+    uint32_t a_ = 1;
+    uint32_t b_ = 0;
+};
+
+// Plain file name, with no path components or leading dot.
+bool valid_transfer_name(const std::string& name);
+
+// Client side. Return true on success.
+bool push_file(int sock, const std::string& path);
+bool pull_file(int sock, const std::string& name);
+
+// Server side. Handles one request, with files restricted to dir.
+bool serve_transfer(int sock, const std::string& dir);
+
+} // namespace bthelper
+#endif
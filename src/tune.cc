@@ -0,0 +1,144 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "tune.h"
+#include "common.h"
+#include "log.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <cstring>
+
+namespace bthelper {
+
+namespace {
+// A function local static, since bt-listener picks the default profile
+// during its own static initialization.
+const std::vector<Profile>& profiles()
+{
+    // clang-format off
+    static const std::vector<Profile> ret = {
+        // Same as not tuning at all.
+        { .name = "default",
+          .nodelay = false,
+          .sndbuf = 0,
+          .rcvbuf = 0,
+          .read_mtus = 0,
+          .write_mtus = 0,
+          .adaptive_read = false,
+          .high_watermark = 128 * 1024,
+          .low_watermark = 32 * 1024 },
+
+        // Keystrokes and screen updates. Keep queues short so that nothing
+        // waits behind a backlog, and send as soon as there's anything.
+        { .name = "interactive",
+          .nodelay = true,
+          .sndbuf = 16 * 1024,
+          .rcvbuf = 16 * 1024,
+          .read_mtus = 1,
+          .write_mtus = 1,
+          .adaptive_read = true,
+          .high_watermark = 8 * 1024,
+          .low_watermark = 2 * 1024 },
+
+        // File copies. Large buffers, and large MTU-aligned writes.
+        { .name = "bulk",
+          .nodelay = false,
+          .sndbuf = 1024 * 1024,
+          .rcvbuf = 1024 * 1024,
+          .read_mtus = 64,
+          .write_mtus = 16,
+          .adaptive_read = true,
+          .high_watermark = 512 * 1024,
+          .low_watermark = 128 * 1024 },
+    };
+    // clang-format on
+    return ret;
+}
+
+void set_bufs(int sock, const Profile& p)
+{
+    if (p.sndbuf
+        && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &p.sndbuf, sizeof(p.sndbuf))) {
+        LOG(warning) << "setsockopt(SO_SNDBUF): " << strerror(errno);
+    }
+    if (p.rcvbuf
+        && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &p.rcvbuf, sizeof(p.rcvbuf))) {
+        LOG(warning) << "setsockopt(SO_RCVBUF): " << strerror(errno);
+    }
+}
+} // namespace
+
+const Profile* find_profile(const std::string& name)
+{
+    for (const auto& p : profiles()) {
+        if (p.name == name) {
+            return &p;
+        }
+    }
+    return nullptr;
+}
+
+std::vector<std::string> profile_names()
+{
+    std::vector<std::string> ret;
+    for (const auto& p : profiles()) {
+        ret.push_back(p.name);
+    }
+    return ret;
+}
+
+const Profile& default_profile() { return profiles()[0]; }
+
+size_t rfcomm_mtu(int sock)
+{
+    // Newer kernels answer BT_SNDMTU for L2CAP only, but try anyway in
+    // case RFCOMM gains it.
+    uint16_t mtu = 0;
+    socklen_t len = sizeof(mtu);
+    if (!getsockopt(sock, SOL_BLUETOOTH, BT_SNDMTU, &mtu, &len) && mtu) {
+        return mtu;
+    }
+    return RFCOMM_DEFAULT_MTU;
+}
+
+void tune_rfcomm(int sock, const Profile& p) { set_bufs(sock, p); }
+
+void tune_target(int sock, const Profile& p)
+{
+    set_bufs(sock, p);
+    const int one = 1;
+    if (p.nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+        LOG(warning) << "setsockopt(TCP_NODELAY): " << strerror(errno);
+    }
+}
+
+StreamOptions stream_options(const Profile& p, size_t mtu)
+{
+    StreamOptions ret;
+    ret.high_watermark = p.high_watermark;
+    ret.low_watermark = p.low_watermark;
+    ret.io_unit = mtu;
+    if (p.read_mtus) {
+        ret.read_size = p.read_mtus * mtu;
+    }
+    ret.write_size = p.write_mtus * mtu;
+    ret.adaptive_read = p.adaptive_read;
+    return ret;
+}
+
+} // namespace bthelper
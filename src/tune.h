@@ -0,0 +1,66 @@
+/*
+   Copyright 2022 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+/*
+ * Socket and I/O size tuning, per transport.
+ */
+#ifndef __INCLUDE_TUNE_H__
+#define __INCLUDE_TUNE_H__
+#include "shuffle.h"
+
+#include <string>
+#include <vector>
+
+namespace bthelper {
+
+struct Profile {
+    std::string name;
+
+    // Set TCP_NODELAY on the target side.
+    bool nodelay;
+
+    // SO_SNDBUF/SO_RCVBUF on all sockets. 0 leaves the kernel default.
+    int sndbuf;
+    int rcvbuf;
+
+    // Read and write sizes, in multiples of the RFCOMM MTU. 0 for
+    // read means use the default read size, and for write no limit.
+    size_t read_mtus;
+    size_t write_mtus;
+
+    // Size reads from FIONREAD.
+    bool adaptive_read;
+
+    size_t high_watermark;
+    size_t low_watermark;
+};
+
+// Look up profile by name. Returns nullptr if not found.
+const Profile* find_profile(const std::string& name);
+std::vector<std::string> profile_names();
+const Profile& default_profile();
+
+// MTU of a connected RFCOMM socket, or a conservative guess if the
+// kernel doesn't tell.
+size_t rfcomm_mtu(int sock);
+
+// Set socket options. Failures are reported but not fatal.
+void tune_rfcomm(int sock, const Profile& p);
+void tune_target(int sock, const Profile& p);
+
+StreamOptions stream_options(const Profile& p, size_t mtu);
+
+} // namespace bthelper
+#endif